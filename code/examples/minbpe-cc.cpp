@@ -33,6 +33,20 @@ std::vector<std::string> split_string(const std::string& str, const std::string&
     return tokens;
 }
 
+// Replaces the escapes \n, \t and \\ typed on the command line with the characters they stand for
+std::string unescape(const std::string& str) {
+    std::string result;
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] == '\\' && i + 1 < str.size()) {
+            char next = str[++i];
+            result += next == 'n' ? '\n' : next == 't' ? '\t' : next;
+        } else {
+            result += str[i];
+        }
+    }
+    return result;
+}
+
 expected<string,string> load_file_to_string(const path &path) {
   std::ifstream file(path);
   if(!file) {
@@ -88,6 +102,35 @@ expected<vector<MinBpeCC::Tokenizer::Token>,string> load_encoding(const path &pa
     return data;
 }
 
+// Saves where each document's tokens start in the encoding, one 64 bit offset per document
+// followed by the total number of tokens
+expected<void,string> save_offsets(const path &path, const vector<size_t> &offsets) {
+  std::ofstream file(path, std::ios::binary);
+  if(!file) {
+    std::error_code ec(errno, std::generic_category());
+    return unexpected(ec.message());
+  }
+  for (auto offset : offsets) {
+    uint64_t value = offset;
+    file.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  return {};
+}
+
+expected<vector<size_t>,string> load_offsets(const path &path) {
+  std::ifstream file(path, ios::binary);
+  if (!file.is_open()) {
+    std::error_code ec(errno, std::generic_category());
+    return unexpected(ec.message());
+  }
+  vector<size_t> offsets;
+  uint64_t value;
+  while(file.read(reinterpret_cast<char *>(&value), sizeof(value))) {
+    offsets.push_back(value);
+  }
+  return offsets;
+}
+
 // Command line training, encoding and decoding
 int main(int argc, char *argv[]) {
   CLI::App app{"Training, encoding and decoding of tokens"};
@@ -130,11 +173,39 @@ int main(int argc, char *argv[]) {
   app.add_option("-c,--conflict-resolution", conflict_resolution_str, "Conflict resolution strategy: 'first' or 'lexical'")
     ->check(CLI::IsMember({"first", "lexical"}));
 
+  std::string pair_count_store_str = "boost";  // Default value
+  app.add_option("-p,--pair-count-store", pair_count_store_str, "Pair count store used for training: 'boost' or 'flat'")
+    ->check(CLI::IsMember({"boost", "flat"}));
+
+  size_t threads = 1;
+  app.add_option("-j,--threads", threads, "Number of threads used to split and encode the input, to count and merge pairs when training, and to encode or decode documents");
+
+  size_t encode_cache_size = 1 << 16;
+  app.add_option("--encode-cache-size", encode_cache_size, "Number of distinct chunks whose tokens are kept when encoding, 0 to turn the cache off");
+
+  string document_separator;
+  app.add_option("--document-separator", document_separator, "Encode or decode the input as independent documents separated by this string (\\n for a newline), spread over the threads. Encoding writes where each document starts to <output>.offsets, which decoding reads back from <input>.offsets");
+
+  std::string invalid_utf8_str = "raw";  // Default value
+  app.add_option("--invalid-utf8", invalid_utf8_str, "What to do with input that is not valid UTF-8: 'reject' it, 'replace' each invalid sequence with U+FFFD, or keep the bytes 'raw'")
+    ->check(CLI::IsMember({"reject", "replace", "raw"}));
+
+  std::string model_format_str = "text";  // Default value
+  app.add_option("--model-format", model_format_str, "Format models are saved in by training and --convert: 'text' (minbpe v1) or 'binary', which loading maps into memory and uses without parsing. Either format is read when loading")
+    ->check(CLI::IsMember({"text", "binary"}));
+
+  bool convert = false;
+  app.add_flag("--convert", convert, "Load the model given as the input and save it to the output in --model-format");
+
+  bool stream = false;
+  app.add_flag("--stream", stream, "Encode or decode in blocks as the input is read, so memory use stays the same however large it is. Encoding can only cut a block after a special token, or for gpt2 and gpt4 between lines or words, and holds text without such a place in memory. Pass - as the input or output to read from stdin or write to stdout");
+
   CLI11_PARSE(app, argc, argv);
+  document_separator = unescape(document_separator);
 
   auto input_fspath = path(input_path);
   if(!input_path.empty()) {
-    if(!exists(input_fspath)) {
+    if(!(stream && input_path == "-") && !exists(input_fspath)) {
       cerr << "Input file " << input_path << " does not exist\n";
       return -1;
     }
@@ -176,7 +247,16 @@ int main(int argc, char *argv[]) {
     return -1;
   }
 
+  auto model_format = model_format_str == "binary" ? Tokenizer::MODEL_FORMAT::BINARY : Tokenizer::MODEL_FORMAT::TEXT;
+
   auto rt = Tokenizer(split_pattern);
+  rt.set_threads(threads);
+  rt.set_encode_cache_size(encode_cache_size);
+  if(invalid_utf8_str == "reject") {
+    rt.set_invalid_utf8(MinBpeCC::Util::InvalidUtf8::Reject);
+  } else if(invalid_utf8_str == "replace") {
+    rt.set_invalid_utf8(MinBpeCC::Util::InvalidUtf8::Replace);
+  }
 
   if(train) {
     if(special_tokens_data.has_value()) {
@@ -203,12 +283,88 @@ int main(int argc, char *argv[]) {
       } else {
         conflict_resolution = MinBpeCC::Tokenizer::Tokenizer::CONFLICT_RESOLUTION::LEXICAL;
       }
-      rt.train(input.value(), vocab_size, conflict_resolution, verbose);
-      rt.save(model_fspath, write_vocab);
+      if (pair_count_store_str == "flat") {
+        rt.set_pair_count_store(MinBpeCC::Tokenizer::Tokenizer::PAIR_COUNT_STORE::FLAT);
+      }
+      try {
+        rt.train(input.value(), vocab_size, conflict_resolution, verbose);
+      } catch(const std::exception &e) {
+        cerr << "Failed with error: " << e.what() << "\n";
+        return -1;
+      }
+      rt.save(model_fspath, write_vocab, model_format);
     } else { 
        cerr << "Failed to load training input file: " << input.error() << "\n";
     }
   }
+  else if((encode || decode) && stream) {
+    // Tokens may be going to stdout, so everything else goes to stderr
+    auto model_fspath = path(model_path);
+    if(output_path.empty()) {
+      cerr << "Output file not specified\n";
+      return -1;
+    }
+    if(!exists(model_fspath)) {
+      cerr << "Model file " << model_path << " does not exist\n";
+      return -1;
+    }
+    if(!rt.load(model_fspath, false)) {
+      return -1;
+    }
+
+    std::ifstream input_file;
+    std::istream *in = &std::cin;
+    if(input_path != "-") {
+      input_file.open(input_fspath, std::ios::binary);
+      if(!input_file) {
+        std::error_code ec(errno, std::generic_category());
+        cerr << "Failed to open " << input_path << ": " << ec.message() << "\n";
+        return -1;
+      }
+      in = &input_file;
+    }
+    std::ofstream output_file;
+    std::ostream *out = &std::cout;
+    if(output_path != "-") {
+      output_file.open(output_path, std::ios::binary);
+      if(!output_file) {
+        std::error_code ec(errno, std::generic_category());
+        cerr << "Failed to open " << output_path << ": " << ec.message() << "\n";
+        return -1;
+      }
+      out = &output_file;
+    }
+
+    size_t count = 0;
+    try {
+      if(encode) {
+        rt.encode_stream(*in, [&](std::span<const MinBpeCC::Tokenizer::Token> tokens) {
+          out->write(reinterpret_cast<const char *>(tokens.data()), tokens.size_bytes());
+          count += tokens.size();
+        });
+      } else {
+        // Tokens decode independently of each other, so a block of them can be decoded at a time
+        const size_t block_tokens = 1 << 18;
+        vector<MinBpeCC::Tokenizer::Token> tokens;
+        do {
+          tokens.resize(block_tokens);
+          in->read(reinterpret_cast<char *>(tokens.data()), tokens.size() * sizeof(MinBpeCC::Tokenizer::Token));
+          tokens.resize(in->gcount() / sizeof(MinBpeCC::Tokenizer::Token));
+          *out << rt.decode(tokens, false);
+          count += tokens.size();
+        } while(*in);
+      }
+    } catch(const std::exception &e) {
+      cerr << "Failed with error: " << e.what() << "\n";
+      return -1;
+    }
+    out->flush();
+    if(!*out) {
+      cerr << "Failed to write " << output_path << "\n";
+      return -1;
+    }
+    cerr << (encode ? "Encoded " : "Decoded ") << count << " tokens\n";
+  }
   else if(encode) {
     auto model_fspath = path(model_path);
     auto output_fspath = path(output_path);
@@ -226,8 +382,34 @@ int main(int argc, char *argv[]) {
     cout << "Encoding input file " << input_fspath << " encoder " << encoder << " model path " << model_path << " output to " << output_path << "\n";
     rt.load(model_fspath, verbose);
     auto input = load_file_to_string(input_fspath);
-    if(input.has_value()) {
-      auto encoded = rt.encode(input.value(), verbose);
+    if(input.has_value() && !document_separator.empty()) {
+      auto documents = split_string(input.value(), document_separator);
+      EncodedBatch batch;
+      try {
+        batch = rt.encode_batch_flat(documents);
+      } catch(const std::exception &e) {
+        cerr << "Failed with error: " << e.what() << "\n";
+        return -1;
+      }
+
+      cout << "Writing " << batch.tokens.size() << " encoded tokens from " << documents.size() << " documents\n";
+      auto result = save_encoding(output_fspath, batch.tokens);
+      if(result.has_value()) {
+        result = save_offsets(output_fspath.string() + ".offsets", batch.offsets);
+      }
+      if(result.has_value()) {
+        cout << "Success\n";
+      } else {
+        cerr << "Failed with error: " << result.error() << "\n";
+      }
+    } else if(input.has_value()) {
+      vector<MinBpeCC::Tokenizer::Token> encoded;
+      try {
+        encoded = rt.encode(input.value(), verbose);
+      } catch(const std::exception &e) {
+        cerr << "Failed with error: " << e.what() << "\n";
+        return -1;
+      }
 
       cout << "Writing " << encoded.size() << " encoded tokens\n";
       auto result = save_encoding(output_fspath, encoded);
@@ -247,7 +429,28 @@ int main(int argc, char *argv[]) {
     cout << "Decoding input file " << input_fspath << " encoder " << encoder << " model path " << model_path << " output to " << output_path << "\n";
     rt.load(model_fspath, verbose);
     auto input = load_encoding(input_fspath);
-    if(input.has_value()) {
+    if(input.has_value() && !document_separator.empty()) {
+      auto offsets = load_offsets(input_fspath.string() + ".offsets");
+      EncodedBatch batch;
+      if(offsets.has_value()) {
+        batch = EncodedBatch{std::move(input.value()), std::move(offsets.value())};
+      }
+      if(!batch.is_valid()) {
+        cerr << "Failed to load document offsets from " << input_path << ".offsets\n";
+        return -1;
+      }
+      auto documents = rt.decode_batch(batch);
+      string decoded;
+      for(size_t i = 0; i < documents.size(); i++) {
+        if(i > 0) {
+          decoded += document_separator;
+        }
+        decoded += documents[i];
+      }
+
+      cout << "Writing " << documents.size() << " decoded documents to " << output_path << "\n";
+      auto result = write_string_to_file(output_fspath, decoded);
+    } else if(input.has_value()) {
       auto decoded = rt.decode(input.value(), verbose);
 
       cout << "Writing " << decoded.size() << " decoded tokens to " << output_path << "\n";
@@ -257,9 +460,20 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  else if(convert) {
+    if(output_path.empty()) {
+      cerr << "Output file not specified\n";
+      return -1;
+    }
+    cout << "Converting model " << input_path << " to a " << model_format_str << " model in " << output_path << "\n";
+    if(!rt.load(input_fspath, verbose) || !rt.save(path(output_path), write_vocab, model_format)) {
+      return -1;
+    }
+  }
+
   auto t2 = high_resolution_clock::now(); // Record end time
   auto duration = t2 - t1;
   auto ms_int = duration_cast<milliseconds>(duration).count();
 
-  std::cout << "Execution time: " << ms_int / 1000.0 << " (s)" << std::endl;
+  (stream ? std::cerr : std::cout) << "Execution time: " << ms_int / 1000.0 << " (s)" << std::endl;
 }
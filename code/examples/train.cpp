@@ -72,6 +72,10 @@ int main(int argc, char *argv[]) {
   app.add_option("-c,--conflict-resolution", conflict_resolution_str, "Conflict resolution strategy: 'first' or 'lexical'")
      ->check(CLI::IsMember({"first", "lexical"}));
 
+  std::string pair_count_store_str = "boost"; // Default value
+  app.add_option("-p,--pair-count-store", pair_count_store_str, "Pair count store used for training: 'boost' or 'flat'")
+     ->check(CLI::IsMember({"boost", "flat"}));
+
   CLI11_PARSE(app, argc, argv);
 
   long num_elements = sizeof(test_strings) / sizeof(test_strings[0]);
@@ -93,10 +97,14 @@ int main(int argc, char *argv[]) {
     conflict_resolution = MinBpeCC::Tokenizer::Tokenizer::CONFLICT_RESOLUTION::LEXICAL;
   }
 
+  auto pair_count_store = pair_count_store_str == "flat" ? Tokenizer::PAIR_COUNT_STORE::FLAT : Tokenizer::PAIR_COUNT_STORE::BOOST;
+
   Tokenizer bt;
+  bt.set_pair_count_store(pair_count_store);
   bt.train(input, num_tokens, conflict_resolution, verbose);
 
   Tokenizer rt(Tokenizer::GPT4_SPLIT_PATTERN);
+  rt.set_pair_count_store(pair_count_store);
   rt.train(input, num_tokens, conflict_resolution, verbose);
 
   auto t2 = high_resolution_clock::now(); // Record end time
@@ -0,0 +1,350 @@
+#ifndef MINBPE_BYTEKERNELS_HPP
+#define MINBPE_BYTEKERNELS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "UnicodeRanges.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MINBPE_BYTE_KERNELS_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace MinBpeCC::Util {
+
+// The instruction sets the byte kernels have versions for
+enum class SimdLevel {
+    Scalar,
+    SSE2,
+    AVX2,
+    NEON
+};
+
+// Kernels that work on runs of bytes, in the version for one instruction set
+struct ByteKernelTable {
+    SimdLevel level;
+    // Writes each of the size bytes at text to out as an unsigned value
+    void (*widen_to_16)(const char *text, size_t size, uint16_t *out);
+    void (*widen_to_32)(const char *text, size_t size, uint32_t *out);
+    // The number of bytes at text before the first that is not ASCII
+    size_t (*ascii_prefix_length)(const char *text, size_t size);
+};
+
+namespace ByteSimd {
+
+    template<typename T>
+    inline void widen_scalar(const char *text, size_t size, T *out) {
+        for(size_t i = 0; i < size; i++) {
+            out[i] = static_cast<uint8_t>(text[i]);
+        }
+    }
+
+    // Eight bytes at a time, testing their high bits together
+    inline size_t ascii_prefix_length_scalar(const char *text, size_t size) {
+        size_t i = 0;
+        for(; i + 8 <= size; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, text + i, 8);
+            if(word & 0x8080808080808080ull) {
+                break;
+            }
+        }
+        while(i < size && static_cast<uint8_t>(text[i]) < 0x80) {
+            i++;
+        }
+        return i;
+    }
+
+    inline constexpr ByteKernelTable scalar_kernels{SimdLevel::Scalar, widen_scalar<uint16_t>, widen_scalar<uint32_t>,
+          ascii_prefix_length_scalar};
+
+#if defined(MINBPE_BYTE_KERNELS_X86)
+    // SSE2 is part of x86-64, so these need no check before they are used
+
+    inline void widen_to_16_sse2(const char *text, size_t size, uint16_t *out) {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi8(bytes, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 8), _mm_unpackhi_epi8(bytes, zero));
+        }
+        widen_scalar(text + i, size - i, out + i);
+    }
+
+    inline void widen_to_32_sse2(const char *text, size_t size, uint32_t *out) {
+        const __m128i zero = _mm_setzero_si128();
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_unpacklo_epi16(low, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 4), _mm_unpackhi_epi16(low, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 8), _mm_unpacklo_epi16(high, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 12), _mm_unpackhi_epi16(high, zero));
+        }
+        widen_scalar(text + i, size - i, out + i);
+    }
+
+    inline size_t ascii_prefix_length_sse2(const char *text, size_t size) {
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            int high_bits = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i)));
+            if(high_bits != 0) {
+                return i + __builtin_ctz(high_bits);
+            }
+        }
+        return i + ascii_prefix_length_scalar(text + i, size - i);
+    }
+
+    inline constexpr ByteKernelTable sse2_kernels{SimdLevel::SSE2, widen_to_16_sse2, widen_to_32_sse2,
+          ascii_prefix_length_sse2};
+
+    // Compiled for AVX2 whatever the flags, and only called once the CPU is known to have it
+
+    __attribute__((target("avx2"))) inline void widen_to_16_avx2(const char *text, size_t size, uint16_t *out) {
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_cvtepu8_epi16(bytes));
+        }
+        widen_scalar(text + i, size - i, out + i);
+    }
+
+    __attribute__((target("avx2"))) inline void widen_to_32_avx2(const char *text, size_t size, uint32_t *out) {
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_cvtepu8_epi32(bytes));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 8),
+                  _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)));
+        }
+        widen_scalar(text + i, size - i, out + i);
+    }
+
+    __attribute__((target("avx2"))) inline size_t ascii_prefix_length_avx2(const char *text, size_t size) {
+        size_t i = 0;
+        for(; i + 32 <= size; i += 32) {
+            auto high_bits = static_cast<uint32_t>(
+                  _mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(text + i))));
+            if(high_bits != 0) {
+                return i + __builtin_ctz(high_bits);
+            }
+        }
+        return i + ascii_prefix_length_sse2(text + i, size - i);
+    }
+
+    inline constexpr ByteKernelTable avx2_kernels{SimdLevel::AVX2, widen_to_16_avx2, widen_to_32_avx2,
+          ascii_prefix_length_avx2};
+
+    // A mask of the bytes in [low, low + count), the unsigned range moved to the bottom of the
+    // signed one so a signed compare can test it
+    inline __m128i in_range(__m128i bytes, uint8_t low, uint8_t count) {
+        __m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8(static_cast<char>(0x80 - low)));
+        return _mm_cmplt_epi8(shifted, _mm_set1_epi8(static_cast<char>(0x80 + count)));
+    }
+
+    inline uint32_t ascii_class_mask(const char *text, CharClass char_class) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text));
+        __m128i letter = in_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 26);
+        __m128i number = in_range(bytes, '0', 10);
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')), in_range(bytes, '\t', 5));
+        __m128i mask;
+        switch(char_class) {
+            case CharClass::Letter:
+                mask = letter;
+                break;
+            case CharClass::Number:
+                mask = number;
+                break;
+            case CharClass::Space:
+                mask = space;
+                break;
+            default:
+                // ASCII, so the high bit is clear, and in none of the other classes
+                mask = _mm_andnot_si128(_mm_or_si128(_mm_or_si128(letter, number), _mm_or_si128(space, bytes)),
+                      _mm_set1_epi8(static_cast<char>(0x80)));
+                break;
+        }
+        return static_cast<uint32_t>(_mm_movemask_epi8(mask));
+    }
+
+#elif defined(__ARM_NEON)
+
+    inline void widen_to_16_neon(const char *text, size_t size, uint16_t *out) {
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(text + i));
+            vst1q_u16(out + i, vmovl_u8(vget_low_u8(bytes)));
+            vst1q_u16(out + i + 8, vmovl_high_u8(bytes));
+        }
+        widen_scalar(text + i, size - i, out + i);
+    }
+
+    inline void widen_to_32_neon(const char *text, size_t size, uint32_t *out) {
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(text + i));
+            uint16x8_t low = vmovl_u8(vget_low_u8(bytes));
+            uint16x8_t high = vmovl_high_u8(bytes);
+            vst1q_u32(out + i, vmovl_u16(vget_low_u16(low)));
+            vst1q_u32(out + i + 4, vmovl_high_u16(low));
+            vst1q_u32(out + i + 8, vmovl_u16(vget_low_u16(high)));
+            vst1q_u32(out + i + 12, vmovl_high_u16(high));
+        }
+        widen_scalar(text + i, size - i, out + i);
+    }
+
+    inline size_t ascii_prefix_length_neon(const char *text, size_t size) {
+        size_t i = 0;
+        for(; i + 16 <= size; i += 16) {
+            if(vmaxvq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(text + i))) >= 0x80) {
+                break;
+            }
+        }
+        return i + ascii_prefix_length_scalar(text + i, size - i);
+    }
+
+    inline constexpr ByteKernelTable neon_kernels{SimdLevel::NEON, widen_to_16_neon, widen_to_32_neon,
+          ascii_prefix_length_neon};
+
+    inline uint32_t ascii_class_mask(const char *text, CharClass char_class) {
+        uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t *>(text));
+        auto in_range = [](uint8x16_t v, uint8_t low, uint8_t count) {
+            return vcltq_u8(vsubq_u8(v, vdupq_n_u8(low)), vdupq_n_u8(count));
+        };
+        uint8x16_t letter = in_range(vorrq_u8(bytes, vdupq_n_u8(0x20)), 'a', 26);
+        uint8x16_t number = in_range(bytes, '0', 10);
+        uint8x16_t space = vorrq_u8(vceqq_u8(bytes, vdupq_n_u8(' ')), in_range(bytes, '\t', 5));
+        uint8x16_t mask;
+        switch(char_class) {
+            case CharClass::Letter:
+                mask = letter;
+                break;
+            case CharClass::Number:
+                mask = number;
+                break;
+            case CharClass::Space:
+                mask = space;
+                break;
+            default:
+                mask = vandq_u8(vcltq_u8(bytes, vdupq_n_u8(0x80)), vmvnq_u8(vorrq_u8(vorrq_u8(letter, number), space)));
+                break;
+        }
+        // One bit per byte, the weights summed across each half
+        static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+        uint8x16_t bits = vandq_u8(mask, vld1q_u8(weights));
+        return vaddv_u8(vget_low_u8(bits)) | (static_cast<uint32_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+    }
+
+#else
+
+    inline uint32_t ascii_class_mask(const char *text, CharClass char_class) {
+        uint32_t mask = 0;
+        for(int i = 0; i < 16; i++) {
+            auto c = static_cast<uint8_t>(text[i]);
+            CharClass byte_class = CharClass::Other;
+            if(c >= 0x80) {
+                continue;
+            }
+            if((c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+                byte_class = CharClass::Letter;
+            } else if(c >= '0' && c <= '9') {
+                byte_class = CharClass::Number;
+            } else if(c == ' ' || (c >= '\t' && c <= '\r')) {
+                byte_class = CharClass::Space;
+            }
+            if(byte_class == char_class) {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+    }
+
+#endif
+
+    inline SimdLevel detect_simd_level() {
+#if defined(MINBPE_BYTE_KERNELS_X86)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+#elif defined(__ARM_NEON)
+        return SimdLevel::NEON;
+#else
+        return SimdLevel::Scalar;
+#endif
+    }
+
+} // namespace ByteSimd
+
+/**
+ * @brief The best instruction set the byte kernels can use on this CPU, found once.
+ */
+inline SimdLevel simd_level() {
+    static const SimdLevel level = ByteSimd::detect_simd_level();
+    return level;
+}
+
+/**
+ * @brief The byte kernels for an instruction set, which must be simd_level() or one it
+ * includes; Scalar is always available. Without a level, those for simd_level().
+ */
+inline const ByteKernelTable &byte_kernels(SimdLevel level) {
+    switch(level) {
+#if defined(MINBPE_BYTE_KERNELS_X86)
+        case SimdLevel::AVX2:
+            return ByteSimd::avx2_kernels;
+        case SimdLevel::SSE2:
+            return ByteSimd::sse2_kernels;
+#elif defined(__ARM_NEON)
+        case SimdLevel::NEON:
+            return ByteSimd::neon_kernels;
+#endif
+        default:
+            return ByteSimd::scalar_kernels;
+    }
+}
+
+inline const ByteKernelTable &byte_kernels() {
+    static const ByteKernelTable &kernels = byte_kernels(simd_level());
+    return kernels;
+}
+
+/**
+ * @brief Writes the bytes of text to out as unsigned tokens, 16 or more at a time.
+ * @param out Room for text.size() values.
+ */
+inline void widen_bytes(std::string_view text, uint16_t *out) {
+    byte_kernels().widen_to_16(text.data(), text.size(), out);
+}
+
+inline void widen_bytes(std::string_view text, uint32_t *out) {
+    byte_kernels().widen_to_32(text.data(), text.size(), out);
+}
+
+/**
+ * @brief The length of the run of ASCII bytes text starts with.
+ */
+inline size_t ascii_prefix_length(std::string_view text) {
+    return byte_kernels().ascii_prefix_length(text.data(), text.size());
+}
+
+/**
+ * @brief A mask with bit i set when byte i of the 16 at text is an ASCII character of
+ * char_class, as PreTokenizer classes them. Bytes that are not ASCII are in no class.
+ *
+ * This is called once for every run of characters the pre-tokenizer scans, which is mostly a
+ * few bytes long, so it is inline and uses the instructions every CPU of the architecture has
+ * rather than going through byte_kernels().
+ */
+inline uint32_t ascii_class_mask(const char *text, CharClass char_class) {
+    return ByteSimd::ascii_class_mask(text, char_class);
+}
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_BYTEKERNELS_HPP
@@ -0,0 +1,113 @@
+#ifndef MINBPE_FLATARRAY_HPP
+#define MINBPE_FLATARRAY_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace MinBpeCC::Util {
+
+/**
+ * @class FlatArray
+ * @brief A read only array that either owns its elements or views ones held elsewhere, such
+ * as in a memory mapped model file, so the same code can use tables that were built in
+ * memory and tables that were loaded without copying them.
+ *
+ * A view does not keep what it points at alive; whoever makes one keeps the memory too.
+ */
+template<typename T>
+class FlatArray {
+private:
+    std::vector<T> owned;
+    std::span<const T> items;
+
+public:
+    FlatArray() = default;
+
+    explicit FlatArray(std::vector<T> elements) : owned(std::move(elements)), items(owned) {
+    }
+
+    explicit FlatArray(std::span<const T> view) : items(view) {
+    }
+
+    // Copying would leave the copy viewing the original's elements
+    FlatArray(const FlatArray &) = delete;
+    FlatArray &operator=(const FlatArray &) = delete;
+
+    // A moved vector keeps its buffer, so the span stays valid
+    FlatArray(FlatArray &&) = default;
+    FlatArray &operator=(FlatArray &&) = default;
+
+    const T &operator[](size_t i) const {
+        return items[i];
+    }
+
+    size_t size() const {
+        return items.size();
+    }
+
+    bool empty() const {
+        return items.empty();
+    }
+
+    const T *data() const {
+        return items.data();
+    }
+
+    std::span<const T> span() const {
+        return items;
+    }
+
+    auto begin() const {
+        return items.begin();
+    }
+
+    auto end() const {
+        return items.end();
+    }
+};
+
+/**
+ * @brief Hashes bytes eight at a time. Unlike std::hash the result is the same for every
+ * build and run, which tables that are saved to a file and loaded again depend on.
+ */
+inline uint64_t hash_bytes(std::string_view bytes) {
+    auto mix = [](uint64_t h) {
+        h ^= h >> 32;
+        h *= 0xD6E8FEB86659FD93ull;
+        h ^= h >> 32;
+        return h;
+    };
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ bytes.size();
+    size_t i = 0;
+    for(; i + 8 <= bytes.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, 8);
+        h = mix(h ^ word);
+    }
+    uint64_t last = 0;
+    std::memcpy(&last, bytes.data() + i, bytes.size() - i);
+    return mix(h ^ last);
+}
+
+/**
+ * @brief Packs both tokens of a pair into one 64 bit key, the first in the high half. The
+ * pair tables used in training and the merge table saved in model files all key on this.
+ */
+inline uint64_t pack_pair(uint32_t a, uint32_t b) {
+    return (static_cast<uint64_t>(a) << 32) | b;
+}
+
+/**
+ * @brief Fibonacci hashing of a packed pair, which spreads the pairs over a power of two
+ * sized table when masked. Saved merge tables depend on it staying the same.
+ */
+inline uint64_t hash_pair(uint64_t pair) {
+    return (pair * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_FLATARRAY_HPP
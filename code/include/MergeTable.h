@@ -0,0 +1,129 @@
+#ifndef MINBPE_MERGETABLE_HPP
+#define MINBPE_MERGETABLE_HPP
+
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "FlatArray.h"
+
+namespace MinBpeCC::Util {
+
+/**
+ * @class MergeTable
+ * @brief The token each merged pair became, in a flat open addressing hash table.
+ *
+ * The table is an array of fixed size slots with no pointers, so a table that was saved can
+ * be used straight from the file. It is at most half full, and a pair's slot is found by
+ * multiplicative hashing and linear probing, which is usually one cache line.
+ */
+template<typename T>
+class MergeTable {
+public:
+    struct Slot {
+        uint64_t pair;  // Both tokens, as pack_pair gives them, or empty
+        uint32_t token;
+        uint32_t unused;
+    };
+
+private:
+    static constexpr uint64_t empty_pair = std::numeric_limits<uint64_t>::max();
+
+    FlatArray<Slot> slots;
+    uint64_t mask = 0;
+
+    static uint64_t pack(T a, T b) {
+        return pack_pair(static_cast<uint32_t>(a), static_cast<uint32_t>(b));
+    }
+
+    size_t home(uint64_t pair) const {
+        return static_cast<size_t>(hash_pair(pair) & mask);
+    }
+
+public:
+    MergeTable() = default;
+
+    /**
+     * @brief Builds the table for merges in order, the first making token first_token.
+     */
+    void build(std::span<const std::pair<T,T>> merges, T first_token) {
+        size_t capacity = 2;
+        while(capacity < merges.size() * 2) {
+            capacity *= 2;
+        }
+        mask = capacity - 1;
+        std::vector<Slot> built(capacity, Slot{empty_pair, 0, 0});
+        auto token = static_cast<uint32_t>(first_token);
+        for(const auto &[a, b] : merges) {
+            auto pair = pack(a, b);
+            auto i = home(pair);
+            while(built[i].pair != empty_pair && built[i].pair != pair) {
+                i = (i + 1) & mask;
+            }
+            // A pair listed twice in a loaded model merges to its last token, as minbpe's
+            // loader has it
+            built[i] = Slot{pair, token, 0};
+            token++;
+        }
+        slots = FlatArray<Slot>(std::move(built));
+    }
+
+    /**
+     * @brief Uses slots saved from the table built for merges without copying them.
+     * @return false if there are not a power of two of them, none is empty to end a search,
+     * or one holds a token that is not among the merges or was not merged from its pair.
+     */
+    bool view(std::span<const Slot> saved, std::span<const std::pair<T,T>> merges, T first_token) {
+        if(saved.size() < 2 || (saved.size() & (saved.size() - 1)) != 0) {
+            return false;
+        }
+        bool has_empty = false;
+        for(const auto &slot : saved) {
+            if(slot.pair == empty_pair) {
+                has_empty = true;
+                continue;
+            }
+            auto index = static_cast<uint64_t>(slot.token) - static_cast<uint64_t>(first_token);
+            if(slot.token < static_cast<uint32_t>(first_token) || index >= merges.size() ||
+                  pack(merges[index].first, merges[index].second) != slot.pair) {
+                return false;
+            }
+        }
+        if(!has_empty) {
+            return false;
+        }
+        slots = FlatArray<Slot>(saved);
+        mask = saved.size() - 1;
+        return true;
+    }
+
+    std::span<const Slot> get_slots() const {
+        return slots.span();
+    }
+
+    /**
+     * @brief The token a and b were merged into, if they were.
+     */
+    std::optional<T> find(T a, T b) const {
+        if(slots.empty()) {
+            return std::nullopt;
+        }
+        auto pair = pack(a, b);
+        for(auto i = home(pair);; i = (i + 1) & mask) {
+            const auto &slot = slots[i];
+            if(slot.pair == pair) {
+                return static_cast<T>(slot.token);
+            }
+            if(slot.pair == empty_pair) {
+                return std::nullopt;
+            }
+        }
+    }
+};
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_MERGETABLE_HPP
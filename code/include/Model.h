@@ -0,0 +1,1338 @@
+#ifndef MINBPE_MODEL_HPP
+#define MINBPE_MODEL_HPP
+
+#include <algorithm>
+#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+#include <iostream>
+#include <utility>
+#include <optional>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <cctype>
+#include <future>
+#include <istream>
+#include <filesystem>
+#include <map>
+
+#ifndef PCRE2_CODE_UNIT_WIDTH
+#define PCRE2_CODE_UNIT_WIDTH 8
+#endif
+#include <pcre2.h>
+
+#include "ByteKernels.h"
+#include "FlatArray.h"
+#include "MergeTable.h"
+#include "ModelFile.h"
+#include "PreTokenizer.h"
+#include "SpecialTokenScanner.h"
+#include "Utf8.h"
+#include "VocabAutomaton.h"
+#include "WorkStealingPool.h"
+
+namespace MinBpeCC::Tokenizer {
+    using Token = uint32_t; // Here it is safe to change to uint16_t and other types as needed,
+                            // but be sure to not have any special tokens that exceed the range.
+    using TokenPair = std::pair<Token, Token>;
+
+    inline const std::string GPT2_SPLIT_PATTERN = "'(?:[sdmt]|ll|ve|re)| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+";
+    inline const std::string GPT4_SPLIT_PATTERN = "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+";
+
+    using Util::pack_pair;
+
+    // Hash function for std::pair<int,int>
+    inline std::function<std::size_t(const TokenPair&)> pair_token_hash =
+        [](const TokenPair& k) -> std::size_t {
+            std::size_t seed = 0;
+            std::hash<Token> hasher;
+            seed ^= hasher(std::get<0>(k)) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            seed ^= hasher(std::get<1>(k)) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+            return seed;
+    };
+
+    // Helper to convert char to int, handling negative char values
+    inline Token char_to_token(char c) {
+        return c < 0 ? c + 256 : c;
+    }
+
+    // Converts text to byte tokens
+    inline std::vector<Token> text_to_vector(std::string_view text) {
+        std::vector<Token> text_converted(text.length());
+        MinBpeCC::Util::widen_bytes(text, text_converted.data());
+        return text_converted;
+    }
+
+    // Hashes strings and views alike, so lookups keyed on strings can be searched with a view
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    // Frees each kind of PCRE2 object, so they can be held in a std::unique_ptr
+    struct Pcre2Free {
+        void operator()(pcre2_code_8 *code) const { pcre2_code_free_8(code); }
+        void operator()(pcre2_match_data_8 *match_data) const { pcre2_match_data_free_8(match_data); }
+        void operator()(pcre2_match_context_8 *context) const { pcre2_match_context_free_8(context); }
+        void operator()(pcre2_jit_stack_8 *stack) const { pcre2_jit_stack_free_8(stack); }
+    };
+
+    /**
+     * @class Matcher
+     * @brief What one thread needs to run a compiled pattern.
+     *
+     * A compiled pattern can be matched from any number of threads at once, but the match data
+     * that receives the results cannot be shared, and neither can the JIT stack the match
+     * context points at. Each thread matching a pattern gets its own Matcher.
+     */
+    class Matcher {
+    private:
+        static const size_t jit_stack_start_size = 32 * 1024;
+        static const size_t jit_stack_max_size = 1024 * 1024;
+
+        std::unique_ptr<pcre2_match_context_8, Pcre2Free> match_context;
+        std::unique_ptr<pcre2_jit_stack_8, Pcre2Free> jit_stack;
+        std::unique_ptr<pcre2_match_data_8, Pcre2Free> match_data;
+
+    public:
+        Matcher() = default;
+
+        explicit Matcher(const pcre2_code_8 *code) {
+            if (code == nullptr) {
+                return;
+            }
+            match_context.reset(pcre2_match_context_create_8(nullptr));
+            match_data.reset(pcre2_match_data_create_from_pattern_8(code, nullptr));
+            if (match_context == nullptr || match_data == nullptr) {
+                throw std::runtime_error("PCRE2 match data creation failed.");
+            }
+            // The JIT stack on the machine stack is only 32K, which a long run of whitespace
+            // can use up, so give the matches a stack of their own that can grow
+            jit_stack.reset(pcre2_jit_stack_create_8(jit_stack_start_size, jit_stack_max_size, nullptr));
+            if (jit_stack != nullptr) {
+                pcre2_jit_stack_assign_8(match_context.get(), nullptr, jit_stack.get());
+            }
+        }
+
+        // Appends the matches of code that start in [begin, end) of text to matches. Matching
+        // always runs over the whole text, so a lookahead at the end of a segment sees the same
+        // input it would in a serial split.
+        void find_matches(const pcre2_code_8 *code, std::string_view text, size_t begin, size_t end,
+              std::vector<std::string_view> &matches) {
+            PCRE2_SPTR subject = reinterpret_cast<PCRE2_SPTR>(text.data());
+            PCRE2_SIZE subject_length = text.length();
+            PCRE2_SIZE offset = begin;
+
+            int rc;
+            while (offset < end) {
+                rc = pcre2_match_8(
+                    code,
+                    subject,
+                    subject_length,
+                    offset,
+                    PCRE2_NO_UTF_CHECK,  // Optional for performance if you're sure input is valid
+                    match_data.get(),
+                    match_context.get()
+                );
+
+                if (rc < 0) {
+                    if (rc == PCRE2_ERROR_NOMATCH) break;
+                    PCRE2_UCHAR buffer[256];
+                    pcre2_get_error_message(rc, buffer, sizeof(buffer));
+                    throw std::runtime_error("PCRE2 match error: " + std::string(reinterpret_cast<char*>(buffer)));
+                }
+
+                PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data.get());
+                PCRE2_SIZE start = ovector[0];
+                PCRE2_SIZE match_end = ovector[1];
+
+                // Matches starting at or after the end belong to the next segment
+                if (start >= end) break;
+
+                // Avoid empty match loops
+                if (start == match_end) {
+                    if (offset >= subject_length) break;
+                    offset++;
+                    continue;
+                }
+
+                // Use a string_view to avoid allocation
+                matches.push_back(text.substr(start, match_end - start));
+                offset = match_end;
+            }
+        }
+    };
+
+    /**
+     * @class Model
+     * @brief A trained tokenizer: its merges, vocabulary, split pattern and special tokens.
+     *
+     * Everything is built in the constructor and never changes after, so one model can be held
+     * in a std::shared_ptr<const Model> and used by any number of threads at once, each through
+     * its own Session. Nothing in a model is mutable, including the compiled pattern, which
+     * PCRE2 allows to be matched concurrently.
+     */
+    class Model {
+    public:
+        // Links between the symbols of a chunk being encoded, in the order they appear
+        struct SymbolLink {
+            uint32_t prev;
+            uint32_t next;
+        };
+
+        // A merge that applied to two adjacent symbols when it was found. rank is the merged
+        // token, which is smaller the earlier the merge was learnt.
+        struct MergeCandidate {
+            Token rank;
+            uint32_t position;
+            Token left;
+            Token right;
+
+            // Orders the heap so the earliest merge comes first, leftmost first between equals
+            bool operator>(const MergeCandidate &other) const {
+                return rank != other.rank ? rank > other.rank : position > other.position;
+            }
+        };
+
+        // Buffers encode_chunk works in, kept by the caller so that encoding many chunks
+        // does not allocate them for each one
+        struct EncodeScratch {
+            std::vector<Token> symbols;
+            std::vector<SymbolLink> links;
+            std::vector<MergeCandidate> heap;
+        };
+
+    private:
+        static constexpr uint32_t no_token = std::numeric_limits<uint32_t>::max();
+
+        // The binary model file the tables below are in when it was loaded from one
+        std::shared_ptr<const MinBpeCC::Util::MappedFile> mapped_file;
+
+        std::string pattern; // The string representation of the regex pattern
+        std::unique_ptr<pcre2_code_8, Pcre2Free> compiled_pattern;
+        // Splits text for the gpt2 and gpt4 patterns without running the regex
+        std::optional<MinBpeCC::Util::PreTokenizer> pre_tokenizer;
+
+        std::unordered_map<std::string, Token> special_tokens;
+        std::unordered_map<Token, std::string> special_tokens_reverse_lookup;
+        // Special token ids as a bitmap, so decode tells whether a token is special with one
+        // load rather than a hash lookup. Ids too far past the vocabulary for the bitmap to be
+        // small are left out of it and looked up in special_tokens_reverse_lookup instead.
+        static constexpr size_t max_special_bits = size_t{1} << 24;
+        std::vector<uint64_t> special_bits;
+        bool has_far_special = false;
+        size_t max_special_length = 0;
+        MinBpeCC::Util::SpecialTokenScanner<Token> special_scanner;
+
+        std::vector<TokenPair> merges;
+        MinBpeCC::Util::MergeTable<Token> merges_lookup;
+        // Where the bytes of a token are in vocab_bytes
+        struct TokenSpan {
+            uint32_t offset;
+            uint32_t length;
+        };
+        // The bytes of every token back to back, indexed by vocab_spans, and then
+        // decode_padding zeros so that decode can copy a fixed size block from any token
+        static constexpr size_t decode_padding = 16;
+        MinBpeCC::Util::FlatArray<char> vocab_bytes;
+        MinBpeCC::Util::FlatArray<TokenSpan> vocab_spans;
+
+        // Encodes long chunks in linear time
+        MinBpeCC::Util::VocabAutomaton<Token> vocab_automaton;
+        // Token for the bytes of each token that encoding its bytes gives back, so a chunk
+        // that is exactly one token is found without merging. An open addressing hash table of
+        // tokens, at most half full, with a power of two slots and no_token in the empty ones.
+        MinBpeCC::Util::FlatArray<uint32_t> vocab_lookup;
+        size_t max_token_length = 0;
+
+        void compile_pattern() {
+            if (pattern.empty()) {
+                return;
+            }
+            if (pattern == GPT2_SPLIT_PATTERN) {
+                pre_tokenizer.emplace(MinBpeCC::Util::SplitPattern::GPT2);
+            } else if (pattern == GPT4_SPLIT_PATTERN) {
+                pre_tokenizer.emplace(MinBpeCC::Util::SplitPattern::GPT4);
+            }
+            PCRE2_SPTR pcre2_pattern_str = reinterpret_cast<PCRE2_SPTR>(pattern.c_str());
+            PCRE2_SIZE erroroffset;
+            int errorcode;
+
+            // Flags for PCRE2: PCRE2_UTF for UTF-8 and PCRE2_UCP for Unicode character properties
+            // Based on the GPT patterns, these are essential for correct matching.
+            uint32_t options = PCRE2_UTF | PCRE2_UCP;
+
+            // If your patterns (e.g., GPT4_SPLIT_PATTERN_OLD) use `(?i:)`, add PCRE2_CASELESS.
+            // If they use `(?s)` (dot matches newline), add PCRE2_DOTALL.
+            // If they use `(?m)` (multiline anchors), add PCRE2_MULTILINE.
+            if (pattern.find("(?i:") != std::string::npos) {
+                options |= PCRE2_CASELESS;
+            }
+
+            compiled_pattern.reset(pcre2_compile_8(
+                pcre2_pattern_str,           // Pointer to the pattern string
+                (PCRE2_SIZE)pattern.length(), // Length of the pattern
+                options,                     // Compile options
+                &errorcode,                  // Where to store error code
+                &erroroffset,                // Where to store error offset
+                nullptr                      // Compile context
+            ));
+
+            if (compiled_pattern == nullptr) {
+                PCRE2_UCHAR buffer[256];
+                pcre2_get_error_message_8(errorcode, buffer, sizeof(buffer));
+                throw std::runtime_error("PCRE2 pattern compilation failed: " + std::string(reinterpret_cast<char*>(buffer)));
+            }
+
+            int jit_errorcode = pcre2_jit_compile_8(compiled_pattern.get(), PCRE2_JIT_COMPLETE);
+            if (jit_errorcode < 0) {
+                // PCRE2 falls back to its interpreter, which gives the same matches only slower
+                PCRE2_UCHAR buffer[256];
+                pcre2_get_error_message_8(jit_errorcode, buffer, sizeof(buffer));
+                std::cerr << "Warning: PCRE2 JIT compilation failed: " << reinterpret_cast<char*>(buffer) << "\n";
+            }
+        }
+
+        // Builds the vocabulary from the merges, and from it what encode needs
+        void build_encoder() {
+            // A token's bytes are those of the pair it was merged from, so the size of the
+            // arena is known before any bytes are copied
+            std::vector<TokenSpan> spans;
+            spans.reserve(256 + merges.size());
+            size_t total_length = 256;
+            for(Token i = 0; i < 256; i++) {
+                spans.push_back(TokenSpan{i, 1});
+            }
+            Token idx = 256;
+            for(const auto &[left, right]: merges) {
+                if (left >= spans.size() || right >= spans.size()) {
+                    throw std::runtime_error("Merge of an unknown token: (" + std::to_string(left) + ", " +
+                          std::to_string(right) + ") -> " + std::to_string(idx));
+                }
+                size_t length = size_t{spans[left].length} + spans[right].length;
+                if (total_length + length > std::numeric_limits<uint32_t>::max()) {
+                    throw std::length_error("Vocabulary too large");
+                }
+                spans.push_back(TokenSpan{static_cast<uint32_t>(total_length), static_cast<uint32_t>(length)});
+                total_length += length;
+                idx++;
+            }
+            std::vector<char> bytes(total_length + decode_padding, '\0');
+            for(size_t i = 0; i < 256; i++) {
+                bytes[i] = static_cast<char>(i);
+            }
+            for(size_t t = 256; t < spans.size(); t++) {
+                auto [left, right] = merges[t - 256];
+                char *out = bytes.data() + spans[t].offset;
+                std::memcpy(out, bytes.data() + spans[left].offset, spans[left].length);
+                std::memcpy(out + spans[left].length, bytes.data() + spans[right].offset, spans[right].length);
+            }
+            vocab_spans = MinBpeCC::Util::FlatArray<TokenSpan>(std::move(spans));
+            vocab_bytes = MinBpeCC::Util::FlatArray<char>(std::move(bytes));
+            merges_lookup.build(merges, 256);
+
+            std::vector<std::string_view> vocab(vocab_spans.size());
+            for(size_t t = 0; t < vocab.size(); t++) {
+                vocab[t] = get_token_bytes(static_cast<Token>(t));
+            }
+            vocab_automaton.build(vocab, merges, merges_lookup);
+            size_t reachable = 0;
+            for(size_t t = 0; t < vocab.size(); t++) {
+                if(vocab_automaton.is_reachable(static_cast<Token>(t))) {
+                    reachable++;
+                    max_token_length = std::max(max_token_length, vocab[t].size());
+                }
+            }
+            size_t capacity = 2;
+            while(capacity < reachable * 2) {
+                capacity *= 2;
+            }
+            std::vector<uint32_t> slots(capacity, no_token);
+            for(size_t t = 0; t < vocab.size(); t++) {
+                if(vocab_automaton.is_reachable(static_cast<Token>(t))) {
+                    auto i = MinBpeCC::Util::hash_bytes(vocab[t]) & (capacity - 1);
+                    while(slots[i] != no_token) {
+                        i = (i + 1) & (capacity - 1);
+                    }
+                    slots[i] = static_cast<uint32_t>(t);
+                }
+            }
+            vocab_lookup = MinBpeCC::Util::FlatArray<uint32_t>(std::move(slots));
+        }
+
+        // Builds what is needed to find and decode the special tokens
+        void build_special_tokens() {
+            for(const auto &[token, id]: special_tokens) {
+                special_tokens_reverse_lookup[id] = token;
+                max_special_length = std::max(max_special_length, token.size());
+                if (id < max_special_bits) {
+                    special_bits.resize(std::max<size_t>(special_bits.size(), id / 64 + 1));
+                    special_bits[id / 64] |= uint64_t{1} << (id % 64);
+                } else {
+                    has_far_special = true;
+                }
+            }
+            special_scanner.build(special_tokens);
+        }
+
+        // Whether saved vocabulary tables are the ones build_encoder makes for the merges: each
+        // merge only uses tokens before it, and each token's bytes are in the arena, with
+        // decode_padding bytes after them, and are the bytes of the pair it was merged from
+        bool vocab_fits(std::span<const TokenSpan> spans, std::span<const char> bytes,
+              std::span<const uint32_t> token_lengths) const {
+            if (spans.size() != merges.size() + 256 || token_lengths.size() != spans.size()) {
+                return false;
+            }
+            for(size_t t = 0; t < spans.size(); t++) {
+                auto [offset, length] = spans[t];
+                if (size_t{offset} + length + decode_padding > bytes.size() || token_lengths[t] != length) {
+                    return false;
+                }
+                const char *token_bytes = bytes.data() + offset;
+                if (t < 256) {
+                    if (length != 1 || static_cast<unsigned char>(*token_bytes) != t) {
+                        return false;
+                    }
+                    continue;
+                }
+                auto [left, right] = merges[t - 256];
+                if (left >= t || right >= t) {
+                    return false;
+                }
+                auto left_span = spans[left];
+                auto right_span = spans[right];
+                if (size_t{left_span.length} + right_span.length != length ||
+                      std::memcmp(token_bytes, bytes.data() + left_span.offset, left_span.length) != 0 ||
+                      std::memcmp(token_bytes + left_span.length, bytes.data() + right_span.offset, right_span.length) != 0) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Whether saved token lookup slots are a power of two, hold only tokens in the
+        // vocabulary, and have an empty one that ends every search
+        static bool lookup_fits(std::span<const uint32_t> lookup, size_t vocab_size) {
+            if (lookup.size() < 2 || (lookup.size() & (lookup.size() - 1)) != 0) {
+                return false;
+            }
+            bool has_empty = false;
+            for(auto token : lookup) {
+                if (token == no_token) {
+                    has_empty = true;
+                } else if (token >= vocab_size) {
+                    return false;
+                }
+            }
+            return has_empty;
+        }
+
+        // Points the model at the tables of a binary model file
+        void view_tables(const MinBpeCC::Util::ModelFileReader &reader) {
+            using MinBpeCC::Util::ModelSection;
+            auto saved_merges = reader.section<TokenPair>(ModelSection::Merges);
+            merges.assign(saved_merges.begin(), saved_merges.end());
+            auto spans = reader.section<TokenSpan>(ModelSection::VocabSpans);
+            auto bytes = reader.section<char>(ModelSection::VocabBytes);
+            auto lookup = reader.section<uint32_t>(ModelSection::VocabLookup);
+            MinBpeCC::Util::VocabAutomaton<Token>::Tables tables{
+                reader.section<uint32_t>(ModelSection::FirstEdge),
+                reader.section<uint8_t>(ModelSection::EdgeBytes),
+                reader.section<uint32_t>(ModelSection::EdgeTargets),
+                reader.section<uint32_t>(ModelSection::NodeToken),
+                reader.section<uint32_t>(ModelSection::TokenLength),
+                reader.section<uint32_t>(ModelSection::NextPrefix),
+                reader.section<uint8_t>(ModelSection::Reachable)};
+            // Everything encode and decode look up is checked to be in range, in one pass over
+            // each table, so that a damaged file is refused rather than read out of bounds
+            if (!vocab_fits(spans, bytes, tables.token_length) || !lookup_fits(lookup, spans.size()) ||
+                  !merges_lookup.view(reader.section<MinBpeCC::Util::MergeTable<Token>::Slot>(ModelSection::MergeTable),
+                        merges, 256) ||
+                  !vocab_automaton.view(tables, merges, merges_lookup)) {
+                throw std::runtime_error("Binary model tables do not fit together");
+            }
+            vocab_spans = MinBpeCC::Util::FlatArray<TokenSpan>(spans);
+            vocab_bytes = MinBpeCC::Util::FlatArray<char>(bytes);
+            vocab_lookup = MinBpeCC::Util::FlatArray<uint32_t>(lookup);
+            max_token_length = reader.max_token_length();
+        }
+
+        bool is_special(Token token) const {
+            if (token / 64 < special_bits.size()) {
+                return (special_bits[token / 64] >> (token % 64)) & 1;
+            }
+            return has_far_special && special_tokens_reverse_lookup.contains(token);
+        }
+
+    public:
+        /**
+         * @brief Builds a model, compiling the pattern and the tables used to encode.
+         * @param pattern The regex text is split with before encoding, empty for none.
+         * @param merges The pairs merged to each token from 256 on, in merge order.
+         * @param special_tokens Special tokens and their ids.
+         * @throws std::runtime_error if the pattern does not compile or a merge uses a token
+         * that does not exist yet.
+         */
+        explicit Model(const std::string &pattern = "", std::vector<TokenPair> merges = {},
+              std::unordered_map<std::string, Token> special_tokens = {})
+            : pattern(pattern),
+              special_tokens(std::move(special_tokens)),
+              merges(std::move(merges)) {
+            compile_pattern();
+            build_special_tokens();
+            build_encoder();
+        }
+
+        /**
+         * @brief Makes a model from a binary model file written by save_binary, using its
+         * tables where they are in the file rather than building them.
+         * @param file The mapped file, kept mapped for as long as the model is alive.
+         * @param special_tokens Special tokens to have as well as those in the file, which
+         * take their place where the two have the same text.
+         * @throws std::runtime_error if the file is not a binary model this build can use,
+         * or the pattern in it does not compile.
+         */
+        explicit Model(std::shared_ptr<const MinBpeCC::Util::MappedFile> file,
+              std::unordered_map<std::string, Token> special_tokens = {})
+            : mapped_file(std::move(file)),
+              special_tokens(std::move(special_tokens)) {
+            using MinBpeCC::Util::ModelSection;
+            MinBpeCC::Util::ModelFileReader reader(mapped_file->data(), sizeof(Token));
+            auto saved_pattern = reader.section<char>(ModelSection::Pattern);
+            pattern.assign(saved_pattern.begin(), saved_pattern.end());
+            auto saved_special = reader.section<char>(ModelSection::SpecialTokens);
+            for(size_t pos = 0; pos < saved_special.size();) {
+                uint32_t header[2]; // Id and length
+                if (saved_special.size() - pos < sizeof(header)) {
+                    throw std::runtime_error("Binary model special tokens are cut short");
+                }
+                std::memcpy(header, saved_special.data() + pos, sizeof(header));
+                pos += sizeof(header);
+                if (saved_special.size() - pos < header[1]) {
+                    throw std::runtime_error("Binary model special tokens are cut short");
+                }
+                this->special_tokens.insert_or_assign(std::string(saved_special.data() + pos, header[1]),
+                      static_cast<Token>(header[0]));
+                pos += header[1];
+            }
+            view_tables(reader);
+            compile_pattern();
+            build_special_tokens();
+        }
+
+        Model(const Model &) = delete;
+        Model &operator=(const Model &) = delete;
+
+        const std::string &get_pattern() const {
+            return pattern;
+        }
+
+        // The compiled pattern, or nullptr when the model has no pattern
+        const pcre2_code_8 *get_compiled_pattern() const {
+            return compiled_pattern.get();
+        }
+
+        // Appends the chunks of text the pattern matches starting in [begin, end) to matches,
+        // see Matcher::find_matches. The gpt2 and gpt4 patterns are split by the pre-tokenizer,
+        // which finds the same chunks, and other patterns with PCRE2 using matcher.
+        void find_matches(Matcher &matcher, std::string_view text, size_t begin, size_t end,
+              std::vector<std::string_view> &matches) const {
+            if (pre_tokenizer) {
+                pre_tokenizer->find_matches(text, begin, end, matches);
+            } else {
+                matcher.find_matches(compiled_pattern.get(), text, begin, end, matches);
+            }
+        }
+
+        const std::vector<TokenPair> &get_merges() const {
+            return merges;
+        }
+
+        /**
+         * @brief Writes the model as a binary model file, which a Model can use in place.
+         * @return false if the file could not be written.
+         */
+        bool save_binary(const std::filesystem::path &path) const {
+            using MinBpeCC::Util::ModelSection;
+            MinBpeCC::Util::ModelFileWriter writer(sizeof(Token), max_token_length);
+            writer.add<char>(ModelSection::Pattern, pattern);
+            // In id order, so that saving the same model always writes the same bytes
+            std::map<Token, std::string_view> by_id;
+            for(const auto &[token, id]: special_tokens) {
+                by_id[id] = token;
+            }
+            std::string saved_special;
+            for(const auto &[id, token]: by_id) {
+                uint32_t header[2] = {static_cast<uint32_t>(id), static_cast<uint32_t>(token.size())};
+                saved_special.append(reinterpret_cast<const char *>(header), sizeof(header));
+                saved_special += token;
+            }
+            writer.add<char>(ModelSection::SpecialTokens, saved_special);
+            writer.add<TokenPair>(ModelSection::Merges, merges);
+            writer.add(ModelSection::MergeTable, merges_lookup.get_slots());
+            writer.add(ModelSection::VocabSpans, vocab_spans.span());
+            writer.add(ModelSection::VocabBytes, vocab_bytes.span());
+            writer.add(ModelSection::VocabLookup, vocab_lookup.span());
+            auto tables = vocab_automaton.get_tables();
+            writer.add(ModelSection::FirstEdge, tables.first_edge);
+            writer.add(ModelSection::EdgeBytes, tables.edge_bytes);
+            writer.add(ModelSection::EdgeTargets, tables.edge_targets);
+            writer.add(ModelSection::NodeToken, tables.node_token);
+            writer.add(ModelSection::TokenLength, tables.token_length);
+            writer.add(ModelSection::NextPrefix, tables.next_prefix);
+            writer.add(ModelSection::Reachable, tables.reachable);
+            return writer.write(path);
+        }
+
+        // Number of tokens in the vocabulary, the 256 bytes and one for each merge
+        size_t get_vocab_size() const {
+            return vocab_spans.size();
+        }
+
+        // The bytes of a token in the vocabulary, which must be less than get_vocab_size()
+        std::string_view get_token_bytes(Token token) const {
+            auto span = vocab_spans[token];
+            return std::string_view(vocab_bytes.data() + span.offset, span.length);
+        }
+
+        const std::unordered_map<std::string, Token> &get_special_tokens() const {
+            return special_tokens;
+        }
+
+        // The built in GPT patterns never match across a newline that is followed by a printable
+        // ASCII character: the whitespace alternatives cannot consume the character and none of
+        // the others can start with a newline. Nor do they match across the end of a letter
+        // that is followed by a single space and another letter: the alternatives that take
+        // letters stop at the space, and the space starts a match of its own with the letters
+        // after it. A match always starts at such points, no matter what came before, so the
+        // text can be split there and matched independently.
+        bool can_split_in_parallel() const {
+            return pattern == GPT2_SPLIT_PATTERN || pattern == GPT4_SPLIT_PATTERN;
+        }
+
+        // The token whose bytes are exactly chunk, if encoding chunk gives just that token
+        std::optional<Token> find_token(std::string_view chunk) const {
+            if (chunk.size() <= max_token_length) {
+                size_t mask = vocab_lookup.size() - 1;
+                for(size_t i = MinBpeCC::Util::hash_bytes(chunk) & mask;; i = (i + 1) & mask) {
+                    auto token = vocab_lookup[i];
+                    if (token == no_token) {
+                        break;
+                    }
+                    if (get_token_bytes(static_cast<Token>(token)) == chunk) {
+                        return static_cast<Token>(token);
+                    }
+                }
+            }
+            return std::nullopt;
+        }
+
+        // Encodes a chunk the way minbpe does and appends its tokens to out: the pair whose merge
+        // was learnt first is merged everywhere it occurs, left to right, then the next one, until
+        // no adjacent pair has a merge. Rather than a pass over the whole chunk per merge the
+        // symbols are kept in a linked list, and every adjacent pair with a merge is held in a
+        // min-heap by rank and position, so each merge costs O(log n).
+        // A merge can only create pairs containing the new token, which are merged later than
+        // it, so the heap never needs to go back to an earlier rank. Candidates made stale by
+        // a neighbouring merge are recognised when they are popped because the tokens no
+        // longer match. Merged away symbols are marked and skipped at the end.
+        // Chunks of at least backtrack_min_length bytes are encoded with vocab_automaton instead.
+        void encode_chunk(std::string_view chunk, std::vector<Token> &out, size_t backtrack_min_length,
+              EncodeScratch &scratch) const {
+            auto &text = scratch.symbols;
+            text.resize(chunk.size());
+            MinBpeCC::Util::widen_bytes(chunk, text.data());
+            if (text.size() < 2) { // Nothing to merge if less than 2 elements
+                out.insert(out.end(), text.begin(), text.end());
+                return;
+            }
+            if (text.size() >= backtrack_min_length && !vocab_automaton.empty()) {
+                auto encoded = vocab_automaton.encode(text);
+                out.insert(out.end(), encoded.begin(), encoded.end());
+                return;
+            }
+            constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+            constexpr Token merged_away = std::numeric_limits<Token>::max();
+            if (text.size() >= none) {
+                throw std::length_error("Chunk too long to encode");
+            }
+            uint32_t len = static_cast<uint32_t>(text.size());
+
+            auto &links = scratch.links;
+            links.resize(len);
+            for(uint32_t i = 0; i < len; i++) {
+                links[i] = SymbolLink{i == 0 ? none : i - 1, i + 1 == len ? none : i + 1};
+            }
+
+            auto &heap = scratch.heap;
+            heap.clear();
+            auto add_candidate = [&](uint32_t left) {
+                auto right = links[left].next;
+                auto rank = merges_lookup.find(text[left], text[right]);
+                if(rank) {
+                    heap.push_back(MergeCandidate{*rank, left, text[left], text[right]});
+                    std::push_heap(heap.begin(), heap.end(), std::greater<>());
+                }
+            };
+            for(uint32_t i = 0; i + 1 < len; i++) {
+                add_candidate(i);
+            }
+
+            while(!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), std::greater<>());
+                auto candidate = heap.back();
+                heap.pop_back();
+
+                auto i = candidate.position;
+                auto j = links[i].next;
+                if(j == none || text[i] != candidate.left || text[j] != candidate.right) {
+                    continue; // Stale
+                }
+
+                text[i] = candidate.rank;
+                text[j] = merged_away;
+                auto k = links[j].next;
+                links[i].next = k;
+                if(k != none) {
+                    links[k].prev = i;
+                    add_candidate(i);
+                }
+                if(links[i].prev != none) {
+                    add_candidate(links[i].prev);
+                }
+            }
+
+            for (auto token : text) {
+                if (token != merged_away) {
+                    out.push_back(token);
+                }
+            }
+        }
+
+        // Where a special token occurs in some text
+        using SpecialMatch = MinBpeCC::Util::SpecialTokenScanner<Token>::Match;
+
+        // A piece of the text split_on_special cuts: ordinary text, or a special token and its id
+        struct TextPart {
+            std::string_view text;
+            std::optional<Token> special;
+        };
+
+        // Finds the first special token in text at or after pos. When several start at the same
+        // place the longest is found.
+        std::optional<SpecialMatch> find_special(std::string_view text, size_t pos) const {
+            return special_scanner.find(text, pos);
+        }
+
+        // Length of the longest special token, 0 if there are none
+        size_t get_max_special_length() const {
+            return max_special_length;
+        }
+
+        // Splits input text into the ordinary text and the special tokens in it, as views of
+        // the text. Text without special tokens is a single part, an empty text none.
+        // Example: "hello <|endoftext|> world" => ["hello ", "<|endoftext|>" (100257), " world"]
+        std::vector<TextPart> split_on_special(std::string_view text) const {
+            std::vector<TextPart> result;
+            size_t pos = 0;
+            while (pos < text.size()) {
+                auto found = find_special(text, pos);
+                if (!found) {
+                    break;
+                }
+                if (found->position > pos) {
+                    result.push_back(TextPart{text.substr(pos, found->position - pos), std::nullopt});
+                }
+                result.push_back(TextPart{text.substr(found->position, found->length), found->token});
+                pos = found->position + found->length;
+            }
+            if (pos < text.size()) {
+                result.push_back(TextPart{text.substr(pos), std::nullopt});
+            }
+            return result;
+        }
+
+        // Decodes a sequence of tokens back into a string
+        std::string decode(std::span<const Token> tokens, const bool verbose) const {
+            if(verbose) {
+                std::cout << "Decoding " << tokens.size() << " tokens\n";
+            }
+            // Size the text first, then copy each token's bytes straight into place
+            size_t size = 0;
+            for(Token tkn : tokens) {
+                // Override special tokens with their string representation
+                if (is_special(tkn)) {
+                    size += special_tokens_reverse_lookup.find(tkn)->second.size();
+                } else if (tkn < vocab_spans.size()) {
+                    size += vocab_spans[tkn].length;
+                } else {
+                    std::cerr << "Warning: Attempted to decode invalid token ID: " << tkn << "\n";
+                }
+            }
+            // Most tokens are short, so they are copied as a whole block of decode_padding
+            // bytes, which the arena and the text both have room for past their end. A fixed
+            // size copy is a single load and store where one of the token's length is a call.
+            std::string text;
+            text.resize_and_overwrite(size + decode_padding, [&](char *out, size_t) {
+                for(Token tkn : tokens) {
+                    if (is_special(tkn)) {
+                        const auto &special = special_tokens_reverse_lookup.find(tkn)->second;
+                        std::memcpy(out, special.data(), special.size());
+                        out += special.size();
+                    } else if (tkn < vocab_spans.size()) {
+                        auto span = vocab_spans[tkn];
+                        const char *bytes = vocab_bytes.data() + span.offset;
+                        if (span.length <= decode_padding) {
+                            std::memcpy(out, bytes, decode_padding);
+                        } else {
+                            std::memcpy(out, bytes, span.length);
+                        }
+                        out += span.length;
+                    }
+                }
+                return size;
+            });
+            return text;
+        }
+    };
+
+    /**
+     * @class Session
+     * @brief Encodes and decodes with a shared Model from one thread.
+     *
+     * A session holds everything that changes while encoding: the PCRE2 match data and JIT
+     * stack, the buffers chunks are encoded in and the cache of encoded chunks. Sessions are
+     * cheap to make, so a service can load a model once and give each worker thread its own
+     * session on it. A session must not be used by two threads at once.
+     */
+    class Session {
+    private:
+        static const size_t default_backtrack_min_length = 1024;
+        static const size_t default_encode_cache_size = 1 << 16;
+        static const size_t max_cached_chunk_length = 256;
+        // Smallest segment of text worth giving its own thread
+        static constexpr size_t min_segment_size = 1 << 16;
+        static const size_t default_stream_block_size = 1 << 20;
+
+        std::shared_ptr<const Model> model;
+        Matcher matcher;
+        Model::EncodeScratch scratch;
+        std::vector<std::string_view> chunks; // Regex matches of the text being encoded
+
+        // Chunks at least this long are encoded with the vocab automaton rather than the merge heap
+        size_t backtrack_min_length = default_backtrack_min_length;
+        // Number of threads used to split text with the regex pattern
+        size_t num_threads = 1;
+        // What to do with text that is not valid UTF-8, which PCRE2 must not be given
+        MinBpeCC::Util::InvalidUtf8 invalid_utf8 = MinBpeCC::Util::InvalidUtf8::Raw;
+
+        // Tokens of chunks already encoded. Once it holds encode_cache_size chunks no more are
+        // added; by then the commonest chunks are in it, and not evicting keeps a stream of rare
+        // chunks from churning it.
+        std::unordered_map<std::string, std::vector<Token>, StringHash, std::equal_to<>> encode_cache;
+        size_t encode_cache_size = default_encode_cache_size;
+        size_t encode_cache_hits = 0;
+        size_t encode_cache_misses = 0;
+
+        // A piece of text to encode: the matches in [begin, end) of part, a special token, or
+        // when raw a run of bytes that are not valid UTF-8, encoded as one chunk
+        struct Segment {
+            std::string_view part;
+            size_t begin;
+            size_t end;
+            std::optional<Token> special;
+            bool raw = false;
+        };
+
+        // Whether the gpt2 and gpt4 patterns always start a match at pos, see can_split_in_parallel
+        static bool is_safe_boundary(std::string_view text, size_t pos) {
+            auto c = static_cast<unsigned char>(text[pos]);
+            if (c == ' ') {
+                return pos + 1 < text.size() && std::isalpha(static_cast<unsigned char>(text[pos - 1])) &&
+                    std::isalpha(static_cast<unsigned char>(text[pos + 1]));
+            }
+            return text[pos - 1] == '\n' && c < 0x80 && !std::isspace(c);
+        }
+
+        // Finds the first safe place to cut the text for parallel splitting at or after pos
+        static size_t next_safe_boundary(std::string_view text, size_t pos) {
+            for(pos = std::max<size_t>(pos, 1); pos < text.size(); pos++) {
+                if(is_safe_boundary(text, pos)) {
+                    return pos;
+                }
+            }
+            return text.size();
+        }
+
+        // Encodes a chunk of text that is not a special token, appending its tokens to out
+        void encode_part(std::string_view part, std::vector<Token> &out) {
+            // Common chunks such as " the" are often a token already
+            if (auto token = model->find_token(part)) {
+                out.push_back(*token);
+                return;
+            }
+            if (encode_cache_size == 0 || part.size() > max_cached_chunk_length) {
+                model->encode_chunk(part, out, backtrack_min_length, scratch);
+                return;
+            }
+            auto found = encode_cache.find(part);
+            if (found != encode_cache.end()) {
+                encode_cache_hits++;
+                out.insert(out.end(), found->second.begin(), found->second.end());
+                return;
+            }
+            encode_cache_misses++;
+            auto start = out.size();
+            model->encode_chunk(part, out, backtrack_min_length, scratch);
+            if (encode_cache.size() < encode_cache_size) {
+                encode_cache.emplace(part, std::vector<Token>(out.begin() + start, out.end()));
+            }
+        }
+
+        // Encodes a segment, appending its tokens to out. Parts without a pattern to split them
+        // are always encoded whole.
+        void encode_segment(const Segment &segment, std::vector<Token> &out) {
+            if (segment.special) {
+                out.push_back(*segment.special);
+            } else if (!segment.raw && model->get_compiled_pattern() != nullptr) {
+                chunks.clear();
+                model->find_matches(matcher, segment.part, segment.begin, segment.end, chunks);
+                for (auto chunk : chunks) {
+                    encode_part(chunk, out);
+                }
+            } else {
+                // No regex: just encode the whole part
+                encode_part(segment.part, out);
+            }
+        }
+
+        // How long the segments of total bytes of text are cut for encoding on several threads,
+        // or 0 to encode it on this one. Several segments per thread let the pool even out
+        // segments that take longer.
+        size_t parallel_segment_size(size_t total) const {
+            if (num_threads <= 1 || total < 2 * min_segment_size) {
+                return 0;
+            }
+            return std::max(min_segment_size, total / (num_threads * 4));
+        }
+
+        // Adds the matches in [begin, end) of part to segments. When segment_size is not 0 and
+        // the pattern allows it they are cut at safe boundaries into segments of about that size.
+        // Each segment is matched against the whole part, as split_chunks does, so a lookahead
+        // at a cut sees the same text as when the part is matched in one go.
+        void add_segments(std::string_view part, size_t begin, size_t end, size_t segment_size,
+              std::vector<Segment> &segments) const {
+            if (segment_size != 0 && model->can_split_in_parallel()) {
+                while (end - begin > segment_size) {
+                    auto cut = next_safe_boundary(part.substr(0, end), begin + segment_size);
+                    segments.push_back(Segment{part, begin, cut, std::nullopt});
+                    begin = cut;
+                }
+            }
+            if (begin < end) {
+                segments.push_back(Segment{part, begin, end, std::nullopt});
+            }
+        }
+
+        // Adds the matches in [0, end) of part to segments as add_segments does. When invalid is
+        // set the part may hold bytes that are not valid UTF-8, which the pattern must not see,
+        // so the valid text between them is added as parts of its own and each run of invalid
+        // bytes as a raw segment.
+        void add_text_segments(std::string_view part, size_t end, size_t segment_size, bool invalid,
+              std::vector<Segment> &segments) const {
+            if (!invalid || model->get_compiled_pattern() == nullptr) {
+                add_segments(part, 0, end, segment_size, segments);
+                return;
+            }
+            size_t pos = 0;
+            while (pos < end) {
+                auto found = MinBpeCC::Util::find_invalid_utf8(part.substr(pos));
+                size_t valid_end = found == std::string_view::npos ? part.size() : pos + found;
+                if (valid_end > pos) {
+                    add_segments(part.substr(pos, valid_end - pos), 0, std::min(valid_end, end) - pos, segment_size, segments);
+                }
+                if (valid_end >= end) {
+                    break;
+                }
+                size_t run = MinBpeCC::Util::invalid_utf8_run_length(part, valid_end);
+                segments.push_back(Segment{part.substr(valid_end, run), 0, run, std::nullopt, true});
+                pos = valid_end + run;
+            }
+        }
+
+        // Encodes segments in order, appending their tokens to out, on several threads if parallel
+        void encode_segments(const std::vector<Segment> &segments, bool parallel, std::vector<Token> &out) {
+            if (!parallel || segments.size() < 2) {
+                for (const auto &segment : segments) {
+                    encode_segment(segment, out);
+                }
+                return;
+            }
+            std::vector<std::vector<Token>> encoded(segments.size());
+            MinBpeCC::Util::WorkStealingPool pool(std::min(num_threads, segments.size()));
+            std::vector<Session> worker_sessions(pool.size() - 1, *this);
+            pool.run(segments.size(), [&](size_t worker, size_t i) {
+                auto &worker_session = worker == 0 ? *this : worker_sessions[worker - 1];
+                worker_session.encode_segment(segments[i], encoded[i]);
+            });
+            for (const auto &tokens : encoded) {
+                out.insert(out.end(), tokens.begin(), tokens.end());
+            }
+        }
+
+        // Encodes the parts split_on_special cut a text into, appending their tokens to out.
+        // Large texts are encoded on several threads when they can be cut into segments that
+        // encode the same on their own: at special tokens, which split_on_special has already
+        // cut at, and within a part at the safe boundaries of the gpt2 and gpt4 patterns. The
+        // tokens are the same as encoding on one thread. Without a pattern a part is a single
+        // chunk, which BPE can merge across anywhere, so only the parts themselves are encoded
+        // in parallel. invalid is whether the text holds invalid UTF-8, see check_utf8.
+        void encode_parts(const std::vector<Model::TextPart> &split_text, bool invalid, std::vector<Token> &out) {
+            size_t total = 0;
+            for (const auto &part : split_text) {
+                total += part.text.size();
+            }
+            auto segment_size = parallel_segment_size(total);
+            std::vector<Segment> segments;
+            for (const auto &part : split_text) {
+                if (part.special) {
+                    segments.push_back(Segment{part.text, 0, part.text.size(), part.special});
+                } else {
+                    add_text_segments(part.text, part.text.size(), segment_size, invalid, segments);
+                }
+            }
+            encode_segments(segments, segment_size != 0, out);
+        }
+
+        // How much of the text buffered from a stream can be encoded before the rest has been
+        // read: up to the end of the last special token that cannot be the start of a longer
+        // one still to come, or for the gpt2 and gpt4 patterns up to a later safe boundary. A
+        // boundary needs the characters after it, which the matches before it look ahead at,
+        // and must not be followed by a special token, where the part would end instead.
+        // Without a pattern or special tokens, or with a pattern that has no safe boundaries,
+        // the whole input is buffered.
+        // scanned is where the search resumes: the buffer before it has been searched already
+        // and holds neither a special token nor a boundary, so a long stretch without either
+        // is only searched once. It is moved on past what this search decided.
+        size_t stream_cut(std::string_view buffer, size_t &scanned) const {
+            size_t max_special = model->get_max_special_length();
+            if (buffer.size() <= max_special) {
+                return 0;
+            }
+            // Special tokens starting at or before resolved are already wholly in the buffer
+            size_t resolved = buffer.size() - max_special;
+            size_t cut = 0;
+            if (max_special > 0) {
+                for (auto special = model->find_special(buffer, scanned); special && special->position <= resolved;
+                      special = model->find_special(buffer, cut)) {
+                    cut = special->position + special->length;
+                }
+            }
+            size_t boundary = cut;
+            if (model->get_compiled_pattern() != nullptr && model->can_split_in_parallel()) {
+                for (size_t b = std::min(resolved, buffer.size() - 1); b > cut && b >= scanned; b--) {
+                    if (is_safe_boundary(buffer, b)) {
+                        boundary = b;
+                        break;
+                    }
+                }
+            }
+            // Whether the last byte starts a boundary is only known once the next one is read
+            scanned = std::max(scanned, std::min(resolved + 1, buffer.size() - 1));
+            return boundary;
+        }
+
+    public:
+        /**
+         * @brief Creates a session on a model.
+         * @param model The model to encode with, which the session shares.
+         */
+        explicit Session(std::shared_ptr<const Model> model)
+            : model(std::move(model)),
+              matcher(this->model->get_compiled_pattern()) {
+        }
+
+        // A copy shares the model and settings but has its own match data and an empty cache,
+        // so it can be handed to another thread
+        Session(const Session &other)
+            : model(other.model),
+              matcher(model->get_compiled_pattern()),
+              backtrack_min_length(other.backtrack_min_length),
+              num_threads(other.num_threads),
+              invalid_utf8(other.invalid_utf8),
+              encode_cache_size(other.encode_cache_size) {
+        }
+
+        Session &operator=(const Session &other) {
+            if (this != &other) {
+                *this = Session(other);
+            }
+            return *this;
+        }
+
+        Session(Session &&) = default;
+        Session &operator=(Session &&) = default;
+
+        const std::shared_ptr<const Model> &get_model() const {
+            return model;
+        }
+
+        // Switches the session to another model, dropping the cache of the old one
+        void set_model(std::shared_ptr<const Model> new_model) {
+            model = std::move(new_model);
+            matcher = Matcher(model->get_compiled_pattern());
+            encode_cache.clear();
+        }
+
+        // Sets the number of threads used to split large inputs with the regex pattern
+        void set_threads(size_t threads) {
+            num_threads = std::max<size_t>(threads, 1);
+        }
+
+        // Sets how long a chunk must be to be encoded by backtracking rather than merging
+        void set_backtrack_min_length(size_t length) {
+            backtrack_min_length = length;
+        }
+
+        // Sets what encoding and training do with text that is not valid UTF-8
+        void set_invalid_utf8(MinBpeCC::Util::InvalidUtf8 policy) {
+            invalid_utf8 = policy;
+        }
+
+        // Text checked for invalid UTF-8: the text to encode, and whether it still holds invalid
+        // bytes, which only InvalidUtf8::Raw lets through
+        struct CheckedText {
+            std::string_view text;
+            bool invalid;
+        };
+
+        /**
+         * @brief Checks text is valid UTF-8 before the pattern is matched on it, applying the
+         * invalid UTF-8 policy if it is not.
+         *
+         * The text is validated once, a vector of bytes at a time, so that matching can skip
+         * PCRE2's own checks. Raw text without a pattern is not checked, as nothing looks at
+         * its characters.
+         * @param text The text to check.
+         * @param repaired Holds the text with U+FFFD in place of invalid sequences, under
+         * InvalidUtf8::Replace.
+         * @param offset Where the text starts in the input, for the error message.
+         * @throws std::runtime_error if the text is invalid under InvalidUtf8::Reject.
+         */
+        CheckedText check_utf8(std::string_view text, std::string &repaired, size_t offset = 0) const {
+            if (invalid_utf8 == MinBpeCC::Util::InvalidUtf8::Raw && model->get_compiled_pattern() == nullptr) {
+                return CheckedText{text, false};
+            }
+            auto found = MinBpeCC::Util::find_invalid_utf8(text);
+            if (found == std::string_view::npos) {
+                return CheckedText{text, false};
+            }
+            if (invalid_utf8 == MinBpeCC::Util::InvalidUtf8::Reject) {
+                throw std::runtime_error("Invalid UTF-8 at byte " + std::to_string(offset + found));
+            }
+            if (invalid_utf8 == MinBpeCC::Util::InvalidUtf8::Replace) {
+                repaired = MinBpeCC::Util::replace_invalid_utf8(text);
+                return CheckedText{repaired, false};
+            }
+            return CheckedText{text, true};
+        }
+
+        // Sets how many distinct chunks encode keeps the tokens of, 0 turns the cache off
+        void set_encode_cache_size(size_t size) {
+            encode_cache_size = size;
+            if (encode_cache.size() > size) {
+                encode_cache.clear();
+            }
+        }
+
+        // Number of chunks encode found in its cache
+        size_t get_encode_cache_hits() const {
+            return encode_cache_hits;
+        }
+
+        // Number of chunks encode had to encode because they were not in its cache
+        size_t get_encode_cache_misses() const {
+            return encode_cache_misses;
+        }
+
+        // Splits text into chunks using the regex pattern. Large inputs are cut into segments at
+        // safe boundaries which are matched on separate threads, each with its own Matcher, and
+        // the chunks are joined back in order. The result is the same as a serial split. When
+        // invalid is set, see check_utf8, each run of invalid bytes is a chunk of its own and the
+        // text between them is split on its own.
+        std::vector<std::string_view> split_chunks(std::string_view text, bool invalid = false) {
+            std::vector<std::string_view> chunks;
+            if(invalid) {
+                size_t pos = 0;
+                while(pos < text.size()) {
+                    auto found = MinBpeCC::Util::find_invalid_utf8(text.substr(pos));
+                    size_t valid_end = found == std::string_view::npos ? text.size() : pos + found;
+                    auto valid = split_chunks(text.substr(pos, valid_end - pos));
+                    chunks.insert(chunks.end(), valid.begin(), valid.end());
+                    if(valid_end == text.size()) {
+                        break;
+                    }
+                    size_t run = MinBpeCC::Util::invalid_utf8_run_length(text, valid_end);
+                    chunks.push_back(text.substr(valid_end, run));
+                    pos = valid_end + run;
+                }
+                return chunks;
+            }
+            size_t segments = model->can_split_in_parallel() ? std::min(num_threads, text.size() / min_segment_size) : 1;
+            if(segments <= 1) {
+                model->find_matches(matcher, text, 0, text.size(), chunks);
+                return chunks;
+            }
+
+            std::vector<size_t> bounds{0};
+            for(size_t i = 1; i < segments; i++) {
+                auto bound = next_safe_boundary(text, std::max(bounds.back() + 1, text.size() * i / segments));
+                if(bound >= text.size()) {
+                    break;
+                }
+                bounds.push_back(bound);
+            }
+            bounds.push_back(text.size());
+
+            std::vector<std::future<std::vector<std::string_view>>> results;
+            for(size_t i = 0; i + 1 < bounds.size(); i++) {
+                results.push_back(std::async(std::launch::async, [this, text, begin = bounds[i], end = bounds[i + 1]]() {
+                    Matcher segment_matcher(model->get_compiled_pattern());
+                    std::vector<std::string_view> matches;
+                    model->find_matches(segment_matcher, text, begin, end, matches);
+                    return matches;
+                }));
+            }
+            for(auto &result: results) {
+                auto matches = result.get();
+                chunks.insert(chunks.end(), matches.begin(), matches.end());
+            }
+            return chunks;
+        }
+
+        // Encodes input text into a sequence of tokens
+        std::vector<Token> encode(std::string_view text, const bool verbose) {
+            std::string repaired;
+            auto checked = check_utf8(text, repaired);
+            auto split_text = model->split_on_special(checked.text);
+            if (verbose) {
+                std::cout << "Splitting input text into " << split_text.size() << " parts\n";
+                for(const auto &part : split_text) {
+                    std::cout << "Part: \"" << part.text << "\" special: " << part.special.has_value() << "\n";
+                }
+            }
+
+            std::vector<Token> out;
+            encode_parts(split_text, checked.invalid, out);
+            if(verbose) {
+                std::cout << "Encoded input text (length " << text.length() << ") to " << out.size() << " tokens\n";
+                std::cout << "Encode cache hits " << encode_cache_hits << ", misses " << encode_cache_misses << "\n";
+            }
+            return out;
+        }
+
+        // Encodes input text and appends its tokens to out, so that many texts can share a buffer
+        void encode_append(std::string_view text, std::vector<Token> &out) {
+            std::string repaired;
+            auto checked = check_utf8(text, repaired);
+            encode_parts(model->split_on_special(checked.text), checked.invalid, out);
+        }
+
+        /**
+         * @brief Encodes a stream in blocks, handing over the tokens of each block as soon as
+         * they are known.
+         *
+         * Each block is encoded up to the last place stream_cut finds where the text before
+         * cannot encode differently once more is read: after a special token, or for the gpt2
+         * and gpt4 patterns at a safe boundary between lines or words. The rest is carried over
+         * to the next block, so text with no such place is held until one comes. The tokens
+         * are the same as encoding the whole stream at once. Each block is checked for invalid
+         * UTF-8 as it is read, in whole characters, see check_utf8.
+         * @param in The stream to read text from.
+         * @param write Called with each block's tokens, as a std::span<const Token>.
+         * @param block_size How many bytes to read at a time.
+         * @throws std::runtime_error if reading the stream fails, or if it is not valid UTF-8
+         * under InvalidUtf8::Reject.
+         */
+        template<typename F>
+        void encode_stream(std::istream &in, F &&write, size_t block_size = default_stream_block_size) {
+            std::string buffer;
+            std::vector<Token> out;
+            std::vector<Segment> segments;
+            size_t offset = 0;     // Where the buffer starts in the stream
+            size_t checked = 0;    // Bytes at the start of the buffer already checked for invalid UTF-8
+            size_t scanned = 0;    // Bytes at the start of the buffer already searched for a cut
+            bool invalid = false;  // Whether the checked bytes hold invalid UTF-8 kept as raw bytes
+            bool end_of_input = false;
+            while (!end_of_input) {
+                auto size = buffer.size();
+                buffer.resize(size + block_size);
+                in.read(buffer.data() + size, block_size);
+                buffer.resize(size + in.gcount());
+                if (in.bad()) {
+                    throw std::runtime_error("Failed to read the input stream");
+                }
+                end_of_input = !in;
+
+                // A character cut off at the end of the block is checked once the rest is read
+                size_t complete = end_of_input ? buffer.size() : buffer.size() - MinBpeCC::Util::incomplete_utf8_suffix(buffer);
+                if (complete > checked) {
+                    std::string repaired;
+                    auto block = check_utf8(std::string_view(buffer).substr(checked, complete - checked), repaired, offset + checked);
+                    if (!repaired.empty()) {
+                        buffer.replace(checked, complete - checked, repaired);
+                        complete = checked + repaired.size();
+                    }
+                    invalid = invalid || block.invalid;
+                    checked = complete;
+                }
+
+                std::string_view text(buffer.data(), complete);
+                size_t cut = end_of_input ? text.size() : stream_cut(text, scanned);
+                if (cut == 0) {
+                    continue;
+                }
+                // The part the cut falls in runs on to the next special token, so that the
+                // matches before the cut see the text after it
+                auto segment_size = parallel_segment_size(cut);
+                segments.clear();
+                size_t pos = 0;
+                while (pos < cut) {
+                    auto special = model->find_special(text, pos);
+                    size_t part_end = special ? special->position : text.size();
+                    add_text_segments(text.substr(pos, part_end - pos), std::min(part_end, cut) - pos, segment_size, invalid, segments);
+                    if (!special || special->position >= cut) {
+                        break;
+                    }
+                    segments.push_back(Segment{text.substr(special->position, special->length), 0, special->length, special->token});
+                    pos = special->position + special->length;
+                }
+
+                out.clear();
+                encode_segments(segments, segment_size != 0, out);
+                write(std::span<const Token>(out));
+                if (invalid) {
+                    invalid = MinBpeCC::Util::find_invalid_utf8(text.substr(cut, checked - cut)) != std::string_view::npos;
+                }
+                buffer.erase(0, cut);
+                offset += cut;
+                checked -= cut;
+                scanned = scanned > cut ? scanned - cut : 0;
+            }
+        }
+
+        // Decodes a sequence of tokens back into a string
+        std::string decode(std::span<const Token> tokens, const bool verbose) const {
+            return model->decode(tokens, verbose);
+        }
+    };
+}
+#endif
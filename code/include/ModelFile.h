@@ -0,0 +1,257 @@
+#ifndef MINBPE_MODELFILE_HPP
+#define MINBPE_MODELFILE_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MINBPE_HAS_MMAP
+#endif
+
+namespace MinBpeCC::Util {
+
+/**
+ * @class MappedFile
+ * @brief A file mapped read only into memory, unmapped when the object goes.
+ *
+ * The pages are shared with every other process that maps the same file and are read from
+ * disk only as they are touched. Where mmap is not available the file is read into memory.
+ */
+class MappedFile {
+private:
+    const char *bytes = nullptr;
+    size_t size = 0;
+    std::vector<char> buffer; // The file's contents where it could not be mapped
+
+public:
+    /**
+     * @throws std::runtime_error if the file cannot be opened or mapped.
+     */
+    explicit MappedFile(const std::filesystem::path &path) {
+#if defined(MINBPE_HAS_MMAP)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error("Failed to open " + path.string());
+        }
+        struct stat status;
+        if(::fstat(fd, &status) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to read the size of " + path.string());
+        }
+        size = static_cast<size_t>(status.st_size);
+        if(size > 0) {
+            void *mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if(mapped == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Failed to map " + path.string());
+            }
+            bytes = static_cast<const char *>(mapped);
+        }
+        ::close(fd);
+#else
+        std::ifstream file(path, std::ios::binary);
+        if(!file) {
+            throw std::runtime_error("Failed to open " + path.string());
+        }
+        buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        bytes = buffer.data();
+        size = buffer.size();
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(MINBPE_HAS_MMAP)
+        if(bytes != nullptr) {
+            ::munmap(const_cast<char *>(bytes), size);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::string_view data() const {
+        return std::string_view(bytes, size);
+    }
+};
+
+// --- Binary model files ---
+// A header, then each section of the model at a multiple of 64 bytes. Every table is laid
+// out as it is held in memory, so loading checks the header and points the model at the
+// sections. The file is written in the byte order and token size of the machine that writes
+// it, and a machine that differs in either refuses to load it.
+
+// The sections of a binary model file, in the order they are written
+enum class ModelSection : uint32_t {
+    Pattern,        // The split pattern's text
+    SpecialTokens,  // For each special token its id, its length and its bytes
+    Merges,         // The pair each token from 256 on was merged from
+    MergeTable,     // MergeTable slots
+    VocabSpans,     // Offset and length of each token's bytes
+    VocabBytes,     // The bytes of every token back to back
+    VocabLookup,    // Hash table from token bytes to tokens
+    FirstEdge,      // The VocabAutomaton tables
+    EdgeBytes,
+    EdgeTargets,
+    NodeToken,
+    TokenLength,
+    NextPrefix,
+    Reachable,
+    Count
+};
+
+struct ModelFileHeader {
+    static constexpr std::array<char, 8> expected_magic{'m', 'i', 'n', 'b', 'p', 'e', 'b', '\0'};
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t native_byte_order = 0x01020304;
+
+    struct Section {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t token_size;
+    uint32_t section_count;
+    uint64_t max_token_length;
+    std::array<Section, static_cast<size_t>(ModelSection::Count)> sections;
+};
+
+/**
+ * @brief Checks whether a file starts like a binary model file.
+ */
+inline bool is_binary_model_file(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary);
+    std::array<char, 8> magic{};
+    return file.read(magic.data(), magic.size()) && magic == ModelFileHeader::expected_magic;
+}
+
+/**
+ * @class ModelFileWriter
+ * @brief Lays out the sections of a binary model file and writes them.
+ */
+class ModelFileWriter {
+private:
+    static constexpr size_t alignment = 64;
+
+    ModelFileHeader header{};
+    std::string contents;
+
+public:
+    ModelFileWriter(uint32_t token_size, uint64_t max_token_length) {
+        header.magic = ModelFileHeader::expected_magic;
+        header.version = ModelFileHeader::current_version;
+        header.byte_order = ModelFileHeader::native_byte_order;
+        header.token_size = token_size;
+        header.section_count = static_cast<uint32_t>(ModelSection::Count);
+        header.max_token_length = max_token_length;
+        contents.resize(sizeof(ModelFileHeader));
+    }
+
+    // Sets a section to the bytes of items, which must be written in the order of ModelSection
+    template<typename T>
+    void add(ModelSection section, std::span<const T> items) {
+        contents.resize((contents.size() + alignment - 1) / alignment * alignment, '\0');
+        header.sections[static_cast<size_t>(section)] = {contents.size(), items.size_bytes()};
+        contents.append(reinterpret_cast<const char *>(items.data()), items.size_bytes());
+    }
+
+    /**
+     * @brief Writes the file next to path under another name, then renames it to path. A model
+     * that has a file already at path mapped keeps the old one, which would otherwise change
+     * under it, and readers never see the file half written.
+     * @return false if the file could not be written.
+     */
+    bool write(const std::filesystem::path &path) {
+        std::memcpy(contents.data(), &header, sizeof(header));
+        auto temporary = path;
+        temporary += ".tmp" + std::to_string(std::random_device()());
+        std::error_code error;
+        bool written;
+        {
+            std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+            written = file.write(contents.data(), static_cast<std::streamsize>(contents.size())) && file.flush();
+        }
+        if(written) {
+            std::filesystem::rename(temporary, path, error);
+        }
+        if(!written || error) {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * @class ModelFileReader
+ * @brief Finds the sections of a binary model file in place.
+ */
+class ModelFileReader {
+private:
+    std::string_view contents;
+    ModelFileHeader header;
+
+public:
+    /**
+     * @throws std::runtime_error if the header is not one this build can use.
+     */
+    ModelFileReader(std::string_view contents, uint32_t token_size) : contents(contents) {
+        if(contents.size() < sizeof(ModelFileHeader)) {
+            throw std::runtime_error("Model file is too short");
+        }
+        std::memcpy(&header, contents.data(), sizeof(header));
+        if(header.magic != ModelFileHeader::expected_magic) {
+            throw std::runtime_error("Not a binary model file");
+        }
+        if(header.version != ModelFileHeader::current_version) {
+            throw std::runtime_error("Unsupported binary model version " + std::to_string(header.version));
+        }
+        if(header.byte_order != ModelFileHeader::native_byte_order || header.token_size != token_size) {
+            throw std::runtime_error("Binary model was written for a different byte order or token size");
+        }
+        if(header.section_count != static_cast<uint32_t>(ModelSection::Count)) {
+            throw std::runtime_error("Binary model has an unexpected number of sections");
+        }
+        for(const auto &section : header.sections) {
+            if(section.offset > contents.size() || section.size > contents.size() - section.offset) {
+                throw std::runtime_error("Binary model section runs past the end of the file");
+            }
+        }
+    }
+
+    uint64_t max_token_length() const {
+        return header.max_token_length;
+    }
+
+    // A section's bytes as items of type T, used in place
+    template<typename T>
+    std::span<const T> section(ModelSection id) const {
+        const auto &[offset, size] = header.sections[static_cast<size_t>(id)];
+        const char *start = contents.data() + offset;
+        if(size % sizeof(T) != 0 || reinterpret_cast<uintptr_t>(start) % alignof(T) != 0) {
+            throw std::runtime_error("Binary model section has the wrong size or alignment");
+        }
+        return std::span<const T>(reinterpret_cast<const T *>(start), size / sizeof(T));
+    }
+};
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_MODELFILE_HPP
@@ -10,8 +10,12 @@
 #include <boost/multi_index/member.hpp>
 #include <limits>
 #include <vector>
+#include <set>
+#include <algorithm>
 #include <cstdint>
 
+#include "FlatArray.h"
+
 using std::pair;
 using std::optional;
 
@@ -23,6 +27,10 @@ namespace MinBpeCC::Util {
  *
  * This class provides a contract for different implementations of pair frequency counters.
  * It allows for querying counts, modifying pairs, and retrieving the most frequent pair.
+ * A pair is removed as soon as its count drops to zero or below, so a pair that occurs again
+ * later is inserted afresh, as it would be into a dict of counts rebuilt from the text.
+ * The implementations are final, so code that is templated on the concrete class (as the
+ * training loop is) calls them directly rather than through this interface.
  */
 template<typename T>
 class PairCount {
@@ -33,12 +41,42 @@ public:
     // Gets the total number of unique pairs stored.
     virtual size_t get_count() = 0;
 
+    // Gets the number of pairs held with a positive count.
+    virtual size_t get_live_count() = 0;
+
+    // Gets the number of entries held that no longer stand for a pair with a positive count,
+    // and are waiting to be cleaned up.
+    virtual size_t get_dead_count() = 0;
+
     // Retrieves the count for a specific pair.
     virtual optional<int> get_pair(pair<T,T> mp) = 0;
 
     // Creates a new pair or modifies the frequency of an existing one.
     virtual bool create_or_modify_pair(T a, T b, int freq) = 0;
 
+    // As above, but also records (freq > 0) or forgets (freq < 0) an occurrence of the pair
+    // at the given position in the training text. Implementations that do not order pairs
+    // by position just ignore it.
+    virtual bool create_or_modify_pair_at(T a, T b, int freq, size_t /*position*/) {
+        return create_or_modify_pair(a, b, freq);
+    }
+
+    // As above for a batch of occurrences found at once, such as in the initial count.
+    virtual bool create_or_modify_pair_at(T a, T b, int freq, const std::vector<size_t> &/*positions*/) {
+        return create_or_modify_pair(a, b, freq);
+    }
+
+    // Adds freq to the count of a pair, creating it if needed, and returns the new count.
+    // This looks the pair up once, where create_or_modify_pair followed by get_pair would
+    // look it up twice.
+    virtual int add_to_pair(T a, T b, int freq) = 0;
+
+    // As above, also recording or forgetting an occurrence at a position in the same way as
+    // create_or_modify_pair_at.
+    virtual int add_to_pair_at(T a, T b, int freq, size_t /*position*/) {
+        return add_to_pair(a, b, freq);
+    }
+
     // Gets the pair with the highest count.
     virtual optional<pair<T,T>> get_top_pair_count() = 0;
 
@@ -51,11 +89,14 @@ public:
 // This implementation breaks ties based on the insertion order.
 
 // Struct to hold the pair, its count, and its insertion order.
+// When occurrences are tracked by position the insertion order is the first position
+// the pair currently occurs at, which is the order a full rescan would insert it in.
 template<typename T>
 struct PairCountOrder {
     ::pair<T,T> pair;
     int count;
     size_t insert_order;
+    std::set<size_t> positions;
 
     PairCountOrder(::pair<T,T> p, int c, size_t fo) : pair(p), count(c), insert_order(fo) {}
     PairCountOrder(::pair<T,T> p, int c) : pair(p), count(c), insert_order(std::numeric_limits<size_t>::max()) {}
@@ -99,11 +140,48 @@ using PairCountStore = boost::multi_index_container<
  * pairs, sorted primarily by their frequency count and secondarily by when they were first added.
  */
 template<typename T>
-class PairCountInsertOrder : public PairCount<T> {
+class PairCountInsertOrder final : public PairCount<T> {
 private:
     PairCountStore<T> pcs;
     size_t next_insert = 0;
 
+    // Applies update to a pair if it exists, otherwise inserts the one made by create. An
+    // existing pair is found and modified with a single hash lookup. The pair is erased if its
+    // count is no longer positive. Returns the pair's new count and whether it was created.
+    template<typename Update, typename Create>
+    std::pair<int, bool> upsert(pair<T,T> mp, Update update, Create create) {
+        auto& index_by_key = pcs.template get<0>();
+        auto f = index_by_key.find(mp);
+        bool created = f == index_by_key.end();
+        if(created) {
+            f = pcs.insert(create()).first;
+        } else {
+            index_by_key.modify(f, update);
+        }
+        int count = (*f).count;
+        if(count <= 0) {
+            index_by_key.erase(f);
+        }
+        return {count, created};
+    }
+
+    // Adds freq to a pair and records (freq > 0) or forgets an occurrence at position
+    std::pair<int, bool> upsert_at(pair<T,T> mp, int freq, size_t position) {
+        return upsert(mp, [freq, position](PairCountOrder<T>& pc) {
+            pc.count += freq;
+            if(freq > 0) {
+                pc.positions.insert(position);
+            } else {
+                pc.positions.erase(position);
+            }
+            pc.insert_order = pc.positions.empty() ? std::numeric_limits<size_t>::max() : *pc.positions.begin();
+        }, [&]() {
+            PairCountOrder<T> pco(mp, freq, position);
+            pco.positions.insert(position);
+            return pco;
+        });
+    }
+
 public:
     PairCountInsertOrder() {}
 
@@ -115,6 +193,23 @@ public:
         return pcs.size();
     }
 
+    /**
+     * @brief Gets the number of pairs with a positive count, which is every pair stored.
+     * @return The number of pairs.
+     */
+    size_t get_live_count() override {
+        return pcs.size();
+    }
+
+    /**
+     * @brief Gets the number of dead entries. Pairs are erased as soon as their count drops to
+     * zero, so there are none.
+     * @return Zero.
+     */
+    size_t get_dead_count() override {
+        return 0;
+    }
+
     /**
      * @brief Gets the frequency count of a given pair.
      * @param mp The pair to look up.
@@ -132,7 +227,8 @@ public:
 
     /**
      * @brief Adds a new pair or modifies the count of an existing pair.
-     * If a pair is new, its insertion order is recorded.
+     * If a pair is new, its insertion order is recorded. A pair whose count is no longer
+     * positive is removed, and gets a new insertion order if it is added again.
      * @param a The first element of the pair.
      * @param b The second element of the pair.
      * @param freq The value to add to the pair's count (can be negative).
@@ -140,15 +236,69 @@ public:
      */
     bool create_or_modify_pair(T a, T b, int freq) override {
         pair<T,T> mp = {a, b};
-        auto& index_by_key = pcs.template get<0>();
-        auto f = index_by_key.find(mp);
-        if(f != pcs.end()) {
-            index_by_key.modify(f, [freq](PairCountOrder<T>& pc) { pc.count += freq; });
-            return false;
-        } else {
-            pcs.insert(PairCountOrder<T>(mp, freq, next_insert++));
-            return true;
-        }
+        return upsert(mp, [freq](PairCountOrder<T>& pc) { pc.count += freq; },
+              [&]() { return PairCountOrder<T>(mp, freq, next_insert++); }).second;
+    }
+
+    /**
+     * @brief Adds to the count of a pair, creating it if it is new.
+     * @param a The first element of the pair.
+     * @param b The second element of the pair.
+     * @param freq The value to add to the pair's count (can be negative).
+     * @return The pair's new count.
+     */
+    int add_to_pair(T a, T b, int freq) override {
+        pair<T,T> mp = {a, b};
+        return upsert(mp, [freq](PairCountOrder<T>& pc) { pc.count += freq; },
+              [&]() { return PairCountOrder<T>(mp, freq, next_insert++); }).first;
+    }
+
+    /**
+     * @brief Adds or modifies a pair and tracks where it occurs.
+     *
+     * Karpathy's trainer recounts every pair after each merge, so a pair is inserted into the
+     * Python dict when it is first seen scanning the text from the start. That makes its
+     * insertion order the lowest position it currently occurs at. Keeping the set of positions
+     * for each pair reproduces that order incrementally, including for a pair whose count
+     * dropped to zero and that later occurs again somewhere else.
+     * @param a The first element of the pair.
+     * @param b The second element of the pair.
+     * @param freq The value to add to the pair's count (can be negative).
+     * @param position The position of the occurrence being added (freq > 0) or removed.
+     * @return True if the pair was newly created, false if it already existed.
+     */
+    bool create_or_modify_pair_at(T a, T b, int freq, size_t position) override {
+        return upsert_at({a, b}, freq, position).second;
+    }
+
+    /**
+     * @brief Adds to the count of a pair and tracks where it occurs, as create_or_modify_pair_at.
+     * @return The pair's new count.
+     */
+    int add_to_pair_at(T a, T b, int freq, size_t position) override {
+        return upsert_at({a, b}, freq, position).first;
+    }
+
+    /**
+     * @brief Adds or modifies a pair that occurs at several new positions at once.
+     * @param a The first element of the pair.
+     * @param b The second element of the pair.
+     * @param freq The value to add to the pair's count.
+     * @param positions The positions of the new occurrences, ideally in ascending order.
+     * @return True if the pair was newly created, false if it already existed.
+     */
+    bool create_or_modify_pair_at(T a, T b, int freq, const std::vector<size_t> &positions) override {
+        pair<T,T> mp = {a, b};
+        auto add = [freq, &positions](PairCountOrder<T>& pc) {
+            pc.count += freq;
+            pc.positions.insert(positions.begin(), positions.end());
+            pc.insert_order = pc.positions.empty() ? std::numeric_limits<size_t>::max() : *pc.positions.begin();
+        };
+        return upsert(mp, add, [&]() {
+            PairCountOrder<T> pco(mp, 0);
+            add(pco);
+            return pco;
+        }).second;
     }
 
     /**
@@ -225,10 +375,29 @@ using PairCountLexicalStore = boost::multi_index_container<
  * NOTE: This is a stub implementation and is not yet functional.
  */
 template<typename T>
-class PairCountLexicalOrder : public PairCount<T> {
+class PairCountLexicalOrder final : public PairCount<T> {
 private:
     PairCountLexicalStore<T> pcs;
 
+    // Adds freq to a pair, creating it if needed. An existing pair is found and modified with a
+    // single hash lookup. The pair is erased if its count is no longer positive. Returns the
+    // pair's new count and whether it was created.
+    std::pair<int, bool> upsert(pair<T,T> mp, int freq) {
+        auto& index_by_key = pcs.template get<0>();
+        auto f = index_by_key.find(mp);
+        bool created = f == index_by_key.end();
+        if(created) {
+            f = pcs.insert(PairCountLexical<T>(mp, freq)).first;
+        } else {
+            index_by_key.modify(f, [freq](PairCountLexical<T>& pc) { pc.count += freq; });
+        }
+        int count = (*f).count;
+        if(count <= 0) {
+            index_by_key.erase(f);
+        }
+        return {count, created};
+    }
+
 public:
     PairCountLexicalOrder() {}
 
@@ -236,6 +405,15 @@ public:
         return pcs.size();
     }
 
+    size_t get_live_count() override {
+        return pcs.size();
+    }
+
+    // Pairs are erased as soon as their count drops to zero
+    size_t get_dead_count() override {
+        return 0;
+    }
+
     [[nodiscard]] optional<int> get_pair(pair<T,T> mp) override {
         auto& index_by_key = pcs.template get<0>();
         auto f = index_by_key.find(mp);
@@ -247,16 +425,11 @@ public:
     }
 
     bool create_or_modify_pair(T a, T b, int freq) override {
-        pair<T,T> mp = {a, b};
-        auto& index_by_key = pcs.template get<0>();
-        auto f = index_by_key.find(mp);
-        if(f != pcs.end()) {
-            index_by_key.modify(f, [freq](PairCountLexical<T>& pc) { pc.count += freq; });
-            return false;
-        } else {
-            pcs.insert(PairCountLexical<T>(mp, freq));
-            return true;
-        }
+        return upsert({a, b}, freq).second;
+    }
+
+    int add_to_pair(T a, T b, int freq) override {
+        return upsert({a, b}, freq).first;
     }
 
     optional<pair<T,T>> get_top_pair_count() override {
@@ -278,6 +451,317 @@ public:
     }
 };
 
+
+// --- Implementation: PairCountFlat ---
+// Stores counts in a flat open addressing hash table keyed on the two elements of the pair
+// packed into 64 bits, instead of node based Boost.MultiIndex indexes, and finds the top pair
+// with a lazily invalidated max-heap instead of an ordered index that is rebalanced on every
+// update. Ties can be broken either way.
+
+/**
+ * @class PairCountFlat
+ * @brief An implementation of PairCount using a flat hash table and a lazy max-heap.
+ *
+ * Every time a pair's priority (count, then tie break order) goes up a new heap entry is pushed
+ * for it. Entries are never updated when a priority goes down, so an entry can only overestimate
+ * the pair's real priority. When the top entry does not match its pair any more it is replaced
+ * with an up to date one, and once the top entry is up to date no other pair can beat it.
+ * A pair whose count drops to zero is deleted from the table straight away, while its heap
+ * entries are left to be dropped when they reach the top or the heap is compacted.
+ * The element type must fit in 32 bits.
+ */
+template<typename T>
+class PairCountFlat final : public PairCount<T> {
+public:
+    enum class TieBreak {
+        INSERT_ORDER, // Same as PairCountInsertOrder
+        LEXICAL       // Same as PairCountLexicalOrder
+    };
+
+private:
+    static_assert(sizeof(T) <= sizeof(uint32_t), "PairCountFlat packs pairs into 64 bits");
+    static constexpr uint64_t empty_key = std::numeric_limits<uint64_t>::max();
+    static constexpr size_t no_order = std::numeric_limits<size_t>::max();
+
+    struct HeapEntry {
+        int count;
+        size_t order;
+        uint64_t key;
+    };
+
+    // Heap comparison, the greatest entry has the highest count then the lowest order
+    struct CompareHeapEntry {
+        bool operator()(const HeapEntry& a, const HeapEntry& b) const {
+            if(a.count == b.count) {
+                return a.order > b.order;
+            } else {
+                return a.count < b.count;
+            }
+        }
+    };
+
+    TieBreak tie_break;
+    // Hash table slots, parallel arrays indexed by slot
+    std::vector<uint64_t> keys;
+    std::vector<int> counts;
+    std::vector<size_t> orders;
+    std::vector<std::set<size_t>> positions; // Only used when tracking positions
+    size_t used = 0;
+    size_t next_insert = 0;
+    std::vector<HeapEntry> heap;
+
+    static uint64_t pack(T a, T b) {
+        return pack_pair(static_cast<uint32_t>(a), static_cast<uint32_t>(b));
+    }
+
+    // The slot a key is placed in when there are no collisions
+    size_t home_slot(uint64_t key) const {
+        return hash_pair(key) & (keys.size() - 1);
+    }
+
+    size_t slot_for(uint64_t key) const {
+        size_t mask = keys.size() - 1;
+        size_t slot = home_slot(key);
+        while(keys[slot] != empty_key && keys[slot] != key) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void grow() {
+        auto old_keys = std::move(keys);
+        auto old_counts = std::move(counts);
+        auto old_orders = std::move(orders);
+        auto old_positions = std::move(positions);
+        size_t capacity = std::max<size_t>(old_keys.size() * 2, 64);
+        keys.assign(capacity, empty_key);
+        counts.assign(capacity, 0);
+        orders.assign(capacity, no_order);
+        positions.clear();
+        if(!old_positions.empty()) {
+            positions.resize(capacity);
+        }
+        for(size_t i = 0; i < old_keys.size(); i++) {
+            if(old_keys[i] != empty_key) {
+                auto slot = slot_for(old_keys[i]);
+                keys[slot] = old_keys[i];
+                counts[slot] = old_counts[i];
+                orders[slot] = old_orders[i];
+                if(!old_positions.empty()) {
+                    positions[slot] = std::move(old_positions[i]);
+                }
+            }
+        }
+    }
+
+    // Finds the slot for a pair, creating it if needed. Sets created if it was.
+    size_t find_or_create(uint64_t key, bool &created) {
+        if((used + 1) * 2 > keys.size()) {
+            grow();
+        }
+        auto slot = slot_for(key);
+        created = keys[slot] == empty_key;
+        if(created) {
+            keys[slot] = key;
+            counts[slot] = 0;
+            orders[slot] = tie_break == TieBreak::LEXICAL ? key : next_insert++;
+            used++;
+        }
+        return slot;
+    }
+
+    // Deletes the pair in a slot. Rather than leaving a tombstone, later pairs in the same run
+    // of slots are shifted back into the gap when that is still on their probe path, so the
+    // table never fills up with deleted entries.
+    void erase_slot(size_t slot) {
+        size_t mask = keys.size() - 1;
+        size_t hole = slot;
+        for(size_t next = (slot + 1) & mask; keys[next] != empty_key; next = (next + 1) & mask) {
+            // The pair at next can move to the hole if the hole is between its home and next
+            if(((next - home_slot(keys[next])) & mask) >= ((next - hole) & mask)) {
+                keys[hole] = keys[next];
+                counts[hole] = counts[next];
+                orders[hole] = orders[next];
+                if(!positions.empty()) {
+                    positions[hole] = std::move(positions[next]);
+                }
+                hole = next;
+            }
+        }
+        keys[hole] = empty_key;
+        counts[hole] = 0;
+        orders[hole] = no_order;
+        if(!positions.empty()) {
+            positions[hole].clear();
+        }
+        used--;
+    }
+
+    // Deletes the pair in a slot if its count is no longer positive, returning the count
+    int collect(size_t slot) {
+        int count = counts[slot];
+        if(count <= 0) {
+            erase_slot(slot);
+        }
+        return count;
+    }
+
+    void push(size_t slot) {
+        if(counts[slot] > 0) {
+            heap.push_back(HeapEntry{counts[slot], orders[slot], keys[slot]});
+            std::push_heap(heap.begin(), heap.end(), CompareHeapEntry());
+        }
+    }
+
+    // Rebuilds the heap from the table once stale entries outnumber the live ones
+    void compact_heap() {
+        if(heap.size() > 2 * used + 1024) {
+            heap.clear();
+            for(size_t slot = 0; slot < keys.size(); slot++) {
+                if(keys[slot] != empty_key && counts[slot] > 0) {
+                    heap.push_back(HeapEntry{counts[slot], orders[slot], keys[slot]});
+                }
+            }
+            std::make_heap(heap.begin(), heap.end(), CompareHeapEntry());
+        }
+    }
+
+    // Adds an occurrence position, or removes one, updating the order. Returns true if the
+    // order went down (so the priority went up).
+    bool update_positions(size_t slot, int freq, size_t position) {
+        if(positions.size() != keys.size()) {
+            positions.resize(keys.size());
+        }
+        auto old_order = orders[slot];
+        if(freq > 0) {
+            positions[slot].insert(position);
+        } else {
+            positions[slot].erase(position);
+        }
+        orders[slot] = positions[slot].empty() ? no_order : *positions[slot].begin();
+        return orders[slot] < old_order;
+    }
+
+    // Adds freq to a pair, returning its new count
+    int add(uint64_t key, int freq, bool &created) {
+        auto slot = find_or_create(key, created);
+        counts[slot] += freq;
+        if(freq > 0) {
+            push(slot);
+        }
+        return collect(slot);
+    }
+
+    // Adds freq to a pair occurring at position, returning its new count
+    int add_at(uint64_t key, int freq, size_t position, bool &created) {
+        if(tie_break == TieBreak::LEXICAL) {
+            return add(key, freq, created);
+        }
+        auto slot = find_or_create(key, created);
+        counts[slot] += freq;
+        bool order_went_down = update_positions(slot, freq, position);
+        if(freq > 0 || order_went_down) {
+            push(slot);
+        }
+        return collect(slot);
+    }
+
+public:
+    explicit PairCountFlat(TieBreak tie_break) : tie_break(tie_break) {}
+
+    size_t get_count() override {
+        return used;
+    }
+
+    size_t get_live_count() override {
+        return used;
+    }
+
+    // Every live pair has at least one heap entry, any others are stale
+    size_t get_dead_count() override {
+        return heap.size() > used ? heap.size() - used : 0;
+    }
+
+    [[nodiscard]] optional<int> get_pair(pair<T,T> mp) override {
+        if(keys.empty()) {
+            return {};
+        }
+        auto slot = slot_for(pack(mp.first, mp.second));
+        if(keys[slot] != empty_key) {
+            return counts[slot];
+        } else {
+            return {};
+        }
+    }
+
+    bool create_or_modify_pair(T a, T b, int freq) override {
+        bool created;
+        add(pack(a, b), freq, created);
+        return created;
+    }
+
+    int add_to_pair(T a, T b, int freq) override {
+        bool created;
+        return add(pack(a, b), freq, created);
+    }
+
+    bool create_or_modify_pair_at(T a, T b, int freq, size_t position) override {
+        bool created;
+        add_at(pack(a, b), freq, position, created);
+        return created;
+    }
+
+    int add_to_pair_at(T a, T b, int freq, size_t position) override {
+        bool created;
+        return add_at(pack(a, b), freq, position, created);
+    }
+
+    bool create_or_modify_pair_at(T a, T b, int freq, const std::vector<size_t> &new_positions) override {
+        if(tie_break == TieBreak::LEXICAL) {
+            return create_or_modify_pair(a, b, freq);
+        }
+        bool created;
+        auto slot = find_or_create(pack(a, b), created);
+        counts[slot] += freq;
+        if(positions.size() != keys.size()) {
+            positions.resize(keys.size());
+        }
+        positions[slot].insert(new_positions.begin(), new_positions.end());
+        orders[slot] = positions[slot].empty() ? no_order : *positions[slot].begin();
+        push(slot);
+        collect(slot);
+        return created;
+    }
+
+    optional<pair<T,T>> get_top_pair_count() override {
+        compact_heap();
+        while(!heap.empty()) {
+            auto top = heap.front();
+            auto slot = slot_for(top.key);
+            if(counts[slot] == top.count && orders[slot] == top.order) {
+                return pair<T,T>(static_cast<T>(top.key >> 32), static_cast<T>(top.key & 0xFFFFFFFFull));
+            }
+            // Stale, replace it with the pair's current priority. A deleted pair has an empty
+            // slot with a count of zero, so nothing is pushed for it.
+            std::pop_heap(heap.begin(), heap.end(), CompareHeapEntry());
+            heap.pop_back();
+            push(slot);
+        }
+        return {};
+    }
+
+    std::vector<std::vector<T>> get_all() override {
+        std::vector<std::vector<T>> result;
+        result.reserve(used);
+        for(size_t slot = 0; slot < keys.size(); slot++) {
+            if(keys[slot] != empty_key) {
+                result.push_back({static_cast<T>(keys[slot] >> 32), static_cast<T>(keys[slot] & 0xFFFFFFFFull), static_cast<T>(counts[slot])});
+            }
+        }
+        return result;
+    }
+};
+
 } // namespace MinBpeCC::Util
 
 #endif // MINBPE_PAIRCOUNT_HPP
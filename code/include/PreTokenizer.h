@@ -0,0 +1,280 @@
+#ifndef MINBPE_PRETOKENIZER_HPP
+#define MINBPE_PRETOKENIZER_HPP
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "ByteKernels.h"
+#include "UnicodeRanges.h"
+
+namespace MinBpeCC::Util {
+
+// The split patterns PreTokenizer has a scanner for
+enum class SplitPattern {
+    GPT2,
+    GPT4
+};
+
+/**
+ * @class PreTokenizer
+ * @brief Splits text into the chunks the gpt2 or gpt4 regex would, without running a regex.
+ *
+ * Each alternative of the patterns is a run of one class of characters, so a hand written
+ * scanner can find the same matches by looking at the class of each character once, instead
+ * of calling PCRE2 for every chunk. ASCII characters are classified with a table and the rest
+ * by searching the ranges PCRE2 itself uses. The matches are exactly those PCRE2 finds for
+ * valid UTF-8; a byte that does not start a valid character is taken as a character of its
+ * own of class Other.
+ */
+class PreTokenizer {
+private:
+    static constexpr std::array<CharClass, 128> ascii_classes = [] {
+        std::array<CharClass, 128> classes{};
+        for(size_t c = 0; c < 128; c++) {
+            if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+                classes[c] = CharClass::Letter;
+            } else if(c >= '0' && c <= '9') {
+                classes[c] = CharClass::Number;
+            } else if(c == ' ' || (c >= '\t' && c <= '\r')) {
+                classes[c] = CharClass::Space;
+            }
+        }
+        return classes;
+    }();
+
+    SplitPattern split_pattern;
+
+    // Decodes the character at pos, returning its class and setting length to its bytes
+    static CharClass class_at(std::string_view text, size_t pos, size_t &length) {
+        auto c = static_cast<uint8_t>(text[pos]);
+        if(c < 0x80) {
+            length = 1;
+            return ascii_classes[c];
+        }
+        uint32_t code_point;
+        if(c >= 0xC2 && c <= 0xDF) {
+            length = 2;
+            code_point = c & 0x1F;
+        } else if(c >= 0xE0 && c <= 0xEF) {
+            length = 3;
+            code_point = c & 0x0F;
+        } else if(c >= 0xF0 && c <= 0xF4) {
+            length = 4;
+            code_point = c & 0x07;
+        } else {
+            length = 1;
+            return CharClass::Other;
+        }
+        if(pos + length > text.size()) {
+            length = 1;
+            return CharClass::Other;
+        }
+        for(size_t i = 1; i < length; i++) {
+            auto continuation = static_cast<uint8_t>(text[pos + i]);
+            if((continuation & 0xC0) != 0x80) {
+                length = 1;
+                return CharClass::Other;
+            }
+            code_point = (code_point << 6) | (continuation & 0x3F);
+        }
+        return class_of(code_point);
+    }
+
+    // The end of the run of characters of class char_class starting at pos. ASCII characters
+    // are taken 16 at a time with ascii_class_mask while there are 16 bytes left, and the
+    // character a mask stops at is decoded to see whether the run carries on past it.
+    static size_t run_end(std::string_view text, size_t pos, CharClass char_class) {
+        size_t length;
+        while(pos < text.size()) {
+            if(pos + 16 <= text.size()) {
+                auto run = std::countr_one(ascii_class_mask(text.data() + pos, char_class));
+                pos += run;
+                if(run == 16) {
+                    continue;
+                }
+            }
+            if(class_at(text, pos, length) != char_class) {
+                break;
+            }
+            pos += length;
+        }
+        return pos;
+    }
+
+    // The end of a run of \r and \n starting at pos
+    static size_t newlines_end(std::string_view text, size_t pos) {
+        while(pos < text.size() && (text[pos] == '\r' || text[pos] == '\n')) {
+            pos++;
+        }
+        return pos;
+    }
+
+    // The end of \s+(?!\S)|\s+ matched at pos, where a whitespace character is. The run is
+    // taken whole at the end of the text, and otherwise without its last character so that
+    // character can start the next match, unless it is the only one.
+    static size_t spaces_end(std::string_view text, size_t pos) {
+        size_t last = pos;
+        size_t length;
+        size_t end = pos;
+        while(end < text.size()) {
+            if(end + 16 <= text.size()) {
+                auto run = std::countr_one(ascii_class_mask(text.data() + end, CharClass::Space));
+                if(run > 0) {
+                    end += run;
+                    last = end - 1;
+                    if(run == 16) {
+                        continue;
+                    }
+                }
+            }
+            if(class_at(text, end, length) != CharClass::Space) {
+                break;
+            }
+            last = end;
+            end += length;
+        }
+        return end == text.size() || last == pos ? end : last;
+    }
+
+    // The end of the contraction '(?:[sdmt]|ll|ve|re) at pos, or pos if there is none. For gpt4
+    // the letters are caseless, which for PCRE2 also lets U+017F (long s) match s.
+    static size_t contraction_end(std::string_view text, size_t pos, bool caseless) {
+        auto lower = [caseless](char c) {
+            return caseless && c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
+        };
+        if(pos + 1 >= text.size()) {
+            return pos;
+        }
+        char first = lower(text[pos + 1]);
+        if(first == 's' || first == 'd' || first == 'm' || first == 't') {
+            return pos + 2;
+        }
+        if(caseless && text.substr(pos + 1, 2) == "\xC5\xBF") {
+            return pos + 3;
+        }
+        if(pos + 2 < text.size()) {
+            char second = lower(text[pos + 2]);
+            if((first == 'l' && second == 'l') || (first == 'v' && second == 'e') || (first == 'r' && second == 'e')) {
+                return pos + 3;
+            }
+        }
+        return pos;
+    }
+
+    // The end of the match of
+    // '(?:[sdmt]|ll|ve|re)| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+ at pos
+    static size_t gpt2_match_end(std::string_view text, size_t pos) {
+        if(text[pos] == '\'') {
+            auto end = contraction_end(text, pos, false);
+            if(end != pos) {
+                return end;
+            }
+        }
+        size_t length;
+        auto char_class = class_at(text, pos, length);
+        if(text[pos] == ' ' && pos + 1 < text.size()) {
+            // A space goes with the letters, numbers or other characters that follow it
+            size_t next_length;
+            auto next = class_at(text, pos + 1, next_length);
+            if(next != CharClass::Space) {
+                return run_end(text, pos + 1 + next_length, next);
+            }
+        }
+        if(char_class == CharClass::Space) {
+            return spaces_end(text, pos);
+        }
+        return run_end(text, pos + length, char_class);
+    }
+
+    // The end of the match of
+    // '(?i:[sdmt]|ll|ve|re)|[^\r\n\p{L}\p{N}]?+\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]++[\r\n]*|
+    // \s*[\r\n]|\s+(?!\S)|\s+ at pos
+    static size_t gpt4_match_end(std::string_view text, size_t pos) {
+        if(text[pos] == '\'') {
+            auto end = contraction_end(text, pos, true);
+            if(end != pos) {
+                return end;
+            }
+        }
+        size_t length;
+        auto char_class = class_at(text, pos, length);
+        if(char_class == CharClass::Letter) {
+            return run_end(text, pos + length, CharClass::Letter);
+        }
+        if(char_class == CharClass::Number) {
+            size_t end = pos + length;
+            for(int count = 1; count < 3 && end < text.size() && class_at(text, end, length) == CharClass::Number; count++) {
+                end += length;
+            }
+            return end;
+        }
+        if(text[pos] != '\r' && text[pos] != '\n' && pos + length < text.size()) {
+            // Any one character but a newline goes with the letters that follow it
+            size_t next_length;
+            auto next = class_at(text, pos + length, next_length);
+            if(next == CharClass::Letter) {
+                return run_end(text, pos + length + next_length, CharClass::Letter);
+            }
+            if(text[pos] == ' ' && next == CharClass::Other) {
+                return newlines_end(text, run_end(text, pos + 1 + next_length, CharClass::Other));
+            }
+        }
+        if(char_class == CharClass::Other) {
+            return newlines_end(text, run_end(text, pos + length, CharClass::Other));
+        }
+        // Whitespace up to and including its last newline, if it has one
+        size_t newline_end = pos;
+        size_t end = pos;
+        while(end < text.size() && class_at(text, end, length) == CharClass::Space) {
+            end += length;
+            if(text[end - 1] == '\r' || text[end - 1] == '\n') {
+                newline_end = end;
+            }
+        }
+        if(newline_end != pos) {
+            return newline_end;
+        }
+        return spaces_end(text, pos);
+    }
+
+public:
+    explicit PreTokenizer(SplitPattern split_pattern) : split_pattern(split_pattern) {
+    }
+
+    /**
+     * @brief The class PCRE2 gives a code point.
+     */
+    static CharClass class_of(uint32_t code_point) {
+        if(code_point < 0x80) {
+            return ascii_classes[code_point];
+        }
+        auto range = std::upper_bound(std::begin(unicode_ranges), std::end(unicode_ranges), code_point,
+              [](uint32_t value, const CodePointRange &r) { return value < r.first; });
+        if(range == std::begin(unicode_ranges) || code_point > (range - 1)->last) {
+            return CharClass::Other;
+        }
+        return (range - 1)->char_class;
+    }
+
+    /**
+     * @brief Appends the chunks of text that start in [begin, end) to matches, as
+     * Matcher::find_matches does. Matching looks at the whole text, so a chunk that starts
+     * before end may run past it.
+     */
+    void find_matches(std::string_view text, size_t begin, size_t end, std::vector<std::string_view> &matches) const {
+        size_t pos = begin;
+        while(pos < end) {
+            size_t match_end = split_pattern == SplitPattern::GPT2 ? gpt2_match_end(text, pos) : gpt4_match_end(text, pos);
+            matches.push_back(text.substr(pos, match_end - pos));
+            pos = match_end;
+        }
+    }
+};
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_PRETOKENIZER_HPP
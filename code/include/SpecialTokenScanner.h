@@ -0,0 +1,181 @@
+#ifndef MINBPE_SPECIALTOKENSCANNER_HPP
+#define MINBPE_SPECIALTOKENSCANNER_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace MinBpeCC::Util {
+
+/**
+ * @class SpecialTokenScanner
+ * @brief Finds special tokens in text in a single pass, however many there are.
+ *
+ * The tokens are compiled into an Aho-Corasick automaton with every transition filled in, so
+ * each byte of text costs one table lookup. Matches are leftmost-longest: the token that starts
+ * first wins, and the longest one between tokens starting at the same place. While no token is
+ * partly matched the scanner jumps to the next byte that can start one, with memchr when all
+ * the tokens start with the same byte, as chat formats such as "<|...|>" do.
+ */
+template<typename T>
+class SpecialTokenScanner {
+public:
+    // Where a token occurs in the text
+    struct Match {
+        size_t position;
+        size_t length;
+        T token;
+    };
+
+private:
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    std::vector<uint32_t> transitions;  // 256 per state, the root first
+    std::vector<uint32_t> depth;        // Length of the token prefix each state has matched
+    std::vector<uint32_t> match_length; // Longest token ending at each state, 0 for none
+    std::vector<T> match_token;
+    std::array<bool, 256> first_bytes{};
+    int first_byte = -1; // The byte all tokens start with, -1 if they differ
+
+    // The first position at or after pos where a token could start
+    size_t next_start(std::string_view text, size_t pos) const {
+        if(first_byte >= 0) {
+            auto found = std::memchr(text.data() + pos, first_byte, text.size() - pos);
+            return found == nullptr ? text.size() : static_cast<const char *>(found) - text.data();
+        }
+        while(pos < text.size() && !first_bytes[static_cast<uint8_t>(text[pos])]) {
+            pos++;
+        }
+        return pos;
+    }
+
+public:
+    SpecialTokenScanner() = default;
+
+    /**
+     * @brief Builds the automaton for a set of tokens.
+     * @param tokens The text of each token and its id, in any order. Empty tokens are ignored.
+     */
+    template<typename Tokens>
+    void build(const Tokens &tokens) {
+        transitions.assign(256, none);
+        depth.assign(1, 0);
+        match_length.assign(1, 0);
+        match_token.assign(1, T{});
+        first_bytes.fill(false);
+        first_byte = -1;
+        bool mixed = false;
+
+        // The trie, with missing transitions left as none
+        for(const auto &[text, token] : tokens) {
+            if(text.empty()) {
+                continue;
+            }
+            auto byte = static_cast<uint8_t>(text[0]);
+            first_bytes[byte] = true;
+            if(first_byte >= 0 && first_byte != byte) {
+                mixed = true;
+            }
+            first_byte = byte;
+            uint32_t state = 0;
+            for(char c : text) {
+                auto &next = transitions[state * 256 + static_cast<uint8_t>(c)];
+                if(next == none) {
+                    next = static_cast<uint32_t>(depth.size());
+                    depth.push_back(depth[state] + 1);
+                    match_length.push_back(0);
+                    match_token.push_back(T{});
+                    transitions.resize(transitions.size() + 256, none);
+                }
+                state = transitions[state * 256 + static_cast<uint8_t>(c)];
+            }
+            match_length[state] = static_cast<uint32_t>(text.size());
+            match_token[state] = token;
+        }
+        if(mixed) {
+            first_byte = -1;
+        }
+
+        // Fill in the missing transitions breadth first from the failure links. A state's
+        // failure state is shallower, so its transitions and matches are already complete.
+        std::vector<uint32_t> failure(depth.size(), 0);
+        std::vector<uint32_t> queue;
+        for(size_t byte = 0; byte < 256; byte++) {
+            auto &next = transitions[byte];
+            if(next == none) {
+                next = 0;
+            } else {
+                queue.push_back(next);
+            }
+        }
+        for(size_t i = 0; i < queue.size(); i++) {
+            auto state = queue[i];
+            if(match_length[state] == 0) {
+                match_length[state] = match_length[failure[state]];
+                match_token[state] = match_token[failure[state]];
+            }
+            for(size_t byte = 0; byte < 256; byte++) {
+                auto &next = transitions[state * 256 + byte];
+                auto fallback = transitions[failure[state] * 256 + byte];
+                if(next == none) {
+                    next = fallback;
+                } else {
+                    failure[next] = fallback;
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Checks whether there are no tokens to find.
+     */
+    bool empty() const {
+        return depth.size() <= 1;
+    }
+
+    /**
+     * @brief Finds the first token in text at or after pos.
+     * @param text The text to search.
+     * @param pos Where to start searching.
+     * @return The leftmost-longest match, if there is one.
+     */
+    std::optional<Match> find(std::string_view text, size_t pos) const {
+        std::optional<Match> best;
+        if(empty()) {
+            return best;
+        }
+        uint32_t state = 0;
+        while(pos < text.size()) {
+            if(state == 0) {
+                pos = next_start(text, pos);
+                if(pos == text.size()) {
+                    break;
+                }
+            }
+            state = transitions[state * 256 + static_cast<uint8_t>(text[pos])];
+            pos++;
+            if(match_length[state] != 0) {
+                size_t start = pos - match_length[state];
+                if(!best || start < best->position || (start == best->position && match_length[state] > best->length)) {
+                    best = Match{start, match_length[state], match_token[state]};
+                }
+            }
+            // Once every token still being matched starts after the best match it is final
+            if(best && best->position < pos - depth[state]) {
+                return best;
+            }
+        }
+        return best;
+    }
+};
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_SPECIALTOKENSCANNER_HPP
@@ -4,8 +4,9 @@
 #include <algorithm>
 #include <unordered_map>
 #include <string>
+#include <string_view>
 #include <functional>
-#include <forward_list>
+#include <span>
 #include <memory>
 #include <vector>
 #include <cassert>
@@ -16,11 +17,13 @@
 #include <optional> // Using std::optional
 #include <stdexcept> // For std::runtime_error
 #include <cstdint>
-
-#define PCRE2_CODE_UNIT_WIDTH 8
-#include <pcre2.h> // Main PCRE2 header
+#include <limits>
+#include <cctype>
+#include <future>
 
 #include "PairCount.h" // Assuming this is a local header
+#include "Model.h"
+#include "WorkStealingPool.h"
 
 using std::string;
 using std::unordered_map;
@@ -35,18 +38,66 @@ using std::make_pair;
 using namespace MinBpeCC::Util; // Assuming this namespace contains PairCount
 
 namespace MinBpeCC::Tokenizer {
-    using Token = uint32_t; // Here it is safe to change to uint16_t and other types as needed, 
-                            // but be sure to not have any special tokens that exceed the range.
-    using TokenPair = std::pair<Token, Token>;
-
-    // Hash function for std::pair<int,int>
-    inline std::function<std::size_t(const TokenPair&)> pair_token_hash =
-        [](const TokenPair& k) -> std::size_t {
-            std::size_t seed = 0;
-            std::hash<Token> hasher;
-            seed ^= hasher(std::get<0>(k)) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-            seed ^= hasher(std::get<1>(k)) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
-            return seed;
+    // A token in a training chunk along with its offset in the original chunk. When a pair is
+    // merged the new token keeps the offset of the left token, so offsets keep ordering the
+    // symbols of a chunk the same way however many merges have been applied.
+    struct Symbol {
+        Token token;
+        uint32_t offset;
+    };
+
+    // The symbols of every training chunk stored back to back in one array. Merging a pair
+    // compacts a chunk in place, so each chunk keeps its start and only its length shrinks.
+    struct TrainingChunks {
+        vector<Symbol> symbols;
+        vector<size_t> starts;
+        vector<uint32_t> lengths;
+
+        // Appends a chunk
+        void add(const vector<Token> &chunk) {
+            assert(chunk.size() <= std::numeric_limits<uint32_t>::max());
+            starts.push_back(symbols.size());
+            lengths.push_back(chunk.size());
+            for(uint32_t offset = 0; offset < chunk.size(); offset++) {
+                symbols.push_back(Symbol{chunk[offset], offset});
+            }
+        }
+
+        // Gets the current symbols of a chunk
+        std::span<Symbol> chunk(size_t i) {
+            return {symbols.data() + starts[i], lengths[i]};
+        }
+
+        std::span<const Symbol> chunk(size_t i) const {
+            return {symbols.data() + starts[i], lengths[i]};
+        }
+
+        size_t size() const {
+            return starts.size();
+        }
+    };
+
+    // The tokens of a batch of texts in one buffer: those of text i are
+    // tokens[offsets[i], offsets[i + 1])
+    struct EncodedBatch {
+        vector<Token> tokens;
+        vector<size_t> offsets;
+
+        // Gets the tokens of text i
+        std::span<const Token> operator[](size_t i) const {
+            return {tokens.data() + offsets[i], offsets[i + 1] - offsets[i]};
+        }
+
+        size_t size() const {
+            return offsets.empty() ? 0 : offsets.size() - 1;
+        }
+
+        // Whether the offsets start at 0, never go back and end at the end of the tokens, so
+        // that every text's tokens are within them
+        bool is_valid() const {
+            return !offsets.empty() && offsets.front() == 0 && std::is_sorted(offsets.begin(), offsets.end()) &&
+                offsets.back() == tokens.size();
+        }
     };
 
     class Tokenizer {
@@ -55,93 +106,165 @@ namespace MinBpeCC::Tokenizer {
             FIRST,
             LEXICAL
         };
+        // Which PairCount implementation holds the pair counts during training
+        enum PAIR_COUNT_STORE {
+            BOOST, // PairCountInsertOrder or PairCountLexicalOrder
+            FLAT   // PairCountFlat
+        };
+        // How save writes a model
+        enum MODEL_FORMAT {
+            TEXT,  // minbpe v1, the pattern, special tokens and merges as text
+            BINARY // Every table the model uses, laid out to be mapped in place, see ModelFile.h
+        };
     public:
-        inline const static std::string GPT2_SPLIT_PATTERN = "'(?:[sdmt]|ll|ve|re)| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)|\\s+";
-        inline const static std::string GPT4_SPLIT_PATTERN = "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+";
+        inline const static std::string GPT2_SPLIT_PATTERN = MinBpeCC::Tokenizer::GPT2_SPLIT_PATTERN;
+        inline const static std::string GPT4_SPLIT_PATTERN = MinBpeCC::Tokenizer::GPT4_SPLIT_PATTERN;
     protected:
         static const auto bucket_size = 10;
 
-        std::unordered_map<std::string, Token> special_tokens;
-        std::unordered_map<Token, std::string> special_tokens_reverse_lookup;
+        // The current model, replaced as a whole when training, loading or setting special tokens
+        std::shared_ptr<const Model> model;
+        // Session that encode and decode run in, switched over whenever the model is replaced
+        Session session;
 
-        pcre2_code_8* compiled_pattern_pcre2;     // Compiled PCRE2 pattern
-        pcre2_match_data_8* match_data_pcre2;     // Match data block for results
+        // Number of threads used to split text with the regex pattern, count pairs and merge them
+        size_t num_threads = 1;
+        PAIR_COUNT_STORE pair_count_store = PAIR_COUNT_STORE::BOOST;
 
-        pcre2_general_context_8* general_context_pcre2;
-        pcre2_compile_context_8* compile_context_pcre2;
-        pcre2_match_context_8* match_context_pcre2;
+        // Smallest number of chunks worth counting or merging pairs in on their own thread
+        size_t min_shard_chunks = 1 << 12;
 
-        unordered_map<TokenPair, Token, decltype(pair_token_hash)> merges_lookup;
-        vector<TokenPair> merges;
-        vector<vector<Token>> vocab;
-        string pattern; // The string representation of the regex pattern
+        void set_model(std::shared_ptr<const Model> new_model) {
+            model = std::move(new_model);
+            session.set_model(model);
+        }
 
-        // Helper to convert char to int, handling negative char values
-        Token char_to_token(char c) {
-            return c < 0 ? c + 256 : c;
+        // Sets how long a chunk must be to be encoded by backtracking rather than merging
+        void set_backtrack_min_length(size_t length) {
+            session.set_backtrack_min_length(length);
         }
 
-        // Same as above but uses string views for performance
-        std::vector<Token> text_to_vector(std::string_view text) {
-            if (!text.empty() && text[0] == '\0') {
-                try {
-                    int id = std::stoi(std::string(text.substr(1)));
-                    return std::vector<Token>{static_cast<Token>(id)};
-                } catch (...) {
-                    // Fallback: treat as normal text if parsing fails
-                }
-            }
-            std::vector<Token> text_converted;
-            text_converted.reserve(text.length()); // Reserve space to prevent reallocations
-            for (char c : text) {
-                text_converted.push_back(static_cast<Token>(char_to_token(c)));
+        // Sets how many chunks a thread must have to count or merge pairs in them on its own
+        void set_min_shard_chunks(size_t chunks) {
+            min_shard_chunks = std::max<size_t>(chunks, 1);
+        }
+
+        // Converts a vector of vector of ints (chunks) to training chunks
+        TrainingChunks create_training_chunks(const vector<vector<Token>> &chunks) {
+            TrainingChunks training_chunks;
+            training_chunks.starts.reserve(chunks.size());
+            training_chunks.lengths.reserve(chunks.size());
+            for(const auto &chunk: chunks) {
+                training_chunks.add(chunk);
             }
-            return text_converted;
+            return training_chunks;
+        }
+
+        // Position of a symbol in the training text, ordered by chunk then by offset
+        static size_t symbol_position(size_t chunk_index, const Symbol &symbol) {
+            return (chunk_index << 32) | symbol.offset;
         }
 
-        // Initializes the vocabulary with 256 byte tokens
-        void initialize_vocab() {
-            vocab.clear();
-            vocab.reserve(256); // Reserve space for initial bytes
-            for(int i = 0; i < 256; i++) {
-                vector<Token> s;
-                s.push_back(i);
-                vocab.push_back(s);
+        // Maps each pair to the indices of the chunks it occurs in, in ascending order. Entries can
+        // be stale (the pair was merged away in that chunk) which only costs a wasted scan.
+        using PairIndex = unordered_map<TokenPair, vector<size_t>, decltype(pair_token_hash)>;
+
+        // Records that a pair occurs in a chunk. Chunks are always visited in ascending order,
+        // so if the chunk is already recorded it is the last entry.
+        static void index_pair(PairIndex &index, TokenPair mp, size_t chunk_index) {
+            auto &chunk_indices = index[mp];
+            if(chunk_indices.empty() || chunk_indices.back() != chunk_index) {
+                chunk_indices.push_back(chunk_index);
             }
         }
 
-        // Converts a vector of vector of ints (chunks) to a vector of forward_list of ints
-        auto create_lists(const vector<vector<Token>> &chunks) {
-            vector<std::forward_list<Token>> flists;
-            flists.reserve(chunks.size()); // Reserve space
-            for(const auto &chunk: chunks) {
-                std::forward_list<Token> flist;
-                // Copy in reverse to use front_inserter efficiently
-                std::copy(chunk.rbegin(), chunk.rend(), std::front_inserter(flist));
-                flists.push_back(flist);
+        // Builds the index of which chunks each pair occurs in
+        PairIndex create_pair_index(const TrainingChunks &chunks) {
+            PairIndex index(bucket_size, pair_token_hash);
+            for(size_t c = 0; c < chunks.size(); c++) {
+                auto chunk = chunks.chunk(c);
+                for(size_t i = 0; i + 1 < chunk.size(); i++) {
+                    index_pair(index, make_pair(chunk[i].token, chunk[i + 1].token), c);
+                }
             }
-            return flists;
+            return index;
         }
 
-        // Calculates frequencies of adjacent pairs in the chunks
-        std::unique_ptr<PairCount<Token>> calculate_freqs(const vector<std::forward_list<Token>> &chunks, CONFLICT_RESOLUTION conflict_resolution) {
-          std::unique_ptr<PairCount<Token>> freqs;
-          if (conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
-              freqs = std::make_unique<PairCountInsertOrder<Token>>();
-          } else { // LEXICAL
-              freqs = std::make_unique<PairCountLexicalOrder<Token>>();
-          }
+        // Count and positions of a pair gathered by one thread in the initial count
+        struct LocalPairCount {
+            int count = 0;
+            vector<size_t> positions;
+        };
+        // Keyed on both tokens of the pair packed into 64 bits
+        using LocalPairCounts = unordered_map<uint64_t, LocalPairCount>;
+
+        // Counts the pairs in chunks [begin, end). Positions are only needed for first
+        // occurrence ordering, and come out in ascending order.
+        template<bool with_positions>
+        static LocalPairCounts count_pairs(const TrainingChunks &chunks, const vector<int> &counts,
+              size_t begin, size_t end) {
+            LocalPairCounts local;
+            for(size_t c = begin; c < end; c++) {
+                auto chunk = chunks.chunk(c);
+                for(size_t i = 0; i + 1 < chunk.size(); i++) {
+                    auto &lpc = local[pack_pair(chunk[i].token, chunk[i + 1].token)];
+                    lpc.count += counts[c];
+                    if constexpr (with_positions) {
+                        lpc.positions.push_back(symbol_position(c, chunk[i]));
+                    }
+                }
+            }
+            return local;
+        }
 
-            for(const auto &chunk: chunks) {
-                auto p1 = chunk.begin();
-                auto p2 = std::next(p1);
-                while(p1 != chunk.end() && p2 != chunk.end()) {
-                    auto p = make_pair(*p1, *p2);
-                    freqs->create_or_modify_pair(*p1, *p2, 1);
-                    ++p1;
-                    ++p2;
+        // Adds the frequencies of adjacent pairs in the chunks to freqs, each chunk standing for
+        // counts[i] identical occurrences of it in the training text. Each thread counts a
+        // contiguous range of chunks into its own table, then the tables are added up in chunk
+        // order (which keeps the positions of each pair ascending) and moved into the store.
+        template<bool with_positions, typename Store>
+        void add_pair_freqs(const TrainingChunks &chunks, const vector<int> &counts, Store &freqs) {
+            size_t shards = std::max<size_t>(std::min(num_threads, chunks.size() / min_shard_chunks), 1);
+            vector<std::future<LocalPairCounts>> results;
+            for(size_t i = 1; i < shards; i++) {
+                results.push_back(std::async(std::launch::async, count_pairs<with_positions>, std::cref(chunks), std::cref(counts),
+                      chunks.size() * i / shards, chunks.size() * (i + 1) / shards));
+            }
+            auto total = count_pairs<with_positions>(chunks, counts, 0, chunks.size() / shards);
+            for(auto &result: results) {
+                for(auto &[key, lpc]: result.get()) {
+                    auto &tpc = total[key];
+                    tpc.count += lpc.count;
+                    tpc.positions.insert(tpc.positions.end(), lpc.positions.begin(), lpc.positions.end());
                 }
             }
+
+            for(const auto &[key, lpc]: total) {
+                freqs.create_or_modify_pair_at(static_cast<Token>(key >> 32), static_cast<Token>(key), lpc.count, lpc.positions);
+            }
+        }
+
+        // Creates the pair count store selected by pair_count_store and conflict_resolution
+        std::unique_ptr<PairCount<Token>> create_pair_count(CONFLICT_RESOLUTION conflict_resolution) const {
+            if (pair_count_store == PAIR_COUNT_STORE::FLAT) {
+                return std::make_unique<PairCountFlat<Token>>(conflict_resolution == CONFLICT_RESOLUTION::FIRST ?
+                      PairCountFlat<Token>::TieBreak::INSERT_ORDER : PairCountFlat<Token>::TieBreak::LEXICAL);
+            } else if (conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
+                return std::make_unique<PairCountInsertOrder<Token>>();
+            } else { // LEXICAL
+                return std::make_unique<PairCountLexicalOrder<Token>>();
+            }
+        }
+
+        // Calculates frequencies of adjacent pairs in the chunks into a new store, used through
+        // the virtual PairCount interface. Training uses add_pair_freqs on a concrete store instead.
+        std::unique_ptr<PairCount<Token>> calculate_freqs(const TrainingChunks &chunks, const vector<int> &counts,
+              CONFLICT_RESOLUTION conflict_resolution) {
+            auto freqs = create_pair_count(conflict_resolution);
+            if (conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
+                add_pair_freqs<true>(chunks, counts, *freqs);
+            } else {
+                add_pair_freqs<false>(chunks, counts, *freqs);
+            }
             return freqs;
         }
 
@@ -158,315 +281,308 @@ namespace MinBpeCC::Tokenizer {
             }
         }
 
-        // Merges a specific pair within a single forward_list then completly update frequencies
-        void merge(std::forward_list<Token> &text, TokenPair mp, Token new_token, PairCount<Token> *freqs) {
-            auto verbose = 0; // Control verbosity for debugging
-            if(verbose >= 2) {
-                cout << "before merge\n";
-                for(auto c: text) {
-                    cout << c << " ";
-                }
-                cout << "\n";
-            }
-
-            auto [p1_val, p2_val] = mp; // Deconstruct the pair
-            auto i1 = text.begin();
-            auto i2 = std::next(i1);
-
-            while(i1 != text.end() && i2 != text.end()) {
-                if(*i1 == p1_val && *i2 == p2_val) {
-                    if(verbose >= 1) {
-                        cout << "found pair " << p1_val << ", " << p2_val << " replace with " << new_token << "\n";
-                    }
-
-                    *i1 = new_token; // Replace the first element of the pair with the new token
-                    i2 = text.erase_after(i1); // Erase the second element
-
+        // A change to the count of a pair occurring at a position in the training text
+        struct PairDelta {
+            TokenPair pair;
+            int delta;
+            size_t position;
+        };
 
+        // Changes to the pair counts and index made while merging a range of chunks. They are
+        // collected without touching the store or the index so that separate ranges can be
+        // merged on separate threads, then applied in one step.
+        template<bool with_positions>
+        struct MergeDeltas {
+            unordered_map<uint64_t, int> totals;      // Summed per pair when positions are not needed
+            vector<PairDelta> positioned;             // Every change in order when they are
+            vector<pair<TokenPair, size_t>> created;  // Pairs created by the merge and their chunk
+
+            void add(TokenPair mp, int delta, size_t position) {
+                if constexpr (with_positions) {
+                    positioned.push_back(PairDelta{mp, delta, position});
                 } else {
-                    // Advance iterators if no merge occurred
-                    i1 = i2;
-                    i2 = std::next(i2);
-                }
-            }
-            if(verbose >= 2) {
-                cout << "after merge\n";
-                for(auto c: text) {
-                    cout << c << " ";
+                    totals[pack_pair(mp.first, mp.second)] += delta;
                 }
-                cout << "\n";
             }
-        }
+        };
 
-        // Merges a specific pair within a single forward_list, updating frequencies incrementally
-        void merge_incremental(std::forward_list<Token> &text, TokenPair mp, Token new_token, PairCount<Token> *freqs) {
+        // Merges a specific pair within a single chunk, recording the changes to the frequencies.
+        // Every pair that is removed or created is reported with the position of its first
+        // symbol so that the first occurrence ordering can be maintained without a recount.
+        // Each change in frequency is weighted by the number of times the chunk occurs.
+        // The chunk is compacted in place: symbols are read at i and written back at out, so
+        // text[out - 1] is always the symbol now to the left of the one being looked at.
+        template<bool with_positions>
+        void merge_incremental(TrainingChunks &chunks, size_t chunk_index, int count, TokenPair mp, Token new_token,
+              MergeDeltas<with_positions> &deltas) {
             auto verbose = 0; // Control verbosity for debugging
+            auto text = chunks.chunk(chunk_index);
             if(verbose >= 2) {
                 cout << "before merge\n";
                 for(auto c: text) {
-                    cout << c << " ";
+                    cout << c.token << " ";
                 }
                 cout << "\n";
             }
 
             auto [p1_val, p2_val] = mp; // Deconstruct the pair
-            auto i0 = text.before_begin();
-            auto i1 = text.begin();
-            auto i2 = std::next(i1);
-
-            if(i2 == text.end()) {
-                // No pairs to merge
-                return;
-            }
-
-            auto i3 = std::next(i2);
+            size_t len = text.size();
+            size_t out = 0;
+            size_t i = 0;
 
-            while(i1 != text.end() && i2 != text.end()) {
-                if(false) { // verbose >= 1) {
-                    cout << "i0 " << (i0 != text.before_begin() ? std::to_string(*i0) : "B_BEGIN")
-                         << " i1 " << *i1 << " i2 " << *i2
-                         << " i3 " << (i3 == text.end() ? "?" : std::to_string(*i3)) << "\n";
-                }
-
-                if(*i1 == p1_val && *i2 == p2_val) {
+            while(i < len) {
+                if(i + 1 < len && text[i].token == p1_val && text[i + 1].token == p2_val) {
                     if(verbose >= 1) {
                         cout << "found pair " << p1_val << ", " << p2_val << " replace with " << new_token << "\n";
                     }
 
-                    *i1 = new_token; // Replace the first element of the pair with the new token
-                    i2 = text.erase_after(i1); // Erase the second element
+                    auto pos1 = symbol_position(chunk_index, text[i]);
+                    auto pos2 = symbol_position(chunk_index, text[i + 1]);
 
                     // Update frequencies: decrement old pairs, increment new ones
-                    auto f = freqs->get_pair(mp);
-                    if(f.has_value()) {
-                        if(verbose >= 1) {
-                            cout << "decrement replaced pair " << mp.first << ", " << mp.second << "\n";
-                        }
-                        freqs->create_or_modify_pair(mp.first, mp.second, -1);
-                    }
+                    deltas.add(mp, -count, pos1);
 
-                    if(i0 != text.before_begin()) { // Check if i0 is a valid element (not before_begin())
-                        auto prev_pair = make_pair(*i0, p1_val);
-                        auto prev = freqs->get_pair(prev_pair);
-                        if(prev.has_value()) {
-                            if(verbose >= 1) {
-                                cout << "decrement previous pair " << *i0 << ", " << p1_val << "\n";
-                            }
-                            freqs->create_or_modify_pair(*i0, p1_val, -1);
-                        }
+                    if(out > 0) { // There is a symbol before the pair
+                        const auto &prev = text[out - 1];
+                        auto pos0 = symbol_position(chunk_index, prev);
                         if(verbose >= 1) {
-                            cout << "increment new previous pair " << *i0 << ", " << new_token << "\n";
+                            cout << "replace previous pair " << prev.token << ", " << p1_val << " with " << prev.token << ", " << new_token << "\n";
                         }
-                        freqs->create_or_modify_pair(*i0, new_token, 1);
+                        deltas.add(make_pair(prev.token, p1_val), -count, pos0);
+                        deltas.add(make_pair(prev.token, new_token), count, pos0);
+                        deltas.created.push_back({make_pair(prev.token, new_token), chunk_index});
                     }
 
-                    if(i2 != text.end()) { // Check if i2 is a valid element (not end())
-                        auto next_pair = make_pair(p2_val, *i2); // Original p2_val, not new_token
-                        auto next = freqs->get_pair(next_pair);
-                        if(next.has_value()) {
-                            if(verbose >= 1) {
-                                cout << "decrement next pair " << p2_val << ", " << *i2 << "\n";
-                            }
-                            freqs->create_or_modify_pair(p2_val, *i2, -1);
-                        } else {
-                            if(verbose >= 1) {
-                                cout << "next pair not found " << p2_val << ", " << *i2 << "\n";
-                            }
-                        }
+                    if(i + 2 < len) { // There is a symbol after the pair
+                        const auto &next = text[i + 2];
                         if(verbose >= 1) {
-                            cout << "increment new next pair " << new_token << ", " << *i2 << "\n";
+                            cout << "replace next pair " << p2_val << ", " << next.token << " with " << new_token << ", " << next.token << "\n";
                         }
-                        freqs->create_or_modify_pair(new_token, *i2, 1);
+                        deltas.add(make_pair(p2_val, next.token), -count, pos2); // Original p2_val, not new_token
+                        deltas.add(make_pair(new_token, next.token), count, pos1);
+                        deltas.created.push_back({make_pair(new_token, next.token), chunk_index});
                     }
 
-                    // Iterators are already adjusted by erase_after,
-                    // just make sure i3 points correctly if it's not end()
-                    if (i2 != text.end()) {
-                        i3 = std::next(i2);
-                    } else {
-                        i3 = text.end(); // If i2 is now end, i3 is also end
-                    }
+                    // The merged token keeps the offset of the left token
+                    text[out++] = Symbol{new_token, text[i].offset};
+                    i += 2;
                 } else {
-                    // Advance iterators if no merge occurred
-                    i0 = i1;
-                    i1 = i2;
-                    i2 = i3;
-                    if (i3 != text.end()) {
-                        i3 = std::next(i3);
-                    }
+                    text[out++] = text[i++];
                 }
             }
+            chunks.lengths[chunk_index] = out;
+
             if(verbose >= 2) {
                 cout << "after merge\n";
-                for(auto c: text) {
-                    cout << c << " ";
+                for(auto c: chunks.chunk(chunk_index)) {
+                    cout << c.token << " ";
                 }
                 cout << "\n";
             }
         }
 
-        // Merges a specific pair across all forward_lists in chunks
-        void merge_chunks(vector<std::forward_list<Token>> &chunks, TokenPair mp, Token idx, PairCount<Token> *freqs,
-              CONFLICT_RESOLUTION conflict_resolution) {
-            for(auto &chunk: chunks) {
-              if (conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
-                  merge(chunk, mp, idx, freqs);
-              } else if(conflict_resolution == CONFLICT_RESOLUTION::LEXICAL) {
-                  merge_incremental(chunk, mp, idx, freqs);
-              } else {
-                  throw std::runtime_error("Unknown conflict resolution strategy");
-              }
+        // Merges the chunks at chunk_indices[begin, end)
+        template<bool with_positions>
+        MergeDeltas<with_positions> merge_range(TrainingChunks &chunks, const vector<int> &counts, const vector<size_t> &chunk_indices,
+              size_t begin, size_t end, TokenPair mp, Token idx) {
+            MergeDeltas<with_positions> deltas;
+            for(size_t i = begin; i < end; i++) {
+                auto c = chunk_indices[i];
+                merge_incremental(chunks, c, counts[c], mp, idx, deltas);
             }
+            return deltas;
         }
 
-        // Internal encoding function that applies merges recursively
-        // NOTE: This version was directly called in the original encode,
-        // but now `encode` will first split with regex, then use this.
-        vector<Token> internal_internal_encode(const vector<Token> &text) {
-            if (text.size() < 2) { // Nothing to merge if less than 2 elements
-                return text;
+        // Merges a specific pair across the chunks it occurs in. Only pairs containing the new
+        // token are created by a merge, and the merged pair can never be created again, so its
+        // index entry is no longer needed afterwards.
+        // When there are enough chunks they are merged on several threads, each taking a
+        // contiguous range of them. The chunks are independent so only the changes to the counts
+        // need combining. Ranges are combined in order, which keeps the index sorted, and in
+        // lexical mode each pair's count in the store is then changed once per merge.
+        template<bool with_positions, typename Store>
+        void merge_pair(TrainingChunks &chunks, const vector<int> &counts, PairIndex &index, TokenPair mp, Token idx,
+              Store &freqs) {
+            auto found = index.find(mp);
+            if(found == index.end()) {
+                return;
             }
+            auto chunk_indices = std::move(found->second);
+            index.erase(found);
 
-            vector<Token> out;
-            out.reserve(text.size()); // Pre-allocate for efficiency
-            int i = 0;
-            int merge_count = 0;
-            auto len = text.size();
-
-            while(i < len) {
-                bool merged_this_iter = false;
-                if(i < len - 1) { // Check if there's a pair
-                    auto current_pair = make_pair(text[i], text[i + 1]);
-                    auto it = merges_lookup.find(current_pair);
-                    if(it != merges_lookup.end()) {
-                        if (false) { // Set to `verbose` if desired
-                            cout << "found pair " << std::get<0>(current_pair) << ", " << std::get<1>(current_pair) << " replace with " << it->second << "\n";
-                        }
-                        out.push_back(it->second); // Add the new merged token
-                        i += 2; // Skip the two merged elements
-                        merge_count++;
-                        merged_this_iter = true;
-                    }
+            size_t shards = std::max<size_t>(std::min(num_threads, chunk_indices.size() / min_shard_chunks), 1);
+            auto n = chunk_indices.size();
+            vector<std::future<MergeDeltas<with_positions>>> results;
+            for(size_t i = 1; i < shards; i++) {
+                results.push_back(std::async(std::launch::async, &Tokenizer::merge_range<with_positions>, this, std::ref(chunks),
+                      std::cref(counts), std::cref(chunk_indices), n * i / shards, n * (i + 1) / shards, mp, idx));
+            }
+            auto deltas = merge_range<with_positions>(chunks, counts, chunk_indices, 0, n / shards, mp, idx);
+            for(auto &result: results) {
+                auto range_deltas = result.get();
+                for(const auto &[key, delta]: range_deltas.totals) {
+                    deltas.totals[key] += delta;
                 }
+                deltas.positioned.insert(deltas.positioned.end(), range_deltas.positioned.begin(), range_deltas.positioned.end());
+                deltas.created.insert(deltas.created.end(), range_deltas.created.begin(), range_deltas.created.end());
+            }
 
-                if (!merged_this_iter) {
-                    if (false) { // Set to `verbose` if desired
-                        cout << "no pair " << text[i] << " replace with " << text[i] << "\n";
-                    }
-                    out.push_back(text[i]); // Add the single element
-                    i++;
+            for(const auto &[created_pair, c]: deltas.created) {
+                index_pair(index, created_pair, c);
+            }
+            for(const auto &pd: deltas.positioned) {
+                freqs.add_to_pair_at(pd.pair.first, pd.pair.second, pd.delta, pd.position);
+            }
+            for(const auto &[key, delta]: deltas.totals) {
+                if(delta != 0) {
+                    freqs.add_to_pair(static_cast<Token>(key >> 32), static_cast<Token>(key), delta);
                 }
             }
+        }
 
-            // Recursively apply merges until no more merges are found
-            if(merge_count == 0) {
-                return out;
+        // Version of merge_pair for a store only known through the virtual PairCount interface
+        void merge_chunks(TrainingChunks &chunks, const vector<int> &counts, PairIndex &index, TokenPair mp, Token idx,
+              PairCount<Token> *freqs, CONFLICT_RESOLUTION conflict_resolution) {
+            if(conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
+                merge_pair<true>(chunks, counts, index, mp, idx, *freqs);
             } else {
-                return internal_internal_encode(out);
+                merge_pair<false>(chunks, counts, index, mp, idx, *freqs);
             }
         }
 
-        // Applies internal encoding to a vector of chunks
-        vector<vector<Token>> internal_encode(const vector<vector<Token>> &chunks) {
-            vector<vector<Token>> encoded_chunks;
-            encoded_chunks.reserve(chunks.size()); // Pre-allocate
-            for(const auto &chunk: chunks) {
-                encoded_chunks.push_back(internal_internal_encode(chunk));
+        // Runs the merges of training against a concrete pair count store and returns them. The
+        // store's type is picked once at the top of train so the whole loop is compiled against it
+        // and the calls on the store can be inlined rather than dispatched through PairCount.
+        template<bool with_positions, typename Store>
+        vector<TokenPair> train_merges(TrainingChunks &chunks, const vector<int> &counts, Store &freqs, const int vocab_size,
+              const bool verbose) {
+            add_pair_freqs<with_positions>(chunks, counts, freqs);
+            auto index = create_pair_index(chunks);
+
+            vector<TokenPair> merges;
+            merges.reserve(vocab_size - 256); // Pre-allocate space for merges
+            vector<vector<Token>> vocab; // Bytes of each token, for printing the merges
+            for(Token i = 0; i < 256; i++) {
+                vocab.push_back({i});
             }
-            return encoded_chunks;
+
+            int total_merges = vocab_size - 256;
+            int last_percent = -1;
+            
+            for(Token i = 256; i < vocab_size; i++) {
+                auto best = freqs.get_top_pair_count();
+                if(best.has_value() && freqs.get_pair(*best).value_or(0) > 0) {
+                    auto max_pair = *best;
+                    auto [p1, p2] = max_pair;
+                    vector<Token> appended{vocab[p1]};
+                    appended.insert(appended.end(), vocab[p2].begin(), vocab[p2].end());
+                    vocab.push_back(appended);
+                    if(verbose) {
+                        auto freq = freqs.get_pair(max_pair);
+                        string new_vocab_str;
+                        new_vocab_str.reserve(appended.size());
+                        for(auto c: appended) {
+                            if(c >= 32 && c < 127) { // Printable ASCII range
+                                new_vocab_str += static_cast<char>(c);
+                            } else {
+                                new_vocab_str += ' ';
+                            }
+                        }
+                        cout << "merge " << (i - 256) + 1 << "/" << total_merges << ": (" <<  p1 << ", " << p2 << ") -> " << i << " (b'" << new_vocab_str << "') had " << (freq.has_value() ? std::to_string(freq.value()) : "0") << " occurrences\n";
+                    }
+                    merges.push_back(max_pair);
+                    merge_pair<with_positions>(chunks, counts, index, max_pair, i, freqs);
+                } else {
+                    break;
+                }
+            }
+            return merges;
+        }
+
+        // Decodes batch[i] for every i on up to num_threads threads, for either kind of batch
+        template<typename Batch>
+        vector<string> decode_each(const Batch &batch) const {
+            vector<string> decoded(batch.size());
+            WorkStealingPool(std::min(num_threads, batch.size())).run(batch.size(), [&](size_t, size_t i) {
+                decoded[i] = model->decode(batch[i], false);
+            });
+            return decoded;
+        }
+
+        // Calls f(worker, session, index) for every index in [0, count) on up to num_threads threads.
+        // Each thread encodes in a session of its own, the one on the calling thread being the
+        // tokenizer's, and single large inputs are not split again on more threads.
+        template<typename F>
+        void for_each_in_batch(size_t count, F &&f) {
+            WorkStealingPool pool(std::min(num_threads, count));
+            vector<Session> worker_sessions(pool.size() - 1, session);
+            for(auto &worker_session: worker_sessions) {
+                worker_session.set_threads(1);
+            }
+            session.set_threads(1);
+            try {
+                pool.run(count, [&](size_t worker, size_t index) {
+                    f(worker, worker == 0 ? session : worker_sessions[worker - 1], index);
+                });
+            } catch(...) {
+                session.set_threads(num_threads);
+                throw;
+            }
+            session.set_threads(num_threads);
+        }
+
+        // Splits text into chunks using the regex pattern, see Session::split_chunks
+        vector<std::string_view> split_chunks(std::string_view text, bool invalid = false) {
+            return session.split_chunks(text, invalid);
         }
 
     public:
         // Default constructor
-        Tokenizer() : merges_lookup(bucket_size, pair_token_hash),
-                      compiled_pattern_pcre2(NULL),
-                      match_data_pcre2(NULL) {
-            // Initialize PCRE2 context objects once
-            general_context_pcre2 = pcre2_general_context_create_8(NULL, NULL, NULL);
-            compile_context_pcre2 = pcre2_compile_context_create_8(general_context_pcre2);
-            match_context_pcre2 = pcre2_match_context_create_8(general_context_pcre2);
+        Tokenizer() : Tokenizer(string()) {
         };
 
         // Constructor with a specific pattern
-        Tokenizer(const string &pattern) : merges_lookup(bucket_size, pair_token_hash),
-                                            pattern(pattern),
-                                            compiled_pattern_pcre2(NULL),
-                                            match_data_pcre2(NULL) {
-            // Initialize PCRE2 context objects once
-            general_context_pcre2 = pcre2_general_context_create_8(NULL, NULL, NULL);
-            compile_context_pcre2 = pcre2_compile_context_create_8(general_context_pcre2);
-            match_context_pcre2 = pcre2_match_context_create_8(general_context_pcre2);
-
-            if (pattern.length() > 0) {
-                PCRE2_SPTR pcre2_pattern_str = reinterpret_cast<PCRE2_SPTR>(this->pattern.c_str());
-                PCRE2_SIZE erroroffset;
-                int errorcode;
-
-                // Flags for PCRE2: PCRE2_UTF for UTF-8 and PCRE2_UCP for Unicode character properties
-                // Based on the GPT patterns, these are essential for correct matching.
-                uint32_t options = PCRE2_UTF | PCRE2_UCP;
-
-                // If your patterns (e.g., GPT4_SPLIT_PATTERN_OLD) use `(?i:)`, add PCRE2_CASELESS.
-                // If they use `(?s)` (dot matches newline), add PCRE2_DOTALL.
-                // If they use `(?m)` (multiline anchors), add PCRE2_MULTILINE.
-                // For the current `GPT4_SPLIT_PATTERN = "\\p{L}"`, UTF and UCP are sufficient.
-                if (this->pattern.find("(?i:") != std::string::npos) {
-                    options |= PCRE2_CASELESS;
-                }
-                // Add more such checks if other options might be dynamically included in `pattern`
-
-                compiled_pattern_pcre2 = pcre2_compile_8(
-                    pcre2_pattern_str,           // Pointer to the pattern string
-                    (PCRE2_SIZE)this->pattern.length(), // Length of the pattern
-                    options,                     // Compile options
-                    &errorcode,                  // Where to store error code
-                    &erroroffset,                // Where to store error offset
-                    compile_context_pcre2        // Compile context
-                );
-
-                if (compiled_pattern_pcre2 == NULL) {
-                    PCRE2_UCHAR buffer[256];
-                    pcre2_get_error_message_8(errorcode, buffer, sizeof(buffer));
-                    throw std::runtime_error("PCRE2 pattern compilation failed: " + std::string(reinterpret_cast<char*>(buffer)));
-                }
+        Tokenizer(const string &pattern) : model(std::make_shared<const Model>(pattern)),
+                                            session(model) {
+        };
 
-                // --- Add this for JIT compilation ---
-                int jit_errorcode;
-                if (pcre2_jit_compile_8(compiled_pattern_pcre2, PCRE2_JIT_COMPLETE) < 0) {
-                    // JIT compilation failed or is not supported by PCRE2 build.
-                    // It's okay, PCRE2 will fall back to its interpretive engine,
-                    // but log a warning if you want.
-                    PCRE2_UCHAR buffer[256];
-                    pcre2_get_error_message_8(jit_errorcode, buffer, sizeof(buffer));
-                    std::cerr << "Warning: PCRE2 JIT compilation failed: " << reinterpret_cast<char*>(buffer) << "\n";
-                }
-                // --- End JIT addition ---
+        // The model encode and decode use. It never changes once made, so it can be shared with
+        // Sessions on other threads; training or loading gives the tokenizer a new one.
+        std::shared_ptr<const Model> get_model() const {
+            return model;
+        }
 
-                // Create match data block for the compiled pattern
-                match_data_pcre2 = pcre2_match_data_create_from_pattern_8(compiled_pattern_pcre2, general_context_pcre2);
-                if (match_data_pcre2 == NULL) {
-                    throw std::runtime_error("PCRE2 match data creation failed.");
-                }
-            }
-        };
+        // Sets the number of threads used to split text with the regex pattern, count pairs and merge them
+        void set_threads(size_t threads) {
+            num_threads = std::max<size_t>(threads, 1);
+            session.set_threads(num_threads);
+        }
 
-        // Destructor to free PCRE2 allocated memory
-        ~Tokenizer() {
-            if (compiled_pattern_pcre2 != NULL) {
-                pcre2_code_free_8(compiled_pattern_pcre2);
-            }
-            if (match_data_pcre2 != NULL) {
-                pcre2_match_data_free_8(match_data_pcre2);
-            }
-            if (compile_context_pcre2 != NULL) {
-                pcre2_compile_context_free_8(compile_context_pcre2);
-            }
-            if (match_context_pcre2 != NULL) {
-                pcre2_match_context_free_8(match_context_pcre2);
-            }
-            if (general_context_pcre2 != NULL) {
-                pcre2_general_context_free_8(general_context_pcre2);
-            }
+        // Sets what train and encode do with text that is not valid UTF-8: reject it with a
+        // std::runtime_error, replace each invalid sequence with U+FFFD, or keep the bytes raw
+        // (the default), each run of invalid bytes then being a chunk of its own
+        void set_invalid_utf8(MinBpeCC::Util::InvalidUtf8 policy) {
+            session.set_invalid_utf8(policy);
+        }
+
+        // Sets which PairCount implementation is used for training
+        void set_pair_count_store(PAIR_COUNT_STORE store) {
+            pair_count_store = store;
+        }
+
+        // Sets how many distinct chunks encode keeps the tokens of, 0 turns the cache off
+        void set_encode_cache_size(size_t size) {
+            session.set_encode_cache_size(size);
+        }
+
+        // Number of chunks encode found in its cache
+        size_t get_encode_cache_hits() const {
+            return session.get_encode_cache_hits();
+        }
+
+        // Number of chunks encode had to encode because they were not in its cache
+        size_t get_encode_cache_misses() const {
+            return session.get_encode_cache_misses();
         }
 
         // Sets the special token map from a single string representing the file contents
@@ -474,15 +590,14 @@ namespace MinBpeCC::Tokenizer {
         //   token1 20000
         //   token2 20001
         void set_special_tokens_from_file(const std::string& input_string) {
-          special_tokens.clear();
-          special_tokens_reverse_lookup.clear();
+          std::unordered_map<std::string, Token> special_tokens;
           std::istringstream iss(input_string);
           std::string key;
           Token value;
           while (iss >> key >> value) {
               special_tokens[key] = value;
-              special_tokens_reverse_lookup[value] = key;
           }
+          set_model(std::make_shared<const Model>(model->get_pattern(), model->get_merges(), std::move(special_tokens)));
         }
 
         // Trains the tokenizer given input text and desired vocabulary size
@@ -491,267 +606,167 @@ namespace MinBpeCC::Tokenizer {
 
             assert(vocab_size >= 256); // Must have at least initial byte tokens
 
-            merges.clear();
-            merges.reserve(vocab_size - 256); // Pre-allocate space for merges
-            initialize_vocab();
-
-            vector<vector<Token>> chunks;
-
-            if (compiled_pattern_pcre2 != NULL) {
-              PCRE2_SPTR subject = reinterpret_cast<PCRE2_SPTR>(text.data());
-              PCRE2_SIZE subject_length = text.length();
-              PCRE2_SIZE offset = 0;
-
-              int rc;
-              while (true) {
-                  rc = pcre2_match(
-                      compiled_pattern_pcre2,
-                      subject,
-                      subject_length,
-                      offset,
-                      PCRE2_NO_UTF_CHECK,  // Optional for performance if you're sure input is valid
-                      match_data_pcre2,
-                      match_context_pcre2
-                  );
-
-                  if (rc < 0) {
-                      if (rc == PCRE2_ERROR_NOMATCH) break;
-                      PCRE2_UCHAR buffer[256];
-                      pcre2_get_error_message(rc, buffer, sizeof(buffer));
-                      throw std::runtime_error("PCRE2 match error: " + std::string(reinterpret_cast<char*>(buffer)));
-                  }
-
-                  PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data_pcre2);
-                  PCRE2_SIZE start = ovector[0];
-                  PCRE2_SIZE end = ovector[1];
-
-                  // Avoid empty match loops
-                  if (start == end) {
-                      if (offset >= subject_length) break;
-                      offset++;
-                      continue;
-                  }
-
-                  // Use a string_view to avoid allocation
-                  std::string_view matched_view(reinterpret_cast<const char*>(subject + start), end - start);
-                  chunks.push_back(text_to_vector(matched_view));  // overload text_to_vector for string_view?
-
-                  offset = end;
-              }
+            // Identical chunks (" the", " and", ...) are stored once along with how many times they
+            // occur, in order of first occurrence so that first occurrence tie breaking is unchanged.
+            TrainingChunks chunks;
+            vector<int> counts;
+            unordered_map<std::string_view, size_t> chunk_lookup;
+            size_t total_chunks = 0;
+            auto add_chunk = [&](std::string_view chunk) {
+                total_chunks++;
+                auto [found, inserted] = chunk_lookup.try_emplace(chunk, chunks.size());
+                if(inserted) {
+                    chunks.add(text_to_vector(chunk));
+                    counts.push_back(1);
+                } else {
+                    counts[found->second]++;
+                }
+            };
+
+            // Invalid UTF-8 is rejected, replaced or kept as raw bytes, see set_invalid_utf8
+            string repaired;
+            auto checked = session.check_utf8(text, repaired);
+            if (model->get_compiled_pattern() != nullptr) {
+                for(auto chunk: split_chunks(checked.text, checked.invalid)) {
+                    add_chunk(chunk);
+                }
             } else {
                 // If no split pattern, treat the whole text as a single chunk
-                chunks.push_back(text_to_vector(text));
+                add_chunk(checked.text);
             }
             
             if (verbose) {
-                cout << "Split input text into " << chunks.size() << " chunks\n";
+                cout << "Split input text into " << total_chunks << " chunks, " << chunks.size() << " unique\n";
             }
 
             // Continue with BPE algorithm
-            auto flists = create_lists(chunks);
-            auto freqs = calculate_freqs(flists, conflict_resolution);
-
-            int total_merges = vocab_size - 256;
-            int last_percent = -1;
-            
-            for(Token i = 256; i < vocab_size; i++) {
-                auto best = freqs->get_top_pair_count();
-                if(best.has_value()) {
-                    auto max_pair = *best;
-                    auto [p1, p2] = max_pair;
-                    vector<Token> appended{vocab[p1]};
-                    appended.insert(appended.end(), vocab[p2].begin(), vocab[p2].end());
-                    vocab.push_back(appended);
-                    if(verbose) {
-                        auto freq = freqs->get_pair(max_pair);
-                        string new_vocab_str;
-                        new_vocab_str.reserve(appended.size());
-                        for(auto c: appended) {
-                            if(c >= 32 && c < 127) { // Printable ASCII range
-                                new_vocab_str += static_cast<char>(c);
-                            } else {
-                                new_vocab_str += ' ';
-                            }
-                        }
-                        cout << "merge " << (i - 256) + 1 << "/" << total_merges << ": (" <<  p1 << ", " << p2 << ") -> " << i << " (b'" << new_vocab_str << "') had " << (freq.has_value() ? std::to_string(freq.value()) : "0") << " occurrences\n";
-                    }
-                    merges.push_back(max_pair);
-                    merges_lookup[max_pair] = i;
-                    merge_chunks(flists, max_pair, i, freqs.get(), conflict_resolution);
-                    if(conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
-                      // The lexical conflict resolution primarily gets its speed up from
-                      // not having to recalculate frequencies after each merge.
-                      freqs = std::move(calculate_freqs(flists, conflict_resolution));
-                    }
+            chunk_lookup.clear();
+            vector<TokenPair> merges;
+            if (pair_count_store == PAIR_COUNT_STORE::FLAT) {
+                if (conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
+                    PairCountFlat<Token> freqs(PairCountFlat<Token>::TieBreak::INSERT_ORDER);
+                    merges = train_merges<true>(chunks, counts, freqs, vocab_size, verbose);
                 } else {
-                    break;
+                    PairCountFlat<Token> freqs(PairCountFlat<Token>::TieBreak::LEXICAL);
+                    merges = train_merges<false>(chunks, counts, freqs, vocab_size, verbose);
                 }
+            } else if (conflict_resolution == CONFLICT_RESOLUTION::FIRST) {
+                PairCountInsertOrder<Token> freqs;
+                merges = train_merges<true>(chunks, counts, freqs, vocab_size, verbose);
+            } else { // LEXICAL
+                PairCountLexicalOrder<Token> freqs;
+                merges = train_merges<false>(chunks, counts, freqs, vocab_size, verbose);
             }
 
             if(verbose) {
-                int size = 0;
-                for(auto &fl: flists) {
-                    size += std::distance(fl.begin(), fl.end());
+                size_t size = 0;
+                for(size_t c = 0; c < chunks.size(); c++) {
+                    size += counts[c] * chunks.lengths[c];
                 }
                 cout << "Length of training text " << text.length() << ". After merges " << size << ".\n";
             }
+            set_model(std::make_shared<const Model>(model->get_pattern(), std::move(merges), model->get_special_tokens()));
         };
 
-        // Splits input text into a vector of strings, separating regular text and special tokens.
-        // Each special token occurrence is replaced with a string like "\0<id>" (null char + token id as string).
-        // If no special tokens are found, returns a single string in the vector.
-        // Example: "hello <|endoftext|> world" => ["hello ", "\0100257", " world"]
-        // TODO this is a naive implementation, it may be more efficient to use a regex or other method
-        std::vector<std::string> split_on_special(const std::string& text) {
-            std::vector<std::string> result;
-            if (special_tokens.empty()) {
-                result.push_back(text);
-                return result;
-            }
-            size_t pos = 0;
-            size_t last = 0;
-            while (pos < text.size()) {
-                size_t found_pos = std::string::npos;
-                std::string found_token;
-                Token found_id = 0;
-                // Find the next special token occurrence
-                for (const auto& kv : special_tokens) {
-                    const std::string& token = kv.first;
-                    size_t p = text.find(token, pos);
-                    if (p != std::string::npos && (found_pos == std::string::npos || p < found_pos)) {
-                        found_pos = p;
-                        found_token = token;
-                        found_id = kv.second;
-                    }
-                }
-                if (found_pos == std::string::npos) {
-                    break;
-                }
-                // Add text before the special token
-                if (found_pos > last) {
-                    result.push_back(text.substr(last, found_pos - last));
-                }
-                // Add the special token marker
-                std::string marker(1, '\0');
-                marker += std::to_string(found_id);
-                result.push_back(marker);
-                pos = found_pos + found_token.size();
-                last = pos;
-            }
-            // Add any remaining text
-            if (last < text.size()) {
-                result.push_back(text.substr(last));
-            }
-            // If no special tokens were found, return the whole string
-            if (result.empty()) {
-                result.push_back(text);
-            }
-            return result;
+        // Splits input text into views of its regular text and special tokens, see
+        // Model::split_on_special
+        std::vector<Model::TextPart> split_on_special(std::string_view text) const {
+            return model->split_on_special(text);
         }
 
         // Encodes input text into a sequence of tokens
         vector<Token> encode(const string &text, const bool verbose) {
-            auto split_text = split_on_special(text);
-            if (verbose) {
-                cout << "Splitting input text into " << split_text.size() << " parts\n";
-                for(const auto &part : split_text) {
-                    auto is_special = part.size() > 0 && part[0] == '\0';
-                    cout << "Part: \"" << part << "\" special: " << is_special << "\n";
-                }
-            }
-
-            vector<vector<Token>> text_chunks;
-            if (compiled_pattern_pcre2 != NULL) {
-                // For each split part, apply regex splitting if not a special token
-                for (const auto& part : split_text) {
-                    if (part.size() > 0 && part[0] == '\0') {
-                        // Special token, treat as a chunk
-                        text_chunks.push_back(text_to_vector(part));
-                        continue;
-                    }
-                    PCRE2_SPTR subject = reinterpret_cast<PCRE2_SPTR>(part.c_str());
-                    PCRE2_SIZE subject_length = part.length();
-                    PCRE2_SIZE offset = 0;
-                    int rc;
-                    while(true) {
-                        rc = pcre2_match_8(
-                                compiled_pattern_pcre2,
-                                subject,
-                                subject_length,
-                                offset,
-                                PCRE2_NO_UTF_CHECK,
-                                match_data_pcre2,
-                                match_context_pcre2
-                            );
-                        if (rc < 0) {
-                            if (rc == PCRE2_ERROR_NOMATCH) break;
-                            PCRE2_UCHAR buffer[256];
-                            pcre2_get_error_message(rc, buffer, sizeof(buffer));
-                            throw std::runtime_error("PCRE2 match error: " + std::string(reinterpret_cast<char*>(buffer)));
-                        }
-                        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data_pcre2);
-                        PCRE2_SIZE start = ovector[0];
-                        PCRE2_SIZE end = ovector[1];
-                        if (start == end) {
-                            if (offset >= subject_length) break;
-                            offset++;
-                            continue;
-                        }
-                        std::string_view matched_view(reinterpret_cast<const char*>(subject + start), end - start);
-                        text_chunks.push_back(text_to_vector(matched_view));
-                        offset = end;
-                    }
-                }
-            } else {
-                // No regex: just convert each split chunk
-                for (const auto& part : split_text) {
-                    text_chunks.push_back(text_to_vector(part));
-                }
-            }
-            // Apply merges to each chunk
-            auto encoded_chunks = internal_encode(text_chunks);
-            // Flatten the encoded chunks into a single token vector
-            vector<Token> out;
-            for(const auto &chunk: encoded_chunks) {
-                out.insert(out.end(), chunk.begin(), chunk.end());
-            }
-            if(verbose) {
-                cout << "Encoded input text (length " << text.length() << ") to " << out.size() << " tokens\n";
-            }
-            return out;
+            return session.encode(text, verbose);
         };
 
+        // Encodes a stream in blocks of block_size bytes, calling write with the tokens of each
+        // block as a std::span<const Token>, see Session::encode_stream
+        template<typename F>
+        void encode_stream(std::istream &in, F &&write, size_t block_size = 1 << 20) {
+            session.encode_stream(in, std::forward<F>(write), block_size);
+        }
+
         // Decodes a sequence of tokens back into a string
-        string decode(const vector<Token> &tokens, const bool verbose) {
-            if(verbose) {
-                cout << "Decoding " << tokens.size() << " tokens\n";
-            }
-            string text = "";
-            for(Token tkn : tokens) {
+        string decode(const vector<Token> &tokens, const bool verbose) const {
+            return model->decode(tokens, verbose);
+        };
 
-                // Override special tokens with their string representation
-                if (special_tokens_reverse_lookup.find(tkn) != special_tokens_reverse_lookup.end()) {
-                    text += special_tokens_reverse_lookup[tkn];
-                    continue; // Skip further processing for this token
-                }
+        // Encodes independent texts on up to the number of threads set with set_threads. The
+        // texts are handed out by a work stealing pool, so a few long ones do not hold up the
+        // rest. The tokens of each text are returned in the order of the texts.
+        vector<vector<Token>> encode_batch(std::span<const string> texts) {
+            vector<vector<Token>> encoded(texts.size());
+            for_each_in_batch(texts.size(), [&](size_t, Session &worker_session, size_t i) {
+                worker_session.encode_append(texts[i], encoded[i]);
+            });
+            return encoded;
+        }
 
-                // Ensure token is within valid vocabulary range
-                if (tkn < 0 || tkn >= vocab.size()) {
-                    std::cerr << "Warning: Attempted to decode invalid token ID: " << tkn << "\n";
-                    continue; // Skip invalid tokens
-                }
+        // Encodes independent texts like encode_batch, returning all the tokens in one buffer
+        EncodedBatch encode_batch_flat(std::span<const string> texts) {
+            // Each text is encoded onto the end of its worker's buffer, then copied into place
+            vector<vector<Token>> buffers(std::max<size_t>(std::min(num_threads, texts.size()), 1));
+            vector<size_t> workers(texts.size());
+            vector<size_t> starts(texts.size());
+            vector<size_t> lengths(texts.size());
+            for_each_in_batch(texts.size(), [&](size_t worker, Session &worker_session, size_t i) {
+                auto &buffer = buffers[worker];
+                workers[i] = worker;
+                starts[i] = buffer.size();
+                worker_session.encode_append(texts[i], buffer);
+                lengths[i] = buffer.size() - starts[i];
+            });
+
+            EncodedBatch batch;
+            batch.offsets.reserve(texts.size() + 1);
+            batch.offsets.push_back(0);
+            for(auto length: lengths) {
+                batch.offsets.push_back(batch.offsets.back() + length);
+            }
+            batch.tokens.resize(batch.offsets.back());
+            for(size_t i = 0; i < texts.size(); i++) {
+                auto source = buffers[workers[i]].begin() + starts[i];
+                std::copy(source, source + lengths[i], batch.tokens.begin() + batch.offsets[i]);
+            }
+            return batch;
+        }
 
-                // cout << "token " << tkn << "\n"; // Debugging
-                for(Token c_int : vocab[tkn]) {
-                    // Convert integer back to character, ensuring it's in byte range
-                    text.push_back(static_cast<char>(c_int));
-                }
+        // Decodes independent token sequences on up to the number of threads set with
+        // set_threads, returning the texts in the order of the sequences
+        vector<string> decode_batch(std::span<const vector<Token>> batch) const {
+            return decode_each(batch);
+        }
+
+        /**
+         * @brief Decodes the texts of a batch encoded with encode_batch_flat.
+         * @throws std::invalid_argument if the batch's offsets are not valid, see
+         * EncodedBatch::is_valid.
+         */
+        vector<string> decode_batch(const EncodedBatch &batch) const {
+            if(!batch.is_valid()) {
+                throw std::invalid_argument("Batch offsets must start at 0, never decrease and end at the last token");
             }
-            return text;
-        };
+            return decode_each(batch);
+        }
 
         // Loads tokenizer model from a file
         bool load(const path &path, const bool verbose) {
+            // A binary model is mapped and its tables used where they are in the file
+            if(MinBpeCC::Util::is_binary_model_file(path)) {
+                try {
+                    set_model(std::make_shared<const Model>(std::make_shared<const MinBpeCC::Util::MappedFile>(path),
+                          model->get_special_tokens()));
+                } catch (const std::runtime_error &e) {
+                    std::cerr << "Failed to load model: " << e.what() << "\n";
+                    return false;
+                }
+                if(verbose) {
+                    cout << "Mapped binary model from " << path << "\n";
+                    print_loaded_vocab();
+                }
+                return true;
+            }
+
             std::ifstream input_file(path, ios::in);
             if(input_file.is_open()) {
                 string version;
@@ -761,59 +776,12 @@ namespace MinBpeCC::Tokenizer {
                     return false;
                 }
 
-                // Clear existing merges and initialize vocab for loading
-                merges_lookup.clear();
-                merges.clear();
-                initialize_vocab();
-
-                // Read pattern string and recompile PCRE2 pattern
+                // Read pattern string
+                string pattern;
                 std::getline(input_file, pattern);
 
-                // Free old PCRE2 pattern and match data if they exist
-                if (compiled_pattern_pcre2 != NULL) {
-                    pcre2_code_free_8(compiled_pattern_pcre2);
-                    compiled_pattern_pcre2 = NULL;
-                }
-                if (match_data_pcre2 != NULL) {
-                    pcre2_match_data_free_8(match_data_pcre2);
-                    match_data_pcre2 = NULL;
-                }
-
-                if (this->pattern.length() > 0) {
-                    PCRE2_SPTR pcre2_pattern_str = reinterpret_cast<PCRE2_SPTR>(this->pattern.c_str());
-                    PCRE2_SIZE erroroffset_load;
-                    int errorcode_load;
-                    uint32_t options = PCRE2_UTF | PCRE2_UCP; // Assuming Unicode features are always desired
-
-                    // Add dynamic options based on pattern content (e.g., case insensitivity)
-                    if (this->pattern.find("(?i:") != std::string::npos) {
-                        options |= PCRE2_CASELESS;
-                    }
-
-                    compiled_pattern_pcre2 = pcre2_compile_8(
-                        pcre2_pattern_str,
-                        (PCRE2_SIZE)this->pattern.length(),
-                        options,
-                        &errorcode_load,
-                        &erroroffset_load,
-                        compile_context_pcre2
-                    );
-
-                    if (compiled_pattern_pcre2 == NULL) {
-                        PCRE2_UCHAR buffer[256];
-                        pcre2_get_error_message_8(errorcode_load, buffer, sizeof(buffer));
-                        std::cerr << "PCRE2 compilation failed on load: " << reinterpret_cast<char*>(buffer) << "\n";
-                        return false;
-                    }
-
-                    match_data_pcre2 = pcre2_match_data_create_from_pattern_8(compiled_pattern_pcre2, general_context_pcre2);
-                    if (match_data_pcre2 == NULL) {
-                        std::cerr << "PCRE2 match data creation failed on load.\n";
-                        return false;
-                    }
-                }
-
-                // Read specials token count
+                // Read specials token count, adding them to any special tokens already set
+                auto special_tokens = model->get_special_tokens();
                 int num_special;
                 input_file >> num_special;
                 for(int i = 0; i < num_special; i++) {
@@ -821,46 +789,32 @@ namespace MinBpeCC::Tokenizer {
                     Token id;
                     input_file >> token >> id;
                     special_tokens[token] = id; // Store special tokens
-                    special_tokens_reverse_lookup[id] = token; // Reverse lookup for decoding
                     if(verbose) {
                         cout << "Loaded special token: " << token << " with ID " << id << "\n";
                     }
                 }
 
                 // Read merges
+                vector<TokenPair> merges;
                 Token idx1, idx2;
-                Token current_token_idx = 256; // Merged tokens start from 256
                 while(input_file >> idx1 >> idx2) {
                     merges.push_back(make_pair(idx1, idx2));
-                    merges_lookup[make_pair(idx1, idx2)] = current_token_idx;
-                    current_token_idx++;
                 }
 
                 if(verbose) {
                     cout << "Read input model from " << path << "\n";
                 }
 
-                // Rebuild vocab from loaded merges
-                Token idx = 256;
-                for(auto mio: merges) {
-                    vector<Token> appended{vocab[std::get<0>(mio)]}; // Copy first part of the merge
-                    appended.insert(appended.end(),vocab[std::get<1>(mio)].begin(), vocab[std::get<1>(mio)].end()); // Append second part
-                    vocab.push_back(appended);
-                    if(verbose) {
-                        cout << "vocab[" << idx << "] = ";
-                        for(auto c: appended) {
-                            if(c >= 32 && c < 127) { // Printable ASCII range
-                                cout << static_cast<char>(c);
-                            } else {
-                                cout << "\\x" << std::hex << c; // Non-printable as hex
-                            }
-                        }
-                        cout << "\n";
-                    }
-                    idx++;
+                // Build the model, which rebuilds the vocab from the merges and compiles the pattern
+                try {
+                    set_model(std::make_shared<const Model>(pattern, std::move(merges), std::move(special_tokens)));
+                } catch (const std::runtime_error &e) {
+                    std::cerr << "Failed to load model: " << e.what() << "\n";
+                    return false;
                 }
+
                 if(verbose) {
-                    cout << "Loaded vocab with " << merges.size() << " merges, vocab size is " << vocab.size() << "\n";
+                    print_loaded_vocab();
                 }
 
                 input_file.close();
@@ -871,25 +825,54 @@ namespace MinBpeCC::Tokenizer {
             }
         };
 
-        // Saves tokenizer model to a file
-        bool save(const path &path, bool write_vocab) {
+        // Prints the bytes of each merged token, and the size of the vocabulary
+        void print_loaded_vocab() const {
+            for(size_t idx = 256; idx < model->get_vocab_size(); idx++) {
+                cout << "vocab[" << idx << "] = ";
+                for(auto c: model->get_token_bytes(static_cast<Token>(idx))) {
+                    auto byte = static_cast<uint8_t>(c);
+                    if(byte >= 32 && byte < 127) { // Printable ASCII range
+                        cout << c;
+                    } else {
+                        cout << "\\x" << std::hex << static_cast<int>(byte) << std::dec; // Non-printable as hex
+                    }
+                }
+                cout << "\n";
+            }
+            cout << "Loaded vocab with " << model->get_merges().size() << " merges, vocab size is " << model->get_vocab_size() << "\n";
+        }
+
+        // Saves tokenizer model to a file, as text or in the binary format load maps in place
+        bool save(const path &path, bool write_vocab, MODEL_FORMAT format = TEXT) {
+            const auto &merges = model->get_merges();
+            const auto &special_tokens = model->get_special_tokens();
             assert(merges.size() > 0); // Must have trained merges to save
 
-            std::ofstream output_file(path, ios::out);
-            if (output_file.is_open()) {
+            std::ofstream output_file;
+            if (format == TEXT) {
+                output_file.open(path, ios::out);
+            }
+            if (format == BINARY || output_file.is_open()) {
                 cout << "Writing model...\n";
-                output_file << "minbpe v1" << std::endl; // Version
-                output_file << pattern << std::endl;     // Regex pattern string
-                output_file << special_tokens.size() << std::endl;           // Special token count (currently 0)
-                // write the special tokens in the same syntax as the input
-                for (const auto &st : special_tokens) {
-                    output_file << st.first << ' ' << st.second << std::endl; // Write special tokens
-                }
-                // Write merges
-                for(const auto &m: merges) {
-                    output_file << std::get<0>(m) << ' ' << std::get<1>(m) << "\n";
+                if (format == BINARY) {
+                    if (!model->save_binary(path)) {
+                        std::cerr << "Unable to write file for saving: " << path << std::endl;
+                        return false;
+                    }
+                } else {
+                    output_file << "minbpe v1" << std::endl; // Version
+                    output_file << model->get_pattern() << std::endl; // Regex pattern string
+                    output_file << special_tokens.size() << std::endl;           // Special token count (currently 0)
+                    // write the special tokens in the same syntax as the input
+                    for (const auto &st : special_tokens) {
+                        output_file << st.first << ' ' << st.second << std::endl; // Write special tokens
+                    }
+                    // Write merges
+                    for(const auto &m: merges) {
+                        output_file << std::get<0>(m) << ' ' << std::get<1>(m) << "\n";
+                    }
+                    output_file.close();
                 }
-                output_file.close();
 
                 if (write_vocab) {
                     // Create the .vocab file path
@@ -902,18 +885,17 @@ namespace MinBpeCC::Tokenizer {
                     }
 
                     // Write the tokens to the .vocab file
-                    Token token_id = 0; // Token IDs start from 0 for byte tokens
-                    for (const auto &v : vocab) {
+                    // Token IDs start from 0 for byte tokens
+                    for (size_t token_id = 0; token_id < model->get_vocab_size(); token_id++) {
                         vocab_file << std::setw(6) << std::left << token_id << ": \""; // Use left alignment for token ID
-                        for (Token c_int : v) {
-                            if (c_int >= 32 && c_int <= 126) { // Printable ASCII characters
-                                vocab_file << (char)c_int;
+                        for (char c : model->get_token_bytes(static_cast<Token>(token_id))) {
+                            if (c >= 32 && c <= 126) { // Printable ASCII characters
+                                vocab_file << c;
                             } else {
                                 vocab_file << "\ufffd"; // Replacement character for non-printable/non-ASCII
                             }
                         }
                         vocab_file << "\"\n";
-                        token_id++;
                     }
                     vocab_file.close();
                 }
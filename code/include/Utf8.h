@@ -0,0 +1,341 @@
+#ifndef MINBPE_UTF8_HPP
+#define MINBPE_UTF8_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "ByteKernels.h"
+
+// The vector validator is compiled for AVX2 on x86 whatever the flags, and only used once the
+// CPU is known to have it. NEON is part of every ARM64 CPU.
+#if defined(MINBPE_BYTE_KERNELS_X86)
+#define MINBPE_UTF8_SIMD
+#define MINBPE_UTF8_SIMD_TARGET __attribute__((target("avx2")))
+#elif defined(__ARM_NEON)
+#define MINBPE_UTF8_SIMD
+#define MINBPE_UTF8_SIMD_TARGET
+#endif
+
+namespace MinBpeCC::Util {
+
+// What to do with text that is not valid UTF-8
+enum class InvalidUtf8 {
+    Reject,  // Throw std::runtime_error
+    Replace, // Replace each invalid sequence with U+FFFD
+    Raw      // Keep the bytes, each run of invalid ones encoded as a chunk of its own
+};
+
+// The length of the valid UTF-8 character at pos, or 0 if the bytes there do not start one.
+// For an invalid sequence invalid_length is set to the length of its maximal subpart, the
+// bytes that begin like a character but do not finish one, or 1 if the first byte cannot
+// begin one. This is how many bytes U+FFFD replaces, as the Unicode standard recommends.
+inline size_t utf8_char_length(std::string_view text, size_t pos, size_t &invalid_length) {
+    auto byte = [&](size_t i) { return static_cast<uint8_t>(text[pos + i]); };
+    uint8_t lead = byte(0);
+    invalid_length = 1;
+    if(lead < 0x80) {
+        return 1;
+    }
+    size_t length;
+    uint8_t second_min = 0x80;
+    uint8_t second_max = 0xBF;
+    if(lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if(lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+        second_min = lead == 0xE0 ? 0xA0 : 0x80; // Overlong
+        second_max = lead == 0xED ? 0x9F : 0xBF; // Surrogates
+    } else if(lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+        second_min = lead == 0xF0 ? 0x90 : 0x80; // Overlong
+        second_max = lead == 0xF4 ? 0x8F : 0xBF; // Above U+10FFFF
+    } else {
+        return 0;
+    }
+    for(size_t i = 1; i < length; i++) {
+        if(pos + i >= text.size()) {
+            return 0;
+        }
+        uint8_t low = i == 1 ? second_min : 0x80;
+        uint8_t high = i == 1 ? second_max : 0xBF;
+        if(byte(i) < low || byte(i) > high) {
+            return 0;
+        }
+        invalid_length = i + 1;
+    }
+    return length;
+}
+
+// Finds the first byte at or after pos that is not part of a valid character, one byte at a time
+inline size_t find_invalid_utf8_scalar(std::string_view text, size_t pos = 0) {
+    size_t invalid_length;
+    while(pos < text.size()) {
+        if(static_cast<uint8_t>(text[pos]) < 0x80) {
+            pos++;
+            continue;
+        }
+        size_t length = utf8_char_length(text, pos, invalid_length);
+        if(length == 0) {
+            return pos;
+        }
+        pos += length;
+    }
+    return std::string_view::npos;
+}
+
+#if defined(MINBPE_UTF8_SIMD)
+
+namespace Utf8Simd {
+    // Vector operations for the validator, 32 bytes at a time with AVX2 and 16 with NEON
+#if defined(MINBPE_BYTE_KERNELS_X86)
+    struct Ops {
+        using Vec = __m256i;
+        static constexpr size_t width = 32;
+        MINBPE_UTF8_SIMD_TARGET static Vec load(const uint8_t *p) {
+            return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        }
+        MINBPE_UTF8_SIMD_TARGET static Vec zero() { return _mm256_setzero_si256(); }
+        MINBPE_UTF8_SIMD_TARGET static Vec splat(uint8_t b) { return _mm256_set1_epi8(static_cast<char>(b)); }
+        MINBPE_UTF8_SIMD_TARGET static Vec table(const uint8_t (&t)[16]) {
+            return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(t)));
+        }
+        MINBPE_UTF8_SIMD_TARGET static Vec lookup(Vec table, Vec index) {
+            return _mm256_shuffle_epi8(table, index);
+        }
+        MINBPE_UTF8_SIMD_TARGET static Vec high_nibbles(Vec v) {
+            return _mm256_and_si256(_mm256_srli_epi16(v, 4), splat(0x0F));
+        }
+        MINBPE_UTF8_SIMD_TARGET static Vec low_nibbles(Vec v) { return _mm256_and_si256(v, splat(0x0F)); }
+        MINBPE_UTF8_SIMD_TARGET static Vec bit_and(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+        MINBPE_UTF8_SIMD_TARGET static Vec bit_or(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+        MINBPE_UTF8_SIMD_TARGET static Vec bit_xor(Vec a, Vec b) { return _mm256_xor_si256(a, b); }
+        MINBPE_UTF8_SIMD_TARGET static Vec saturating_sub(Vec a, Vec b) { return _mm256_subs_epu8(a, b); }
+        // The bytes of input shifted along by n, with the last n of previous in front
+        template<int n>
+        MINBPE_UTF8_SIMD_TARGET static Vec shift_in(Vec input, Vec previous) {
+            return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - n);
+        }
+        MINBPE_UTF8_SIMD_TARGET static bool any(Vec v) { return !_mm256_testz_si256(v, v); }
+        MINBPE_UTF8_SIMD_TARGET static bool is_ascii(Vec v) { return _mm256_movemask_epi8(v) == 0; }
+        MINBPE_UTF8_SIMD_TARGET static Vec incomplete_max() {
+            return _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                  static_cast<char>(0xEF), static_cast<char>(0xDF), static_cast<char>(0xBF));
+        }
+    };
+#else
+    struct Ops {
+        using Vec = uint8x16_t;
+        static constexpr size_t width = 16;
+        static Vec load(const uint8_t *p) { return vld1q_u8(p); }
+        static Vec zero() { return vdupq_n_u8(0); }
+        static Vec splat(uint8_t b) { return vdupq_n_u8(b); }
+        static Vec table(const uint8_t (&t)[16]) { return vld1q_u8(t); }
+        static Vec lookup(Vec table, Vec index) { return vqtbl1q_u8(table, index); }
+        static Vec high_nibbles(Vec v) { return vshrq_n_u8(v, 4); }
+        static Vec low_nibbles(Vec v) { return vandq_u8(v, splat(0x0F)); }
+        static Vec bit_and(Vec a, Vec b) { return vandq_u8(a, b); }
+        static Vec bit_or(Vec a, Vec b) { return vorrq_u8(a, b); }
+        static Vec bit_xor(Vec a, Vec b) { return veorq_u8(a, b); }
+        static Vec saturating_sub(Vec a, Vec b) { return vqsubq_u8(a, b); }
+        template<int n>
+        static Vec shift_in(Vec input, Vec previous) { return vextq_u8(previous, input, 16 - n); }
+        static bool any(Vec v) { return vmaxvq_u8(v) != 0; }
+        static bool is_ascii(Vec v) { return vmaxvq_u8(v) < 0x80; }
+        static Vec incomplete_max() {
+            static const uint8_t max[16] = {255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+                  0xEF, 0xDF, 0xBF};
+            return vld1q_u8(max);
+        }
+    };
+#endif
+
+    // Classes of error in a pair of bytes, looked up from the high and low nibbles of the first
+    // byte and the high nibble of the second, as in Keiser and Lemire's "Validating UTF-8 in
+    // less than one instruction per byte". A pair is invalid if all three lookups share a bit.
+    constexpr uint8_t too_short = 1 << 0;      // A lead byte followed by a lead byte or ASCII
+    constexpr uint8_t too_long = 1 << 1;       // ASCII followed by a continuation byte
+    constexpr uint8_t overlong_3 = 1 << 2;     // 11100000 100_____
+    constexpr uint8_t too_large = 1 << 3;      // 11110100 1001____ and above
+    constexpr uint8_t surrogate = 1 << 4;      // 11101101 101_____
+    constexpr uint8_t overlong_2 = 1 << 5;     // 1100000_ 10______
+    constexpr uint8_t too_large_1000 = 1 << 6; // 11110101 1000____ and above
+    constexpr uint8_t overlong_4 = 1 << 6;     // 11110000 1000____
+    constexpr uint8_t two_conts = 1 << 7;      // Two continuation bytes, fine if a lead is before
+    constexpr uint8_t carry = too_short | too_long | two_conts;
+
+    constexpr uint8_t byte_1_high[16] = {
+        too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+        two_conts, two_conts, two_conts, two_conts,
+        too_short | overlong_2,
+        too_short,
+        too_short | overlong_3 | surrogate,
+        too_short | too_large | too_large_1000 | overlong_4};
+    constexpr uint8_t byte_1_low[16] = {
+        carry | overlong_3 | overlong_2 | overlong_4,
+        carry | overlong_2,
+        carry,
+        carry,
+        carry | too_large,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000 | surrogate,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000};
+    constexpr uint8_t byte_2_high[16] = {
+        too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+        too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+        too_long | overlong_2 | two_conts | overlong_3 | too_large,
+        too_long | overlong_2 | two_conts | surrogate | too_large,
+        too_long | overlong_2 | two_conts | surrogate | too_large,
+        too_short, too_short, too_short, too_short};
+
+    // Finds the first invalid byte, checking a vector at a time until one holds an error and
+    // then finding it exactly from the start of the character before
+    MINBPE_UTF8_SIMD_TARGET inline size_t find_invalid(std::string_view text) {
+        using V = Ops::Vec;
+        const auto *data = reinterpret_cast<const uint8_t *>(text.data());
+        const V high_1 = Ops::table(byte_1_high);
+        const V low_1 = Ops::table(byte_1_low);
+        const V high_2 = Ops::table(byte_2_high);
+        const V incomplete_max = Ops::incomplete_max();
+        V previous = Ops::zero();
+        V previous_incomplete = Ops::zero();
+        size_t pos = 0;
+        for(; pos + Ops::width <= text.size(); pos += Ops::width) {
+            V input = Ops::load(data + pos);
+            if(Ops::is_ascii(input)) {
+                // Only an error if the last vector ended part way through a character
+                if(Ops::any(previous_incomplete)) {
+                    break;
+                }
+            } else {
+                V previous_1 = Ops::shift_in<1>(input, previous);
+                V special_cases = Ops::bit_and(Ops::bit_and(
+                      Ops::lookup(high_1, Ops::high_nibbles(previous_1)),
+                      Ops::lookup(low_1, Ops::low_nibbles(previous_1))),
+                      Ops::lookup(high_2, Ops::high_nibbles(input)));
+                // The third and fourth bytes of a character must be continuations
+                V third = Ops::saturating_sub(Ops::shift_in<2>(input, previous), Ops::splat(0xE0 - 0x80));
+                V fourth = Ops::saturating_sub(Ops::shift_in<3>(input, previous), Ops::splat(0xF0 - 0x80));
+                V must_continue = Ops::bit_and(Ops::bit_or(third, fourth), Ops::splat(0x80));
+                if(Ops::any(Ops::bit_xor(must_continue, special_cases))) {
+                    break;
+                }
+                previous_incomplete = Ops::saturating_sub(input, incomplete_max);
+            }
+            previous = input;
+        }
+        // Everything before the character that pos is in or just after is valid
+        size_t start = pos;
+        for(size_t i = pos; i > 0 && pos - i < 4;) {
+            i--;
+            if((data[i] & 0xC0) != 0x80) {
+                start = i;
+                break;
+            }
+        }
+        return find_invalid_utf8_scalar(text, start);
+    }
+}
+
+#endif
+
+/**
+ * @brief Finds the first byte of text that is not part of a valid UTF-8 character.
+ *
+ * With AVX2 or NEON it checks a vector of bytes at a time. Otherwise it checks a character at
+ * a time, but skips runs of ASCII with ascii_prefix_length.
+ * @param level The instruction set to use, which must be simd_level() or one it includes.
+ * @return Its position, or std::string_view::npos if text is valid.
+ */
+inline size_t find_invalid_utf8(std::string_view text, SimdLevel level) {
+#if defined(MINBPE_UTF8_SIMD)
+    if(level == SimdLevel::AVX2 || level == SimdLevel::NEON) {
+        return Utf8Simd::find_invalid(text);
+    }
+#endif
+    const auto &kernels = byte_kernels(level);
+    size_t pos = 0;
+    size_t invalid_length;
+    while(pos < text.size()) {
+        if(static_cast<uint8_t>(text[pos]) < 0x80) {
+            pos += kernels.ascii_prefix_length(text.data() + pos, text.size() - pos);
+            continue;
+        }
+        size_t length = utf8_char_length(text, pos, invalid_length);
+        if(length == 0) {
+            return pos;
+        }
+        pos += length;
+    }
+    return std::string_view::npos;
+}
+
+/**
+ * @brief Finds the first byte of text that is not part of a valid UTF-8 character, with the
+ * best instruction set this CPU has.
+ * @return Its position, or std::string_view::npos if text is valid.
+ */
+inline size_t find_invalid_utf8(std::string_view text) {
+    return find_invalid_utf8(text, simd_level());
+}
+
+// The length of the run of invalid bytes at pos, which runs until a valid character starts
+inline size_t invalid_utf8_run_length(std::string_view text, size_t pos) {
+    size_t end = pos;
+    size_t invalid_length;
+    while(end < text.size() && utf8_char_length(text, end, invalid_length) == 0) {
+        end += invalid_length;
+    }
+    return end - pos;
+}
+
+// How many bytes at the end of text are the start of a character that is cut off, so that
+// text read in blocks is only checked in whole characters
+inline size_t incomplete_utf8_suffix(std::string_view text) {
+    for(size_t back = 1; back <= 3 && back <= text.size(); back++) {
+        auto byte = static_cast<uint8_t>(text[text.size() - back]);
+        if((byte & 0xC0) != 0x80) {
+            size_t invalid_length;
+            if(byte >= 0xC2 && byte <= 0xF4 && utf8_char_length(text, text.size() - back, invalid_length) == 0 &&
+                  invalid_length == back) {
+                return back;
+            }
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Returns text with each invalid sequence replaced by U+FFFD
+inline std::string replace_invalid_utf8(std::string_view text) {
+    std::string replaced;
+    replaced.reserve(text.size());
+    size_t pos = 0;
+    while(pos < text.size()) {
+        auto invalid = find_invalid_utf8(text.substr(pos));
+        if(invalid == std::string_view::npos) {
+            replaced.append(text.substr(pos));
+            break;
+        }
+        replaced.append(text.substr(pos, invalid));
+        pos += invalid;
+        size_t invalid_length;
+        utf8_char_length(text, pos, invalid_length);
+        replaced.append("\xEF\xBF\xBD");
+        pos += invalid_length;
+    }
+    return replaced;
+}
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_UTF8_HPP
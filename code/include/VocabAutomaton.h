@@ -0,0 +1,354 @@
+#ifndef MINBPE_VOCABAUTOMATON_HPP
+#define MINBPE_VOCABAUTOMATON_HPP
+
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <span>
+#include <unordered_map>
+#include <cstdint>
+#include <string_view>
+
+#include "FlatArray.h"
+#include "MergeTable.h"
+
+namespace MinBpeCC::Util {
+
+// --- Backtracking BPE encoding ---
+// Rather than applying merges one at a time, the tokens are chosen directly from the input:
+// the longest token that matches next is taken, and is replaced by its next shorter prefix
+// token when BPE would not actually put it next to the token before it. If no prefix works
+// either the previous token is given back. Each position in the input is given up at most
+// once, so encoding takes time linear in the length of the input, however long a chunk is.
+// See the bpe crate by GitHub (github.com/github/rust-gems) for the method and its proof.
+
+/**
+ * @class VocabAutomaton
+ * @brief Encodes byte sequences with a fixed set of merges by backtracking over the vocabulary.
+ *
+ * The vocabulary's byte strings are held in a trie, the goto function of an Aho-Corasick
+ * automaton. The encoder only ever matches anchored at a known position so the failure links
+ * are not needed. Token ids must be in merge order, with the 256 byte tokens first, which is
+ * how minbpe numbers them, so a token's id is also its merge rank.
+ *
+ * A token is left out of the trie if BPE would never produce it, as happens when two merges
+ * build the same bytes and the one learnt later never wins. Otherwise the longest match could
+ * pick a token the merges cannot reach.
+ */
+template<typename T>
+class VocabAutomaton {
+private:
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    // Trie nodes in breadth first order, root first. A node's children are the edges
+    // [first_edge[node], first_edge[node + 1]), sorted by byte.
+    FlatArray<uint32_t> first_edge;
+    FlatArray<uint8_t> edge_bytes;
+    FlatArray<uint32_t> edge_targets;
+    FlatArray<uint32_t> node_token;  // Token spelled by the path to each node, if any
+
+    std::span<const std::pair<T,T>> merges; // The pair each token from 256 on was merged from
+    const MergeTable<T> *merge_table = nullptr;
+    FlatArray<uint32_t> token_length;       // Length of each token in bytes
+    FlatArray<uint32_t> next_prefix;        // Longest reachable token that is a proper prefix of each token
+    FlatArray<uint8_t> reachable;           // Whether BPE encodes the token's own bytes as the token
+
+    // The pair a token was merged from, (t, t) for a byte
+    std::pair<T,T> split(uint32_t token) const {
+        return token < 256 ? std::pair<T,T>{static_cast<T>(token), static_cast<T>(token)} : merges[token - 256];
+    }
+
+    uint32_t child(uint32_t node, uint8_t byte) const {
+        auto begin = edge_bytes.begin() + first_edge[node];
+        auto end = edge_bytes.begin() + first_edge[node + 1];
+        auto found = std::lower_bound(begin, end, byte);
+        if(found == end || *found != byte) {
+            return none;
+        }
+        return edge_targets[found - edge_bytes.begin()];
+    }
+
+    // Whether BPE encodes the bytes of token1 followed by those of token2 as exactly those two
+    // tokens. The merges that built each token are undone one at a time, earliest undone
+    // last, checking that no pair across the boundary would have been merged before the
+    // merges that have not been undone yet. limit starts as the smallest merge the pair
+    // itself may have without being rejected.
+    bool is_valid_pair(uint32_t token1, uint32_t token2, uint32_t limit = none) const {
+        while(true) {
+            auto combined = merge_table->find(static_cast<T>(token1), static_cast<T>(token2));
+            if(combined && static_cast<uint32_t>(*combined) < limit) {
+                return false;
+            }
+            if(token1 > token2) {
+                limit = token1;
+                token1 = split(token1).second;
+                if(token1 == limit) {
+                    limit = token2 + 1;
+                    token2 = split(token2).first;
+                    if(token2 + 1 == limit) {
+                        return true;
+                    }
+                }
+            } else {
+                limit = token2 + 1;
+                token2 = split(token2).first;
+                if(token2 + 1 == limit) {
+                    limit = token1;
+                    token1 = split(token1).second;
+                    if(token1 == limit) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    // The longest token in the trie that starts at text[pos]
+    uint32_t longest_match(const std::vector<T> &text, size_t pos) const {
+        uint32_t node = 0;
+        uint32_t token = none;
+        for(size_t i = pos; i < text.size(); i++) {
+            node = child(node, static_cast<uint8_t>(text[i]));
+            if(node == none) {
+                break;
+            }
+            if(node_token[node] != none) {
+                token = node_token[node];
+            }
+        }
+        return token;
+    }
+
+public:
+    VocabAutomaton() = default;
+
+    // The automaton's tables, which can be saved and used again with view
+    struct Tables {
+        std::span<const uint32_t> first_edge;
+        std::span<const uint8_t> edge_bytes;
+        std::span<const uint32_t> edge_targets;
+        std::span<const uint32_t> node_token;
+        std::span<const uint32_t> token_length;
+        std::span<const uint32_t> next_prefix;
+        std::span<const uint8_t> reachable;
+    };
+
+    /**
+     * @brief Builds the automaton for a vocabulary.
+     * @param vocab The byte strings of the tokens, indexed by token.
+     * @param merges The pair each token from 256 on was merged from, in merge order.
+     * @param merge_table The token each of the merges made.
+     * The merges and merge table are used in place and must outlive the automaton.
+     */
+    void build(const std::vector<std::string_view> &vocab, std::span<const std::pair<T,T>> merges,
+          const MergeTable<T> &merge_table) {
+        auto count = vocab.size();
+        this->merges = merges;
+        this->merge_table = &merge_table;
+        std::vector<uint32_t> lengths(count);
+        std::vector<uint8_t> reachable_tokens(count, 0);
+        for(size_t t = 0; t < count; t++) {
+            lengths[t] = static_cast<uint32_t>(vocab[t].size());
+            if(t < 256) {
+                reachable_tokens[t] = 1;
+            } else {
+                auto [left, right] = merges[t - 256];
+                // Where the pair merges to t only an earlier merge across it can get in the way.
+                // A pair listed again later merges to that token instead, so t never appears.
+                reachable_tokens[t] = reachable_tokens[left] && reachable_tokens[right] &&
+                    merge_table.find(left, right) == static_cast<T>(t) &&
+                    is_valid_pair(static_cast<uint32_t>(left), static_cast<uint32_t>(right), static_cast<uint32_t>(t));
+            }
+        }
+        token_length = FlatArray<uint32_t>(std::move(lengths));
+
+        // Build the trie with hashed edges, then lay it out breadth first
+        std::unordered_map<uint64_t, uint32_t> edges;
+        std::vector<uint32_t> tokens{none};
+        for(size_t t = 0; t < count; t++) {
+            if(!reachable_tokens[t]) {
+                continue;
+            }
+            uint32_t node = 0;
+            for(auto c: vocab[t]) {
+                auto [edge, inserted] = edges.try_emplace((static_cast<uint64_t>(node) << 8) | static_cast<uint8_t>(c),
+                      static_cast<uint32_t>(tokens.size()));
+                if(inserted) {
+                    tokens.push_back(none);
+                }
+                node = edge->second;
+            }
+            tokens[node] = static_cast<uint32_t>(t);
+        }
+        std::vector<std::vector<std::pair<uint8_t, uint32_t>>> children(tokens.size());
+        for(const auto &[key, target]: edges) {
+            children[key >> 8].push_back({static_cast<uint8_t>(key & 0xFF), target});
+        }
+        std::vector<uint32_t> order{0};           // Old node ids in breadth first order
+        std::vector<uint32_t> renumber(tokens.size());
+        for(size_t i = 0; i < order.size(); i++) {
+            auto &node_children = children[order[i]];
+            std::sort(node_children.begin(), node_children.end());
+            for(auto [byte, target]: node_children) {
+                renumber[target] = static_cast<uint32_t>(order.size());
+                order.push_back(target);
+            }
+        }
+        std::vector<uint32_t> edge_starts{0};
+        std::vector<uint8_t> bytes;
+        std::vector<uint32_t> targets;
+        std::vector<uint32_t> node_tokens;
+        for(auto old: order) {
+            for(auto [byte, target]: children[old]) {
+                bytes.push_back(byte);
+                targets.push_back(renumber[target]);
+            }
+            edge_starts.push_back(static_cast<uint32_t>(bytes.size()));
+            node_tokens.push_back(tokens[old]);
+        }
+        first_edge = FlatArray<uint32_t>(std::move(edge_starts));
+        edge_bytes = FlatArray<uint8_t>(std::move(bytes));
+        edge_targets = FlatArray<uint32_t>(std::move(targets));
+        node_token = FlatArray<uint32_t>(std::move(node_tokens));
+
+        std::vector<uint32_t> prefixes(count, none);
+        for(size_t t = 0; t < count; t++) {
+            if(!reachable_tokens[t]) {
+                continue;
+            }
+            uint32_t node = 0;
+            for(size_t i = 0; i + 1 < vocab[t].size(); i++) {
+                node = child(node, static_cast<uint8_t>(vocab[t][i]));
+                if(node_token[node] != none) {
+                    prefixes[t] = node_token[node];
+                }
+            }
+        }
+        next_prefix = FlatArray<uint32_t>(std::move(prefixes));
+        reachable = FlatArray<uint8_t>(std::move(reachable_tokens));
+    }
+
+    /**
+     * @brief The tables build made, to be saved.
+     */
+    Tables get_tables() const {
+        return Tables{first_edge.span(), edge_bytes.span(), edge_targets.span(), node_token.span(),
+              token_length.span(), next_prefix.span(), reachable.span()};
+    }
+
+    /**
+     * @brief Uses tables saved from an automaton for the same merges without copying them.
+     * Like the merges and merge table, the tables must outlive the automaton.
+     * The merges must only use tokens made before them. The tables are checked to be laid out
+     * as build lays them out, so that encoding with tables from a damaged file cannot read
+     * outside them or the text, though it may give the wrong tokens.
+     * @return false if the tables do not fit together or with the merges.
+     */
+    bool view(const Tables &tables, std::span<const std::pair<T,T>> merges, const MergeTable<T> &merge_table) {
+        auto count = merges.size() + 256;
+        auto nodes = tables.node_token.size();
+        auto edges = tables.edge_bytes.size();
+        if(tables.token_length.size() != count || tables.next_prefix.size() != count ||
+              tables.reachable.size() != count || nodes == 0 || tables.first_edge.size() != nodes + 1 ||
+              tables.edge_targets.size() != edges || edges + 1 != nodes ||
+              tables.first_edge[0] != 0 || tables.first_edge[nodes] != edges) {
+            return false;
+        }
+        // Breadth first, edge e leads to node e + 1 and comes after the node it leaves, so
+        // every node but the root is reached once and its depth is known before its edges
+        std::vector<uint32_t> depth(nodes, 0);
+        for(size_t node = 0; node < nodes; node++) {
+            size_t begin = tables.first_edge[node];
+            size_t end = tables.first_edge[node + 1];
+            if(end < begin || end > edges) {
+                return false;
+            }
+            for(size_t e = begin; e < end; e++) {
+                if(e < node || tables.edge_targets[e] != e + 1 ||
+                      (e > begin && tables.edge_bytes[e] <= tables.edge_bytes[e - 1])) {
+                    return false;
+                }
+                depth[e + 1] = depth[node] + 1;
+            }
+            // A match must be as long as the token it gives
+            auto token = tables.node_token[node];
+            if(token != none && (token >= count || !tables.reachable[token] || tables.token_length[token] != depth[node])) {
+                return false;
+            }
+        }
+        for(size_t t = 0; t < count; t++) {
+            auto prefix = tables.next_prefix[t];
+            if(tables.token_length[t] == 0 || (prefix != none && (prefix >= count || !tables.reachable[prefix] ||
+                  tables.token_length[prefix] >= tables.token_length[t]))) {
+                return false;
+            }
+        }
+        this->merges = merges;
+        this->merge_table = &merge_table;
+        first_edge = FlatArray<uint32_t>(tables.first_edge);
+        edge_bytes = FlatArray<uint8_t>(tables.edge_bytes);
+        edge_targets = FlatArray<uint32_t>(tables.edge_targets);
+        node_token = FlatArray<uint32_t>(tables.node_token);
+        token_length = FlatArray<uint32_t>(tables.token_length);
+        next_prefix = FlatArray<uint32_t>(tables.next_prefix);
+        reachable = FlatArray<uint8_t>(tables.reachable);
+        return true;
+    }
+
+    /**
+     * @brief Checks whether encoding a token's bytes gives back the token, which is false for
+     * a token that the merges never produce.
+     * @param token The token to check.
+     */
+    bool is_reachable(T token) const {
+        return static_cast<size_t>(token) < reachable.size() && reachable[token];
+    }
+
+    /**
+     * @brief Checks whether the automaton has been built.
+     */
+    bool empty() const {
+        return node_token.empty();
+    }
+
+    /**
+     * @brief Encodes a sequence of bytes, giving the same tokens as applying the merges in order.
+     * @param text The bytes to encode, one per element.
+     * @return The tokens.
+     */
+    std::vector<T> encode(const std::vector<T> &text) const {
+        std::vector<T> tokens;
+        // Positions that can still be the end of a token, cleared when backtracking past them
+        std::vector<bool> can_end(text.size() + 1, true);
+        size_t pos = 0;
+        uint32_t next = text.empty() ? none : longest_match(text, 0);
+        while(next != none) {
+            auto token = next;
+            auto last = tokens.empty() ? none : static_cast<uint32_t>(tokens.back());
+            while(true) {
+                auto end = pos + token_length[token];
+                if(can_end[end] && (last == none || is_valid_pair(last, token))) {
+                    tokens.push_back(static_cast<T>(token));
+                    pos = end;
+                    next = pos < text.size() ? longest_match(text, pos) : none;
+                    break;
+                } else if(next_prefix[token] != none) {
+                    token = next_prefix[token];
+                } else {
+                    // Nothing fits after last, so give it back and try its prefixes instead
+                    can_end[pos] = false;
+                    tokens.pop_back();
+                    pos -= token_length[last];
+                    next = last;
+                    break;
+                }
+            }
+        }
+        return tokens;
+    }
+};
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_VOCABAUTOMATON_HPP
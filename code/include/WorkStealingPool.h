@@ -0,0 +1,165 @@
+#ifndef MINBPE_WORKSTEALINGPOOL_HPP
+#define MINBPE_WORKSTEALINGPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace MinBpeCC::Util {
+
+/**
+ * @class WorkStealingPool
+ * @brief Runs a function over a range of indices on several threads, balancing uneven work
+ * by stealing.
+ *
+ * Each worker starts with an equal contiguous share of the indices and takes them from the
+ * front of its share. A worker that runs out steals the back half of the largest share left,
+ * so a few expensive indices only hold up the workers running them while the rest of the work
+ * moves to the workers that are free. Threads are started for each call to run and joined
+ * before it returns; the calling thread is worker 0.
+ */
+class WorkStealingPool {
+private:
+    // The indices [begin, end) a worker has left. Kept on separate cache lines so workers
+    // taking from their own shares do not slow each other down.
+    struct alignas(64) Share {
+        std::mutex mutex;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    size_t num_threads;
+
+    // Takes the next index from a worker's own share
+    static bool take(Share &share, size_t &index) {
+        std::lock_guard<std::mutex> lock(share.mutex);
+        if(share.begin == share.end) {
+            return false;
+        }
+        index = share.begin++;
+        return true;
+    }
+
+    // Moves the back half of the largest other share into the worker's own, which is empty
+    static bool steal(std::vector<Share> &shares, size_t worker) {
+        while(true) {
+            size_t victim = worker;
+            size_t most = 0;
+            for(size_t i = 0; i < shares.size(); i++) {
+                if(i == worker) {
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(shares[i].mutex);
+                if(shares[i].end - shares[i].begin > most) {
+                    most = shares[i].end - shares[i].begin;
+                    victim = i;
+                }
+            }
+            if(victim == worker) {
+                return false;
+            }
+            size_t begin, end;
+            {
+                std::lock_guard<std::mutex> lock(shares[victim].mutex);
+                if(shares[victim].begin == shares[victim].end) {
+                    continue; // Emptied since it was looked at, so look again
+                }
+                // The victim keeps the front half, the index it would take next included,
+                // unless that is all it has left
+                end = shares[victim].end;
+                begin = end - (end - shares[victim].begin) / 2;
+                if(begin == end) {
+                    begin--;
+                }
+                shares[victim].end = begin;
+            }
+            std::lock_guard<std::mutex> lock(shares[worker].mutex);
+            shares[worker].begin = begin;
+            shares[worker].end = end;
+            return true;
+        }
+    }
+
+public:
+    /**
+     * @brief Creates a pool.
+     * @param threads The number of workers, at least one.
+     */
+    explicit WorkStealingPool(size_t threads) : num_threads(std::max<size_t>(threads, 1)) {
+    }
+
+    /**
+     * @brief The number of workers.
+     */
+    size_t size() const {
+        return num_threads;
+    }
+
+    /**
+     * @brief Calls f(worker, index) for every index in [0, count), each exactly once.
+     * @param count The number of indices.
+     * @param f The function to call. Calls with the same worker are never made at the same
+     * time, so f can use state kept per worker without locking.
+     * @throws Whatever f throws. The workers stop taking indices once a call has thrown, and
+     * the first exception is rethrown when they have all finished.
+     */
+    template<typename F>
+    void run(size_t count, F &&f) {
+        if(count == 0) {
+            return;
+        }
+        size_t workers = std::min(num_threads, count);
+        std::vector<Share> shares(workers);
+        for(size_t w = 0; w < workers; w++) {
+            shares[w].begin = count * w / workers;
+            shares[w].end = count * (w + 1) / workers;
+        }
+
+        std::atomic<bool> failed = false;
+        auto work = [&](size_t worker) {
+            try {
+                size_t index;
+                while(!failed.load(std::memory_order_relaxed)) {
+                    if(take(shares[worker], index)) {
+                        f(worker, index);
+                    } else if(!steal(shares, worker)) {
+                        break;
+                    }
+                }
+            } catch(...) {
+                failed = true;
+                throw;
+            }
+        };
+
+        std::vector<std::future<void>> results;
+        for(size_t w = 1; w < workers; w++) {
+            results.push_back(std::async(std::launch::async, work, w));
+        }
+        std::exception_ptr error;
+        try {
+            work(0);
+        } catch(...) {
+            error = std::current_exception();
+        }
+        for(auto &result: results) {
+            try {
+                result.get();
+            } catch(...) {
+                if(!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if(error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+} // namespace MinBpeCC::Util
+
+#endif // MINBPE_WORKSTEALINGPOOL_HPP
@@ -1,11 +1,23 @@
 #include "Tokenizer.h"
 #include <catch_amalgamated.hpp>
 #include <utility>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <thread>
 
 using MinBpeCC::Tokenizer::Tokenizer;
 using MinBpeCC::Util::PairCount;
 using MinBpeCC::Util::PairCountInsertOrder;
 using MinBpeCC::Util::PairCountLexicalOrder;
+using MinBpeCC::Util::PairCountFlat;
+using MinBpeCC::Util::SpecialTokenScanner;
+using MinBpeCC::Util::PreTokenizer;
+using MinBpeCC::Util::SplitPattern;
+using MinBpeCC::Util::CharClass;
+using MinBpeCC::Util::InvalidUtf8;
 using std::vector;
 using std::string;
 using std::pair;
@@ -105,64 +117,189 @@ TEST_CASE("PairCountLexicalOrder get most frequent", "[paircount]") {
     REQUIRE( max.value() == make_pair(0,1) );
 }
 
+TEST_CASE("PairCountFlat get most frequent", "[paircount]") {
+    SECTION("insert order") {
+        PairCountFlat<int> pc(PairCountFlat<int>::TieBreak::INSERT_ORDER);
+        REQUIRE( !pc.get_top_pair_count().has_value() );
+
+        pc.create_or_modify_pair(1,2,1);
+        pc.create_or_modify_pair(1,2,1); // count(1,2) is 2
+        pc.create_or_modify_pair(2,3,1); // count(2,3) is 1
+        REQUIRE( pc.get_top_pair_count() == make_pair(1,2) );
+
+        pc.create_or_modify_pair(2,3,1); // count(1,2) is 2, count(2,3) is 2. (1,2) was inserted first.
+        REQUIRE( pc.get_top_pair_count() == make_pair(1,2) );
+        pc.create_or_modify_pair(2,3,1); // count(2,3) is 3
+        REQUIRE( pc.get_top_pair_count() == make_pair(2,3) );
+        pc.create_or_modify_pair(2,3,-2); // count(2,3) is 1, the heap entry for 3 is stale
+        REQUIRE( pc.get_top_pair_count() == make_pair(1,2) );
+        REQUIRE( pc.get_count() == 2 );
+    }
+    SECTION("lexical") {
+        PairCountFlat<int> pc(PairCountFlat<int>::TieBreak::LEXICAL);
+        pc.create_or_modify_pair(2,3,2);
+        pc.create_or_modify_pair(1,2,2);
+        REQUIRE( pc.get_top_pair_count() == make_pair(1,2) ); // (1,2) is smaller
+        pc.create_or_modify_pair(0,1,3);
+        REQUIRE( pc.get_top_pair_count() == make_pair(0,1) );
+        pc.create_or_modify_pair(0,1,-3);
+        REQUIRE( pc.get_top_pair_count() == make_pair(1,2) );
+        REQUIRE( !pc.get_pair({0,1}).has_value() ); // Removed when its count reached zero
+        REQUIRE( !pc.get_pair({5,5}).has_value() );
+    }
+    SECTION("positions") {
+        PairCountFlat<int> pc(PairCountFlat<int>::TieBreak::INSERT_ORDER);
+        pc.create_or_modify_pair_at(1,2,1,10);
+        pc.create_or_modify_pair_at(2,3,1,5);
+        REQUIRE( pc.get_top_pair_count() == make_pair(2,3) ); // first occurs earlier
+        pc.create_or_modify_pair_at(2,3,-1,5);
+        pc.create_or_modify_pair_at(2,3,1,20);
+        REQUIRE( pc.get_top_pair_count() == make_pair(1,2) );
+    }
+}
+
+TEST_CASE("PairCount add_to_pair returns the new count", "[paircount]") {
+    PairCountInsertOrder<int> insert_order;
+    PairCountLexicalOrder<int> lexical;
+    PairCountFlat<int> flat_insert_order(PairCountFlat<int>::TieBreak::INSERT_ORDER);
+    PairCountFlat<int> flat_lexical(PairCountFlat<int>::TieBreak::LEXICAL);
+    for(PairCount<int> *pc: {static_cast<PairCount<int>*>(&insert_order), static_cast<PairCount<int>*>(&lexical),
+          static_cast<PairCount<int>*>(&flat_insert_order), static_cast<PairCount<int>*>(&flat_lexical)}) {
+        REQUIRE( pc->add_to_pair(1,2,3) == 3 );
+        REQUIRE( pc->add_to_pair(1,2,2) == 5 );
+        REQUIRE( pc->add_to_pair_at(2,3,1,7) == 1 );
+        REQUIRE( pc->add_to_pair_at(2,3,1,4) == 2 );
+        REQUIRE( pc->add_to_pair_at(1,2,-5,0) == 0 );
+        REQUIRE( !pc->get_pair({1,2}).has_value() );
+        REQUIRE( pc->get_top_pair_count() == make_pair(2,3) );
+        REQUIRE( pc->get_count() == 1 );
+    }
+}
+
+TEST_CASE("PairCount removes pairs whose count drops to zero", "[paircount]") {
+    PairCountInsertOrder<int> insert_order;
+    PairCountFlat<int> flat(PairCountFlat<int>::TieBreak::INSERT_ORDER);
+    for(PairCount<int> *pc: {static_cast<PairCount<int>*>(&insert_order), static_cast<PairCount<int>*>(&flat)}) {
+        pc->create_or_modify_pair(1,2,2);
+        pc->create_or_modify_pair(2,3,2);
+        pc->create_or_modify_pair(3,4,1);
+        REQUIRE( pc->get_top_pair_count() == make_pair(1,2) );
+
+        pc->create_or_modify_pair(1,2,-2);
+        REQUIRE( !pc->get_pair({1,2}).has_value() );
+        REQUIRE( pc->get_count() == 2 );
+        REQUIRE( pc->get_live_count() == 2 );
+        REQUIRE( pc->get_top_pair_count() == make_pair(2,3) );
+
+        // Added again it is inserted after (2,3), like a new key in a Python dict
+        REQUIRE( pc->create_or_modify_pair(1,2,2) );
+        REQUIRE( pc->get_top_pair_count() == make_pair(2,3) );
+        pc->create_or_modify_pair(2,3,-2);
+        pc->create_or_modify_pair(3,4,-1);
+        REQUIRE( pc->get_top_pair_count() == make_pair(1,2) );
+        REQUIRE( pc->get_live_count() == 1 );
+    }
+    REQUIRE( insert_order.get_dead_count() == 0 );
+}
+
+TEST_CASE("PairCountFlat deletes pairs from crowded probe runs", "[paircount]") {
+    PairCountFlat<int> pc(PairCountFlat<int>::TieBreak::LEXICAL);
+    for(int round = 0; round < 3; round++) {
+        for(int i = 0; i < 1000; i++) {
+            pc.create_or_modify_pair(i, i % 7, i + 1);
+        }
+        for(int i = 0; i < 1000; i += 2) {
+            pc.create_or_modify_pair(i, i % 7, -(i + 1));
+        }
+        for(int i = 0; i < 1000; i++) {
+            REQUIRE( pc.get_pair({i, i % 7}) == (i % 2 ? optional<int>(i + 1) : optional<int>()) );
+            if(i % 2) {
+                pc.create_or_modify_pair(i, i % 7, -(i + 1));
+            }
+        }
+        REQUIRE( pc.get_count() == 0 );
+        REQUIRE( !pc.get_top_pair_count().has_value() );
+        REQUIRE( pc.get_dead_count() == 0 ); // The stale heap entries were popped
+    }
+}
 
 // Test helper class to expose protected members of Tokenizer
 class TokenizerTest : public Tokenizer {
 public:
-    auto create_lists_public(const vector<vector<MinBpeCC::Tokenizer::Token>> &chunks) {
-        return create_lists(chunks);
+    using Tokenizer::Tokenizer;
+
+    auto create_training_chunks_public(const vector<vector<MinBpeCC::Tokenizer::Token>> &chunks) {
+        return create_training_chunks(chunks);
+    };
+
+    const auto &get_merges() {
+        return model->get_merges();
+    };
+
+    void set_backtrack_min_length_public(size_t length) {
+        set_backtrack_min_length(length);
+    };
+
+    void set_min_shard_chunks_public(size_t chunks) {
+        set_min_shard_chunks(chunks);
+    };
+
+    auto split_chunks_public(const string &text, size_t threads) {
+        set_threads(threads);
+        return split_chunks(text);
     };
 
     auto text_to_vector_public(const string &text) {
-        return text_to_vector(text);
+        return MinBpeCC::Tokenizer::text_to_vector(text);
+    };
+
+    auto calculate_freqs_public(const MinBpeCC::Tokenizer::TrainingChunks &chunks, const vector<int> &counts,
+                                CONFLICT_RESOLUTION conflict_resolution) {
+        return calculate_freqs(chunks, counts, conflict_resolution);
     };
 
-    auto calculate_freqs_public(const vector<std::forward_list<MinBpeCC::Tokenizer::Token>> &chunks, CONFLICT_RESOLUTION conflict_resolution) {
-        return calculate_freqs(chunks, conflict_resolution);
+    auto create_pair_index_public(const MinBpeCC::Tokenizer::TrainingChunks &chunks) {
+        return create_pair_index(chunks);
     };
 
-    void merge_public(std::forward_list<MinBpeCC::Tokenizer::Token> &text, pair<MinBpeCC::Tokenizer::Token, MinBpeCC::Tokenizer::Token> mp,
-                      MinBpeCC::Tokenizer::Token new_token, PairCount<MinBpeCC::Tokenizer::Token> *freqs) {
-        merge(text, mp, new_token, freqs);
+    void merge_chunks_public(MinBpeCC::Tokenizer::TrainingChunks &chunks, const vector<int> &counts, PairIndex &index,
+                      pair<MinBpeCC::Tokenizer::Token, MinBpeCC::Tokenizer::Token> mp,
+                      MinBpeCC::Tokenizer::Token new_token, PairCount<MinBpeCC::Tokenizer::Token> *freqs, CONFLICT_RESOLUTION conflict_resolution) {
+        merge_chunks(chunks, counts, index, mp, new_token, freqs, conflict_resolution);
     }
 };
 
-// Helper to get the length of a forward_list
-template<typename T>
-size_t getForwardListLength(const std::forward_list<T>& flist) {
-    return std::distance(flist.begin(), flist.end());
-}
-
 TEST_CASE("Tokenizer training", "[tokenizer]") {
     TokenizerTest bt;
     vector<vector<MinBpeCC::Tokenizer::Token>> chunks;
     const auto test_string = string("abcbcde");
     chunks.push_back(bt.text_to_vector_public(test_string));
 
-    auto flists = bt.create_lists_public(chunks);
-    REQUIRE( flists.size() == 1 );
-    REQUIRE( getForwardListLength(flists[0]) == test_string.size());
+    auto training_chunks = bt.create_training_chunks_public(chunks);
+    vector<int> counts(training_chunks.size(), 1);
+    REQUIRE( training_chunks.size() == 1 );
+    REQUIRE( training_chunks.chunk(0).size() == test_string.size());
 
     // FIX: `freqs` is now a std::unique_ptr, so we use it like a pointer.
-    auto freqs = bt.calculate_freqs_public(flists, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    auto freqs = bt.calculate_freqs_public(training_chunks, counts, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    auto index = bt.create_pair_index_public(training_chunks);
 
     // FIX: Use the -> operator to access members of the object managed by unique_ptr.
     auto max = freqs->get_top_pair_count();
     REQUIRE( max.has_value() );
     REQUIRE( max.value() == make_pair((MinBpeCC::Tokenizer::Token)'b', (MinBpeCC::Tokenizer::Token)'c') ); // 98, 99
 
-    // FIX: Pass the raw pointer using .get() to the merge function.
-    bt.merge_public(flists[0], make_pair((MinBpeCC::Tokenizer::Token)'b', (MinBpeCC::Tokenizer::Token)'c'), 256, freqs.get());
+    // The merge updates the frequencies incrementally, no recount needed.
+    bt.merge_chunks_public(training_chunks, counts, index, make_pair((MinBpeCC::Tokenizer::Token)'b', (MinBpeCC::Tokenizer::Token)'c'), 256, freqs.get(), Tokenizer::CONFLICT_RESOLUTION::FIRST);
 
-    // Recalculate frequencies and re-assign the unique_ptr.
-    freqs = bt.calculate_freqs_public(flists, Tokenizer::CONFLICT_RESOLUTION::FIRST);
     max = freqs->get_top_pair_count();
     REQUIRE( max.has_value() );
     REQUIRE( max.value() == make_pair((MinBpeCC::Tokenizer::Token)'a', (MinBpeCC::Tokenizer::Token)256) ); // 97, 256
 
-    bt.merge_public(flists[0], make_pair((MinBpeCC::Tokenizer::Token)'a', (MinBpeCC::Tokenizer::Token)256), 257, freqs.get());
+    bt.merge_chunks_public(training_chunks, counts, index, make_pair((MinBpeCC::Tokenizer::Token)'a', (MinBpeCC::Tokenizer::Token)256), 257, freqs.get(), Tokenizer::CONFLICT_RESOLUTION::FIRST);
 
-    freqs = bt.calculate_freqs_public(flists, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    // Recalculate frequencies from scratch, the result should be the same
+    freqs = bt.calculate_freqs_public(training_chunks, counts, Tokenizer::CONFLICT_RESOLUTION::FIRST);
     max = freqs->get_top_pair_count();
     REQUIRE( max.has_value() );
     REQUIRE( max.value() == make_pair((MinBpeCC::Tokenizer::Token)257, (MinBpeCC::Tokenizer::Token)256) );
@@ -184,3 +321,1150 @@ TEST_CASE("Tokenizer training", "[tokenizer]") {
     // Also check that the total number of pairs is 3
     REQUIRE(freqs->get_count() == 3);
 }
+
+// Sorts the non zero counts of a PairCount so two of them can be compared
+vector<vector<MinBpeCC::Tokenizer::Token>> live_counts(PairCount<MinBpeCC::Tokenizer::Token> &pc) {
+    auto all = pc.get_all();
+    std::erase_if(all, [](const auto &e) { return e[2] == 0; });
+    std::sort(all.begin(), all.end());
+    return all;
+}
+
+TEST_CASE("Incremental first occurrence merges match a full recount", "[tokenizer]") {
+    TokenizerTest bt;
+    vector<vector<MinBpeCC::Tokenizer::Token>> chunks;
+    // The pair (a,a) overlaps with itself, and (b,c) disappears and comes back
+    // earlier in the text once (a,b) is merged.
+    for(auto s : {"zaaaab", "xbcab", "aaaaaa", "abcbcab", "ab"}) {
+        chunks.push_back(bt.text_to_vector_public(s));
+    }
+
+    auto training_chunks = bt.create_training_chunks_public(chunks);
+    vector<int> counts(training_chunks.size(), 1);
+    auto freqs = bt.calculate_freqs_public(training_chunks, counts, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    auto index = bt.create_pair_index_public(training_chunks);
+
+    for(MinBpeCC::Tokenizer::Token idx = 256; idx < 264; idx++) {
+        auto recount = bt.calculate_freqs_public(training_chunks, counts, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+        REQUIRE( live_counts(*freqs) == live_counts(*recount) );
+        auto best = recount->get_top_pair_count();
+        if(!best.has_value()) {
+            break;
+        }
+        REQUIRE( freqs->get_top_pair_count() == best );
+        // Every chunk containing the best pair is in the index
+        for(size_t c = 0; c < training_chunks.size(); c++) {
+            auto chunk = training_chunks.chunk(c);
+            auto it = std::adjacent_find(chunk.begin(), chunk.end(), [&](auto x, auto y) {
+                return make_pair(x.token, y.token) == best.value();
+            });
+            if(it != chunk.end()) {
+                auto &in_index = index[best.value()];
+                REQUIRE( std::find(in_index.begin(), in_index.end(), c) != in_index.end() );
+            }
+        }
+        bt.merge_chunks_public(training_chunks, counts, index, best.value(), idx, freqs.get(), Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    }
+}
+
+TEST_CASE("Weighted chunks count the same as repeated chunks", "[tokenizer]") {
+    TokenizerTest bt;
+    vector<vector<MinBpeCC::Tokenizer::Token>> repeated;
+    for(auto s : {"ab", "bc", "ab", "abc", "ab", "bc"}) {
+        repeated.push_back(bt.text_to_vector_public(s));
+    }
+    vector<vector<MinBpeCC::Tokenizer::Token>> unique;
+    for(auto s : {"ab", "bc", "abc"}) {
+        unique.push_back(bt.text_to_vector_public(s));
+    }
+    vector<int> repeated_counts(repeated.size(), 1);
+    vector<int> unique_counts{3, 2, 1};
+
+    auto repeated_training = bt.create_training_chunks_public(repeated);
+    auto unique_training = bt.create_training_chunks_public(unique);
+    auto repeated_index = bt.create_pair_index_public(repeated_training);
+    auto unique_index = bt.create_pair_index_public(unique_training);
+
+    for(auto cr : {Tokenizer::CONFLICT_RESOLUTION::FIRST, Tokenizer::CONFLICT_RESOLUTION::LEXICAL}) {
+        auto repeated_freqs = bt.calculate_freqs_public(repeated_training, repeated_counts, cr);
+        auto unique_freqs = bt.calculate_freqs_public(unique_training, unique_counts, cr);
+        REQUIRE( live_counts(*repeated_freqs) == live_counts(*unique_freqs) );
+        REQUIRE( unique_freqs->get_pair({'a', 'b'}) == 4 );
+        REQUIRE( unique_freqs->get_pair({'b', 'c'}) == 3 );
+    }
+
+    auto repeated_freqs = bt.calculate_freqs_public(repeated_training, repeated_counts, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    auto unique_freqs = bt.calculate_freqs_public(unique_training, unique_counts, Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    bt.merge_chunks_public(repeated_training, repeated_counts, repeated_index, {'a', 'b'}, 256, repeated_freqs.get(), Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    bt.merge_chunks_public(unique_training, unique_counts, unique_index, {'a', 'b'}, 256, unique_freqs.get(), Tokenizer::CONFLICT_RESOLUTION::FIRST);
+    REQUIRE( live_counts(*repeated_freqs) == live_counts(*unique_freqs) );
+    REQUIRE( unique_freqs->get_top_pair_count() == repeated_freqs->get_top_pair_count() );
+    REQUIRE( unique_freqs->get_pair({256, 'c'}) == 1 );
+}
+
+TEST_CASE("Parallel regex splitting matches a serial split", "[tokenizer]") {
+    // Lines that start with whitespace, punctuation followed by newlines, runs of blank
+    // lines and trailing spaces are all places a careless cut would change the chunks.
+    const vector<string> lines = {
+        "Hello world, it's 12345 o'clock!\n",
+        "  indented line\twith tabs  \n",
+        "\n\n\n",
+        "trailing spaces   \n",
+        "...\n",
+        "\u00e9t\u00e9 \u4f60\u597d \U0001F600 caf\u00e9\r\n",
+        "I'LL WE'VE they're\n",
+        "x\n \n",
+    };
+    string text;
+    for(size_t i = 0; text.size() < 600000; i++) {
+        text += lines[(i * 7) % lines.size()];
+    }
+
+    for(const auto &pattern : {Tokenizer::GPT2_SPLIT_PATTERN, Tokenizer::GPT4_SPLIT_PATTERN}) {
+        TokenizerTest rt(pattern);
+        auto serial = rt.split_chunks_public(text, 1);
+        auto parallel = rt.split_chunks_public(text, 4);
+        REQUIRE( serial.size() > 0 );
+        REQUIRE( parallel == serial );
+    }
+}
+
+TEST_CASE("Sharded pair counting and merging match a serial run", "[tokenizer]") {
+    TokenizerTest bt;
+    // Lowered so that merging the best pairs, which occur in a few thousand chunks, is sharded
+    // as well as counting
+    bt.set_min_shard_chunks_public(256);
+    vector<vector<MinBpeCC::Tokenizer::Token>> chunks;
+    vector<int> counts;
+    // Enough chunks for several shards, with pairs that tie and first occur in different shards
+    uint32_t state = 12345;
+    for(size_t i = 0; i < 20000; i++) {
+        string s;
+        for(size_t j = 0; j < 2 + i % 5; j++) {
+            state = state * 1103515245 + 12345;
+            s.push_back('a' + (state >> 16) % 6);
+        }
+        chunks.push_back(bt.text_to_vector_public(s));
+        counts.push_back(1 + i % 3);
+    }
+
+    for(auto cr : {Tokenizer::CONFLICT_RESOLUTION::FIRST, Tokenizer::CONFLICT_RESOLUTION::LEXICAL}) {
+        auto serial_training = bt.create_training_chunks_public(chunks);
+        auto sharded_training = bt.create_training_chunks_public(chunks);
+        auto serial_index = bt.create_pair_index_public(serial_training);
+        auto sharded_index = bt.create_pair_index_public(sharded_training);
+
+        bt.set_threads(1);
+        auto serial = bt.calculate_freqs_public(serial_training, counts, cr);
+        bt.set_threads(4);
+        auto sharded = bt.calculate_freqs_public(sharded_training, counts, cr);
+        REQUIRE( live_counts(*serial) == live_counts(*sharded) );
+
+        for(MinBpeCC::Tokenizer::Token idx = 256; idx < 276; idx++) {
+            auto best = serial->get_top_pair_count();
+            REQUIRE( best.has_value() );
+            REQUIRE( sharded->get_top_pair_count() == best );
+            bt.set_threads(1);
+            bt.merge_chunks_public(serial_training, counts, serial_index, best.value(), idx, serial.get(), cr);
+            bt.set_threads(4);
+            bt.merge_chunks_public(sharded_training, counts, sharded_index, best.value(), idx, sharded.get(), cr);
+            REQUIRE( live_counts(*serial) == live_counts(*sharded) );
+        }
+    }
+}
+
+TEST_CASE("Training with sharded merges gives the same model as a serial run", "[tokenizer]") {
+    string text;
+    uint32_t state = 777;
+    for(size_t i = 0; i < 30000; i++) {
+        text += ' ';
+        for(size_t j = 0; j < 1 + i % 7; j++) {
+            state = state * 1103515245 + 12345;
+            text.push_back('a' + (state >> 16) % 8);
+        }
+    }
+
+    for(auto cr : {Tokenizer::CONFLICT_RESOLUTION::FIRST, Tokenizer::CONFLICT_RESOLUTION::LEXICAL}) {
+        TokenizerTest serial(Tokenizer::GPT4_SPLIT_PATTERN);
+        serial.set_threads(1);
+        serial.train(text, 356, cr, false);
+
+        TokenizerTest sharded(Tokenizer::GPT4_SPLIT_PATTERN);
+        sharded.set_threads(4);
+        sharded.set_min_shard_chunks_public(16);
+        sharded.train(text, 356, cr, false);
+
+        REQUIRE( serial.get_merges().size() == 100 );
+        REQUIRE( sharded.get_merges() == serial.get_merges() );
+    }
+}
+
+TEST_CASE("Training with the flat pair count store gives the same merges", "[tokenizer]") {
+    string text;
+    uint32_t state = 42;
+    for(size_t i = 0; i < 20000; i++) {
+        state = state * 1103515245 + 12345;
+        text += " abcdefgh"[(state >> 16) % 9];
+        if(i % 50 == 0) {
+            text += "\n";
+        }
+    }
+
+    for(auto cr : {Tokenizer::CONFLICT_RESOLUTION::FIRST, Tokenizer::CONFLICT_RESOLUTION::LEXICAL}) {
+        for(const auto &pattern : {string(""), Tokenizer::GPT4_SPLIT_PATTERN}) {
+            TokenizerTest boost_store(pattern);
+            boost_store.train(text, 400, cr, false);
+            TokenizerTest flat_store(pattern);
+            flat_store.set_pair_count_store(Tokenizer::PAIR_COUNT_STORE::FLAT);
+            flat_store.train(text, 400, cr, false);
+            REQUIRE( boost_store.get_merges().size() > 0 );
+            REQUIRE( flat_store.get_merges() == boost_store.get_merges() );
+        }
+    }
+}
+
+TEST_CASE("Encoding applies merges in the order they were learnt", "[tokenizer]") {
+    using T = MinBpeCC::Tokenizer::Token;
+    SECTION("wikipedia example") {
+        // The example from the Wikipedia article on byte pair encoding, as used in minbpe's tests
+        Tokenizer t;
+        t.train("aaabdaaabac", 256 + 3, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( t.encode("aaabdaaabac", false) == vector<T>{258, 100, 258, 97, 99} );
+        REQUIRE( t.decode(t.encode("aaabdaaabac", false), false) == "aaabdaaabac" );
+    }
+    SECTION("rank order rather than left to right") {
+        // Learns (b, c) -> 256 then (a, b) -> 257. A single left to right pass would merge the
+        // (a, b) in "abc" first, but (b, c) was learnt first so it wins.
+        TokenizerTest t;
+        t.train("bcbcbcbc abab ab", 256 + 2, Tokenizer::CONFLICT_RESOLUTION::LEXICAL, false);
+        REQUIRE( t.get_merges() == vector<pair<T,T>>{{'b', 'c'}, {'a', 'b'}} );
+        REQUIRE( t.encode("abc", false) == vector<T>{'a', 256} );
+        REQUIRE( t.encode("abcabab", false) == vector<T>{'a', 256, 257, 257} );
+    }
+    SECTION("overlapping occurrences") {
+        Tokenizer t;
+        t.train("aaaaaaaa", 256 + 2, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( t.encode("aaa", false) == vector<T>{256, 'a'} );
+        REQUIRE( t.encode("aaaaaaa", false) == vector<T>{257, 256, 'a'} );
+    }
+}
+
+TEST_CASE("Backtracking encoding matches encoding by merge rank", "[tokenizer]") {
+    // Few distinct bytes give long tokens that overlap in many ways, which is where the
+    // backtracking has the most to do
+    uint32_t state = 7;
+    auto random_text = [&](size_t length, const string &alphabet) {
+        string text;
+        for(size_t i = 0; i < length; i++) {
+            state = state * 1103515245 + 12345;
+            text += alphabet[(state >> 16) % alphabet.size()];
+        }
+        return text;
+    };
+
+    SECTION("trained on random text") {
+        for(const auto &alphabet : {string("ab"), string("abc "), string("aaab"), string("0123456789 \n")}) {
+            for(auto cr : {Tokenizer::CONFLICT_RESOLUTION::FIRST, Tokenizer::CONFLICT_RESOLUTION::LEXICAL}) {
+                TokenizerTest t;
+                t.train(random_text(5000, alphabet), 600, cr, false);
+                for(int i = 0; i < 50; i++) {
+                    auto text = random_text(1 + i * 7, alphabet);
+                    t.set_backtrack_min_length_public(std::numeric_limits<size_t>::max());
+                    auto by_rank = t.encode(text, false);
+                    t.set_backtrack_min_length_public(2);
+                    auto backtracked = t.encode(text, false);
+                    REQUIRE( backtracked == by_rank );
+                    REQUIRE( t.decode(backtracked, false) == text );
+                }
+            }
+        }
+    }
+
+    SECTION("tokens that merges never produce") {
+        // 259 spells "abc" like 258, but (a, b) always merges before (b, c) so it never appears
+        auto model_path = std::filesystem::temp_directory_path() / "minbpe-cc-unreachable.model";
+        {
+            std::ofstream model(model_path);
+            model << "minbpe v1\n\n0\n97 98\n98 99\n256 99\n97 257\n";
+        }
+        TokenizerTest t;
+        REQUIRE( t.load(model_path, false) );
+        std::filesystem::remove(model_path);
+        for(int i = 0; i < 100; i++) {
+            auto text = random_text(1 + i, "abc");
+            t.set_backtrack_min_length_public(std::numeric_limits<size_t>::max());
+            auto by_rank = t.encode(text, false);
+            t.set_backtrack_min_length_public(2);
+            REQUIRE( t.encode(text, false) == by_rank );
+        }
+        REQUIRE( t.encode("abc", false) == vector<MinBpeCC::Tokenizer::Token>{258} );
+    }
+
+    SECTION("a pair listed twice") {
+        // (a, b) is listed as 256 and again as 258, and merges to 258 as minbpe's loader has
+        // it, after (b, c). So 256 and 259, built on it, never appear
+        auto model_path = std::filesystem::temp_directory_path() / "minbpe-cc-duplicate.model";
+        {
+            std::ofstream model(model_path);
+            model << "minbpe v1\n\n0\n97 98\n98 99\n97 98\n256 99\n";
+        }
+        TokenizerTest t;
+        REQUIRE( t.load(model_path, false) );
+        std::filesystem::remove(model_path);
+        REQUIRE( t.get_merges().size() == 4 );
+        REQUIRE( t.encode("ab", false) == vector<MinBpeCC::Tokenizer::Token>{258} );
+        REQUIRE( t.encode("abc", false) == vector<MinBpeCC::Tokenizer::Token>{'a', 257} );
+        for(int i = 0; i < 100; i++) {
+            auto text = random_text(1 + i, "abc");
+            t.set_backtrack_min_length_public(std::numeric_limits<size_t>::max());
+            auto by_rank = t.encode(text, false);
+            t.set_backtrack_min_length_public(2);
+            REQUIRE( t.encode(text, false) == by_rank );
+            REQUIRE( t.decode(by_rank, false) == text );
+        }
+    }
+}
+
+TEST_CASE("Encode cache returns the same tokens and counts hits", "[tokenizer]") {
+    string text;
+    for(int i = 0; i < 200; i++) {
+        text += " the cat sat on the mat";
+    }
+    // With a single merge no word is a token by itself, so every chunk goes to the cache
+    Tokenizer cached(Tokenizer::GPT4_SPLIT_PATTERN);
+    cached.train(text, 257, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    auto encoded = cached.encode(" the cat and the dog", false);
+    // " the" is seen twice, the other four chunks once
+    REQUIRE( cached.get_encode_cache_misses() == 4 );
+    REQUIRE( cached.get_encode_cache_hits() == 1 );
+    REQUIRE( cached.encode(" the cat and the dog", false) == encoded );
+    REQUIRE( cached.get_encode_cache_hits() == 6 );
+
+    Tokenizer uncached(Tokenizer::GPT4_SPLIT_PATTERN);
+    uncached.set_encode_cache_size(0);
+    uncached.train(text, 257, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    REQUIRE( uncached.encode(" the cat and the dog", false) == encoded );
+    REQUIRE( uncached.encode(text, false) == cached.encode(text, false) );
+    REQUIRE( uncached.get_encode_cache_hits() + uncached.get_encode_cache_misses() == 0 );
+
+    // A full cache stops taking new chunks but still serves the ones it has
+    Tokenizer small(Tokenizer::GPT4_SPLIT_PATTERN);
+    small.set_encode_cache_size(1);
+    small.train(text, 257, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    REQUIRE( small.encode(" the cat the cat", false) == cached.encode(" the cat the cat", false) );
+    REQUIRE( small.get_encode_cache_hits() == 1 );
+    REQUIRE( small.get_encode_cache_misses() == 3 );
+}
+
+TEST_CASE("Chunks that are a single token are looked up whole", "[tokenizer]") {
+    string text;
+    for(int i = 0; i < 200; i++) {
+        text += " the cat sat on the mat";
+    }
+    TokenizerTest t(Tokenizer::GPT4_SPLIT_PATTERN);
+    t.train(text, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    auto the = t.encode(" the", false);
+    REQUIRE( the.size() == 1 );
+    REQUIRE( the[0] >= 256 );
+    // Found without going through the merges or the cache
+    REQUIRE( t.get_encode_cache_hits() + t.get_encode_cache_misses() == 0 );
+    REQUIRE( t.encode(" the cat sat", false).size() == 3 );
+
+    // The same as merging for every token, including the single bytes from 128 up that are not
+    // valid UTF-8 on their own and are encoded as raw bytes. encode_chunk merges without looking
+    // the chunk up first.
+    const auto &merges = t.get_merges();
+    auto model = t.get_model();
+    MinBpeCC::Tokenizer::Model::EncodeScratch scratch;
+    for(MinBpeCC::Tokenizer::Token token = 0; token < 256 + merges.size(); token++) {
+        auto bytes = t.decode({token}, false);
+        vector<MinBpeCC::Tokenizer::Token> merged;
+        model->encode_chunk(bytes, merged, std::numeric_limits<size_t>::max(), scratch);
+        REQUIRE( merged == vector<MinBpeCC::Tokenizer::Token>{token} );
+        REQUIRE( t.encode(bytes, false) == merged );
+    }
+}
+
+TEST_CASE("Decoding copies token bytes from the vocabulary arena", "[tokenizer]") {
+    using MinBpeCC::Tokenizer::Token;
+    string text;
+    for(int i = 0; i < 100; i++) {
+        text += "A longer line of text so that some tokens grow past sixteen bytes long.\n";
+    }
+    Tokenizer t;
+    t.train(text, 400, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    const auto &merges = t.get_model()->get_merges();
+
+    // Special tokens override the vocabulary, whatever their ids, and invalid ids are skipped
+    std::unordered_map<string, Token> special_tokens{{"<|low|>", 300}, {"<|end|>", 100257}, {"<|far|>", 4000000000u}};
+    MinBpeCC::Tokenizer::Model model("", merges, special_tokens);
+    REQUIRE( model.get_vocab_size() == 256 + merges.size() );
+    bool long_token = false;
+    for(Token token = 256; token < model.get_vocab_size(); token++) {
+        auto [left, right] = merges[token - 256];
+        auto bytes = model.get_token_bytes(token);
+        REQUIRE( bytes == string(model.get_token_bytes(left)) + string(model.get_token_bytes(right)) );
+        long_token = long_token || bytes.size() > 16;
+    }
+    REQUIRE( long_token );
+
+    vector<Token> tokens;
+    string expected;
+    std::mt19937 rng(24);
+    for(int i = 0; i < 1000; i++) {
+        Token token = rng() % (model.get_vocab_size() + 2);
+        if(token == model.get_vocab_size()) {
+            token = rng() % 2 == 0 ? 100257 : 4000000000u;
+        } else if(token == model.get_vocab_size() + 1) {
+            token = 100000; // Neither in the vocabulary nor special
+        }
+        tokens.push_back(token);
+        if(token == 300) {
+            expected += "<|low|>";
+        } else if(token == 100257) {
+            expected += "<|end|>";
+        } else if(token == 4000000000u) {
+            expected += "<|far|>";
+        } else if(token < model.get_vocab_size()) {
+            expected += model.get_token_bytes(token);
+        }
+    }
+    REQUIRE( model.decode(tokens, false) == expected );
+    REQUIRE( t.decode(t.encode(text, false), false) == text );
+}
+
+TEST_CASE("Binary models are used in place and behave like the model saved", "[tokenizer]") {
+    using MinBpeCC::Tokenizer::Token;
+    string text;
+    for(int i = 0; i < 500; i++) {
+        text += "Line " + std::to_string(i) + " of a text with caf\xC3\xA9s, repeated words and  spaces.\n";
+    }
+    text += "<|endoftext|>tail\xFF";
+    auto directory = std::filesystem::temp_directory_path();
+    auto text_path = directory / "minbpe-cc-binary-test.model";
+    auto binary_path = directory / "minbpe-cc-binary-test.bin";
+    auto read_bytes = [](const std::filesystem::path &path) {
+        std::ifstream file(path, std::ios::binary);
+        return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+
+    for(const auto &pattern: {Tokenizer::GPT4_SPLIT_PATTERN, string()}) {
+        Tokenizer trained(pattern);
+        trained.set_special_tokens_from_file("<|endoftext|> 100257\n");
+        trained.train(text, 600, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( trained.save(text_path, false) );
+        REQUIRE( trained.save(binary_path, false, Tokenizer::MODEL_FORMAT::BINARY) );
+        REQUIRE( MinBpeCC::Util::is_binary_model_file(binary_path) );
+        REQUIRE( !MinBpeCC::Util::is_binary_model_file(text_path) );
+
+        Tokenizer from_text;
+        Tokenizer from_binary;
+        from_binary.set_special_tokens_from_file("<|start|> 100258\n");
+        REQUIRE( from_text.load(text_path, false) );
+        REQUIRE( from_binary.load(binary_path, false) );
+        auto model = from_binary.get_model();
+        REQUIRE( model->get_pattern() == pattern );
+        REQUIRE( model->get_merges() == from_text.get_model()->get_merges() );
+        REQUIRE( model->get_special_tokens() ==
+            std::unordered_map<string, Token>{{"<|endoftext|>", 100257}, {"<|start|>", 100258}} );
+
+        auto encoded = from_text.encode(text, false);
+        REQUIRE( from_binary.encode(text, false) == encoded );
+        REQUIRE( from_binary.decode(encoded, false) == text );
+        for(Token token = 0; token < model->get_vocab_size(); token++) {
+            REQUIRE( model->get_token_bytes(token) == from_text.get_model()->get_token_bytes(token) );
+        }
+
+        // The mapping lives as long as the model, and saving it again writes the same bytes
+        from_binary = Tokenizer();
+        REQUIRE( model->decode(encoded, false) == text );
+        Tokenizer resaved;
+        REQUIRE( resaved.load(binary_path, false) );
+        auto original = read_bytes(binary_path);
+        REQUIRE( resaved.save(binary_path, false, Tokenizer::MODEL_FORMAT::BINARY) );
+        REQUIRE( read_bytes(binary_path) == original );
+    }
+
+    SECTION("tokens that merges never produce") {
+        {
+            std::ofstream model(text_path);
+            model << "minbpe v1\n\n0\n97 98\n98 99\n256 99\n97 257\n";
+        }
+        TokenizerTest t;
+        REQUIRE( t.load(text_path, false) );
+        REQUIRE( t.save(binary_path, false, Tokenizer::MODEL_FORMAT::BINARY) );
+        TokenizerTest mapped;
+        REQUIRE( mapped.load(binary_path, false) );
+        mapped.set_backtrack_min_length_public(2);
+        REQUIRE( mapped.encode("abc", false) == vector<Token>{258} );
+        REQUIRE( mapped.encode("abcabcab", false) == t.encode("abcabcab", false) );
+    }
+
+    SECTION("files that are not a binary model this build can use are refused") {
+        Tokenizer t;
+        t.train(text, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( t.save(binary_path, false, Tokenizer::MODEL_FORMAT::BINARY) );
+        auto original = read_bytes(binary_path);
+        auto write_bytes = [&](const string &bytes) {
+            std::ofstream file(binary_path, std::ios::binary | std::ios::trunc);
+            file << bytes;
+        };
+        auto other_version = original;
+        other_version[8] = 2;
+        auto cut_short = original.substr(0, original.size() / 2);
+        for(const auto &bytes: {other_version, cut_short, original.substr(0, 100)}) {
+            write_bytes(bytes);
+            Tokenizer loaded;
+            REQUIRE( !loaded.load(binary_path, false) );
+        }
+
+        // Tables that would make encoding or decoding read out of bounds or search forever
+        using MinBpeCC::Util::ModelSection;
+        MinBpeCC::Util::ModelFileHeader header;
+        std::memcpy(&header, original.data(), sizeof(header));
+        auto damaged = [&](ModelSection section, size_t at, uint32_t value) {
+            auto bytes = original;
+            std::memcpy(bytes.data() + header.sections[static_cast<size_t>(section)].offset + at, &value, sizeof(value));
+            return bytes;
+        };
+        auto filled = [&](ModelSection section, uint8_t value) {
+            auto bytes = original;
+            auto [offset, size] = header.sections[static_cast<size_t>(section)];
+            std::memset(bytes.data() + offset, value, size);
+            return bytes;
+        };
+        Token last = 299;
+        REQUIRE( t.get_model()->get_vocab_size() == last + 1 );
+        for(const auto &bytes: {damaged(ModelSection::Merges, 0, 5000),
+                                damaged(ModelSection::VocabSpans, last * 8, 0xFFFFFF00),
+                                damaged(ModelSection::VocabBytes, 300, 1),
+                                filled(ModelSection::VocabLookup, 0),
+                                filled(ModelSection::MergeTable, 0),
+                                damaged(ModelSection::FirstEdge, 4, 1000),
+                                damaged(ModelSection::EdgeTargets, 0, 0),
+                                damaged(ModelSection::NodeToken, 4, last + 1),
+                                damaged(ModelSection::TokenLength, last * 4, 1000),
+                                damaged(ModelSection::NextPrefix, last * 4, last)}) {
+            write_bytes(bytes);
+            Tokenizer loaded;
+            REQUIRE( !loaded.load(binary_path, false) );
+        }
+        write_bytes(original);
+        Tokenizer loaded;
+        REQUIRE( loaded.load(binary_path, false) );
+    }
+
+    SECTION("saving over a model that is still mapped") {
+        Tokenizer larger;
+        larger.train(text, 600, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( larger.save(binary_path, false, Tokenizer::MODEL_FORMAT::BINARY) );
+        Tokenizer mapped;
+        REQUIRE( mapped.load(binary_path, false) );
+        auto encoded = larger.encode(text, false);
+
+        // The new file is smaller, so the old mapping would run past its end if it were
+        // written over in place
+        Tokenizer smaller;
+        smaller.train(text, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( smaller.save(binary_path, false, Tokenizer::MODEL_FORMAT::BINARY) );
+        REQUIRE( mapped.encode(text, false) == encoded );
+        REQUIRE( mapped.decode(encoded, false) == text );
+        REQUIRE( mapped.get_model()->get_merges() == larger.get_model()->get_merges() );
+
+        Tokenizer reloaded;
+        REQUIRE( reloaded.load(binary_path, false) );
+        REQUIRE( reloaded.get_model()->get_merges() == smaller.get_model()->get_merges() );
+        for(const auto &entry: std::filesystem::directory_iterator(directory)) {
+            REQUIRE( !entry.path().filename().string().starts_with(binary_path.filename().string() + ".tmp") );
+        }
+    }
+    std::filesystem::remove(text_path);
+    std::filesystem::remove(binary_path);
+}
+
+TEST_CASE("One model can be shared by sessions on several threads", "[tokenizer]") {
+    string text;
+    for(int i = 0; i < 300; i++) {
+        text += "Line " + std::to_string(i) + " of the text, with some words repeated.\n";
+    }
+    Tokenizer t(Tokenizer::GPT4_SPLIT_PATTERN);
+    t.train(text, 400, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    auto expected = t.encode(text, false);
+    auto model = t.get_model();
+
+    vector<std::future<vector<MinBpeCC::Tokenizer::Token>>> results;
+    for(int i = 0; i < 4; i++) {
+        results.push_back(std::async(std::launch::async, [model, &text]() {
+            MinBpeCC::Tokenizer::Session session(model);
+            vector<MinBpeCC::Tokenizer::Token> encoded;
+            for(int repeat = 0; repeat < 5; repeat++) {
+                encoded = session.encode(text, false);
+            }
+            return encoded;
+        }));
+    }
+    for(auto &result: results) {
+        auto encoded = result.get();
+        REQUIRE( encoded == expected );
+        REQUIRE( model->decode(encoded, false) == text );
+    }
+
+    SECTION("copies share the model and have their own match data") {
+        Tokenizer copy = t;
+        REQUIRE( copy.get_model() == model );
+        Tokenizer assigned;
+        assigned = copy;
+        REQUIRE( assigned.encode(text, false) == expected );
+        REQUIRE( copy.encode(text, false) == expected );
+        // Training the original gives it a new model and leaves the copies alone
+        t.train(text, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        REQUIRE( t.get_model() != model );
+        REQUIRE( copy.encode(text, false) == expected );
+    }
+}
+
+TEST_CASE("Work stealing pool runs every index once", "[pool]") {
+    for(size_t threads: {1, 3, 8}) {
+        MinBpeCC::Util::WorkStealingPool pool(threads);
+        vector<std::atomic<int>> runs(1000);
+        // The first indices take far longer so the other workers have to steal them
+        pool.run(runs.size(), [&](size_t, size_t i) {
+            if(i < 10) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+            runs[i]++;
+        });
+        for(auto &count: runs) {
+            REQUIRE( count == 1 );
+        }
+        REQUIRE_THROWS_AS( pool.run(100, [](size_t, size_t i) {
+            if(i == 42) {
+                throw std::runtime_error("failed");
+            }
+        }), std::runtime_error );
+    }
+}
+
+TEST_CASE("Batches encode and decode like their texts one at a time", "[tokenizer]") {
+    string text;
+    for(int i = 0; i < 300; i++) {
+        text += "Line " + std::to_string(i) + " of the text, with some words repeated.\n";
+    }
+    Tokenizer t(Tokenizer::GPT4_SPLIT_PATTERN);
+    t.train(text, 400, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+
+    vector<string> texts;
+    for(size_t i = 0; i < text.size(); i += 1 + i % 977) {
+        texts.push_back(text.substr(i, i % 977));
+    }
+    vector<vector<MinBpeCC::Tokenizer::Token>> expected;
+    for(const auto &part: texts) {
+        expected.push_back(t.encode(part, false));
+    }
+
+    for(size_t threads: {1, 4}) {
+        t.set_threads(threads);
+        auto encoded = t.encode_batch(texts);
+        REQUIRE( encoded == expected );
+
+        auto flat = t.encode_batch_flat(texts);
+        REQUIRE( flat.size() == texts.size() );
+        for(size_t i = 0; i < texts.size(); i++) {
+            REQUIRE( vector<MinBpeCC::Tokenizer::Token>(flat[i].begin(), flat[i].end()) == expected[i] );
+        }
+
+        REQUIRE( t.decode_batch(encoded) == texts );
+        REQUIRE( t.decode_batch(flat) == texts );
+    }
+    REQUIRE( t.encode_batch({}).empty() );
+    REQUIRE( t.encode_batch_flat({}).size() == 0 );
+    REQUIRE( t.decode_batch(t.encode_batch_flat({})).empty() );
+
+    SECTION("offsets that do not cover the tokens in order are refused") {
+        auto flat = t.encode_batch_flat(texts);
+        REQUIRE( flat.is_valid() );
+        auto n = flat.tokens.size();
+        for(const auto &offsets: {vector<size_t>{0, n, 1, n}, vector<size_t>{1, n}, vector<size_t>{0, n + 1},
+                                  vector<size_t>{0, n - 1}, vector<size_t>{}}) {
+            MinBpeCC::Tokenizer::EncodedBatch bad{flat.tokens, offsets};
+            REQUIRE( !bad.is_valid() );
+            REQUIRE_THROWS_AS( t.decode_batch(bad), std::invalid_argument );
+        }
+    }
+}
+
+TEST_CASE("Large texts encode the same on several threads", "[tokenizer]") {
+    string sample = "Some words, some  spaces  \n\n  and 1234 numbers!\nAnother line <|endoftext|> ends\n";
+    string text;
+    while(text.size() < 400000) {
+        text += sample + std::to_string(text.size()) + "   \n";
+    }
+    for(const auto &pattern: {Tokenizer::GPT2_SPLIT_PATTERN, Tokenizer::GPT4_SPLIT_PATTERN, string()}) {
+        Tokenizer t(pattern);
+        t.set_special_tokens_from_file("<|endoftext|> 100257\n");
+        t.train(sample + sample, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+        auto serial = t.encode(text, false);
+        t.set_threads(4);
+        REQUIRE( t.encode(text, false) == serial );
+        REQUIRE( t.decode(serial, false) == text );
+    }
+}
+
+TEST_CASE("Streams encode the same as the whole text", "[tokenizer]") {
+    string sample = "Some words, some  spaces  \n\n  and 1234 numbers!\n<|endoftext|>Another line <|endoftext|>\n"
+                    "  <|end|> ends\n\n<|endoftext|>  \n";
+    string text;
+    for(int i = 0; text.size() < 200000; i++) {
+        text += sample.substr(0, i % sample.size()) + std::to_string(i) + "\n";
+    }
+    // Without newlines the gpt2 and gpt4 patterns can only be cut between words
+    string line;
+    for(int i = 0; line.size() < 200000; i++) {
+        line += "word" + std::to_string(i % 10) + (i % 3 == 0 ? ", and more " : " then some  ");
+    }
+    for(const auto &pattern: {Tokenizer::GPT2_SPLIT_PATTERN, Tokenizer::GPT4_SPLIT_PATTERN, string()}) {
+        for(const auto &specials: {string(), string("<|endoftext|> 100257\n<|end|> 100258\n")}) {
+            Tokenizer t(pattern);
+            t.set_special_tokens_from_file(specials);
+            t.train(sample + sample + line.substr(0, 200), 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+            for(const auto &input: {text, line}) {
+                auto expected = t.encode(input, false);
+                for(size_t threads: {1, 4}) {
+                    t.set_threads(threads);
+                    // The largest blocks are enough to be encoded on several threads
+                    for(size_t block_size: {1, 7, 100, 1 << 16, 150000}) {
+                        std::istringstream in(input);
+                        vector<MinBpeCC::Tokenizer::Token> streamed;
+                        size_t writes = 0;
+                        t.encode_stream(in, [&](std::span<const MinBpeCC::Tokenizer::Token> tokens) {
+                            streamed.insert(streamed.end(), tokens.begin(), tokens.end());
+                            writes++;
+                        }, block_size);
+                        REQUIRE( streamed == expected );
+                        // Each block is encoded as soon as it is read rather than held back
+                        if(!pattern.empty() && block_size == 1 << 16) {
+                            REQUIRE( writes >= input.size() / block_size );
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("Special token scanner finds the leftmost longest token", "[special]") {
+    // Tokens that are prefixes, suffixes and overlaps of each other, first with a shared first
+    // byte as in chat formats and then without
+    vector<vector<pair<string, int>>> token_sets = {
+        {{"<|a|>", 1}, {"<|ab|>", 2}, {"<|a", 3}, {"<|b", 4}, {"<|", 5}, {"<<|b|>", 6}},
+        {{"ab", 1}, {"abcd", 2}, {"bc", 3}, {"c", 4}, {"dab", 5}, {"bcda", 6}},
+    };
+    std::mt19937 rng(42);
+    for(const auto &tokens: token_sets) {
+        SpecialTokenScanner<int> scanner;
+        scanner.build(tokens);
+        string alphabet;
+        for(const auto &[token, id]: tokens) {
+            alphabet += token;
+        }
+        alphabet += "xy ";
+        for(int round = 0; round < 2000; round++) {
+            string text;
+            for(size_t length = rng() % 30; text.size() < length;) {
+                text += alphabet[rng() % alphabet.size()];
+            }
+            size_t pos = rng() % (text.size() + 1);
+
+            // The earliest start, then the longest token starting there
+            std::optional<SpecialTokenScanner<int>::Match> expected;
+            for(const auto &[token, id]: tokens) {
+                auto p = text.find(token, pos);
+                if(p != string::npos && (!expected || p < expected->position ||
+                      (p == expected->position && token.size() > expected->length))) {
+                    expected = SpecialTokenScanner<int>::Match{p, token.size(), id};
+                }
+            }
+            auto found = scanner.find(text, pos);
+            REQUIRE( found.has_value() == expected.has_value() );
+            if(found) {
+                REQUIRE( found->position == expected->position );
+                REQUIRE( found->length == expected->length );
+                REQUIRE( found->token == expected->token );
+            }
+        }
+    }
+
+    SpecialTokenScanner<int> empty;
+    empty.build(vector<pair<string, int>>{});
+    REQUIRE( empty.empty() );
+    REQUIRE( !empty.find("<|a|>", 0).has_value() );
+}
+
+TEST_CASE("Split on special returns views of the text", "[special]") {
+    Tokenizer t;
+    t.set_special_tokens_from_file("<|endoftext|> 100257\n<|end|> 100258\n");
+    string text = "hello <|endoftext|><|end|> world<|end";
+    auto parts = t.split_on_special(text);
+    REQUIRE( parts.size() == 4 );
+    REQUIRE( parts[0].text == "hello " );
+    REQUIRE( !parts[0].special );
+    REQUIRE( parts[1].text == "<|endoftext|>" );
+    REQUIRE( parts[1].special == 100257u );
+    REQUIRE( parts[2].text == "<|end|>" );
+    REQUIRE( parts[2].special == 100258u );
+    REQUIRE( parts[3].text == " world<|end" );
+    REQUIRE( !parts[3].special );
+    for(const auto &part: parts) {
+        REQUIRE( part.text.data() >= text.data() );
+        REQUIRE( part.text.data() + part.text.size() <= text.data() + text.size() );
+    }
+    REQUIRE( t.split_on_special("").empty() );
+    REQUIRE( t.encode("<|end|><|endoftext|>", false) == vector<MinBpeCC::Tokenizer::Token>{100258, 100257} );
+    REQUIRE( t.decode(t.encode(text, false), false) == text );
+}
+
+// Reads a file from the repository's data folder, looking up from the working directory, or
+// returns an empty string if it cannot be found
+static string read_data_file(const string &name) {
+    std::filesystem::path dir = std::filesystem::current_path();
+    for(int up = 0; up < 4; up++, dir = dir.parent_path()) {
+        std::ifstream in(dir / "data" / name, std::ios::binary);
+        if(in) {
+            return string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+    }
+    return "";
+}
+
+// Splits text with PCRE2, the reference for the pre-tokenizer
+static vector<std::string_view> pcre2_split(const string &pattern, std::string_view text) {
+    MinBpeCC::Tokenizer::Model model(pattern);
+    MinBpeCC::Tokenizer::Matcher matcher(model.get_compiled_pattern());
+    vector<std::string_view> matches;
+    matcher.find_matches(model.get_compiled_pattern(), text, 0, text.size(), matches);
+    return matches;
+}
+
+static vector<std::string_view> pre_tokenizer_split(SplitPattern split_pattern, std::string_view text) {
+    vector<std::string_view> matches;
+    PreTokenizer(split_pattern).find_matches(text, 0, text.size(), matches);
+    return matches;
+}
+
+TEST_CASE("Pre-tokenizer classifies code points as PCRE2 does", "[pretokenizer]") {
+    vector<pair<string, CharClass>> classes = {
+        {"\\p{L}", CharClass::Letter}, {"\\p{N}", CharClass::Number}, {"\\s", CharClass::Space}};
+    vector<std::unique_ptr<MinBpeCC::Tokenizer::Model>> models;
+    vector<MinBpeCC::Tokenizer::Matcher> matchers;
+    for(const auto &[pattern, char_class]: classes) {
+        models.push_back(std::make_unique<MinBpeCC::Tokenizer::Model>(pattern));
+        matchers.emplace_back(models.back()->get_compiled_pattern());
+    }
+    size_t mismatches = 0;
+    vector<std::string_view> matches;
+    for(uint32_t code_point = 0; code_point < 0x110000; code_point++) {
+        if(code_point >= 0xD800 && code_point <= 0xDFFF) {
+            continue;
+        }
+        string text;
+        if(code_point < 0x80) {
+            text += static_cast<char>(code_point);
+        } else if(code_point < 0x800) {
+            text += static_cast<char>(0xC0 | (code_point >> 6));
+            text += static_cast<char>(0x80 | (code_point & 0x3F));
+        } else if(code_point < 0x10000) {
+            text += static_cast<char>(0xE0 | (code_point >> 12));
+            text += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            text += static_cast<char>(0x80 | (code_point & 0x3F));
+        } else {
+            text += static_cast<char>(0xF0 | (code_point >> 18));
+            text += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+            text += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+            text += static_cast<char>(0x80 | (code_point & 0x3F));
+        }
+        auto expected = CharClass::Other;
+        for(size_t i = 0; i < classes.size(); i++) {
+            matches.clear();
+            matchers[i].find_matches(models[i]->get_compiled_pattern(), text, 0, text.size(), matches);
+            if(!matches.empty()) {
+                expected = classes[i].second;
+                break;
+            }
+        }
+        if(PreTokenizer::class_of(code_point) != expected) {
+            mismatches++;
+        }
+    }
+    REQUIRE( mismatches == 0 );
+}
+
+TEST_CASE("Pre-tokenizer splits like the gpt2 and gpt4 regex", "[pretokenizer]") {
+    // Characters around the edges of each alternative: contractions with the caseless forms
+    // gpt4 allows, including U+017F, letters, numbers and spaces from outside ASCII, and
+    // characters that are none of them such as emoji, combining marks and U+0085
+    vector<string> pieces = {"'", "s", "S", "t", "d", "m", "l", "L", "v", "e", "E", "r", "\xC5\xBF", "a", "Z",
+        "0", "7", " ", "  ", "\t", "\r", "\n", "\r\n", "\x0B", "\x0C", "!", ".", "(", "_", "-",
+        "\xC3\xA9", "\xD0\xB6", "\xE4\xB8\xAD", "\xD9\xA3", "\xC2\xBD", "\xC2\xB2", "\xC2\xA0",
+        "\xE3\x80\x80", "\xC2\x85", "\xE1\xA0\x8E", "\xE2\x80\xA8", "\xF0\x9F\x98\x80", "\xCC\x81",
+        "\xF0\x90\x8C\xB0"};
+    std::mt19937 rng(7);
+    vector<string> texts;
+    for(int round = 0; round < 5000; round++) {
+        string text;
+        for(size_t count = rng() % 24; count > 0; count--) {
+            text += pieces[rng() % pieces.size()];
+        }
+        texts.push_back(text);
+    }
+    for(const auto &name: {"taylorswift.txt", "shakespeare.txt", "sample.txt", "small.txt", "specialtokensample.txt"}) {
+        auto text = read_data_file(name);
+        if(text.empty()) {
+            WARN("Could not find data/" << name);
+        }
+        texts.push_back(text);
+    }
+
+    for(const auto &[pattern, split_pattern]: {pair{Tokenizer::GPT2_SPLIT_PATTERN, SplitPattern::GPT2},
+          pair{Tokenizer::GPT4_SPLIT_PATTERN, SplitPattern::GPT4}}) {
+        size_t mismatches = 0;
+        for(const auto &text: texts) {
+            if(pre_tokenizer_split(split_pattern, text) != pcre2_split(pattern, text)) {
+                UNSCOPED_INFO("Split differs from PCRE2 for \"" << text.substr(0, 200) << "\"");
+                mismatches++;
+            }
+        }
+        REQUIRE( mismatches == 0 );
+    }
+}
+
+TEST_CASE("Pre-tokenizer throughput", "[.][benchmark]") {
+    auto text = read_data_file("shakespeare.txt");
+    for(const auto &[pattern, split_pattern]: {pair{Tokenizer::GPT2_SPLIT_PATTERN, SplitPattern::GPT2},
+          pair{Tokenizer::GPT4_SPLIT_PATTERN, SplitPattern::GPT4}}) {
+        MinBpeCC::Tokenizer::Model model(pattern);
+        MinBpeCC::Tokenizer::Matcher matcher(model.get_compiled_pattern());
+        PreTokenizer pre_tokenizer(split_pattern);
+        string name = split_pattern == SplitPattern::GPT2 ? "gpt2" : "gpt4";
+        BENCHMARK("PCRE2 " + name) {
+            vector<std::string_view> matches;
+            matcher.find_matches(model.get_compiled_pattern(), text, 0, text.size(), matches);
+            return matches.size();
+        };
+        BENCHMARK("Pre-tokenizer " + name) {
+            vector<std::string_view> matches;
+            pre_tokenizer.find_matches(text, 0, text.size(), matches);
+            return matches.size();
+        };
+    }
+}
+
+TEST_CASE("UTF-8 validation finds the first invalid byte", "[utf8]") {
+    using MinBpeCC::Util::find_invalid_utf8;
+    using MinBpeCC::Util::find_invalid_utf8_scalar;
+    auto npos = std::string_view::npos;
+    REQUIRE( find_invalid_utf8("") == npos );
+    REQUIRE( find_invalid_utf8("plain ascii") == npos );
+    REQUIRE( find_invalid_utf8("caf\xC3\xA9 \xE4\xB8\xAD \xF0\x9F\x98\x80 \xF4\x8F\xBF\xBF") == npos );
+    REQUIRE( find_invalid_utf8("ab\x80") == 2 );             // Lone continuation
+    REQUIRE( find_invalid_utf8("ab\xC0\xAF") == 2 );         // Overlong
+    REQUIRE( find_invalid_utf8("ab\xE0\x80\xAF") == 2 );     // Overlong
+    REQUIRE( find_invalid_utf8("ab\xED\xA0\x80") == 2 );     // Surrogate
+    REQUIRE( find_invalid_utf8("ab\xF4\x90\x80\x80") == 2 ); // Above U+10FFFF
+    REQUIRE( find_invalid_utf8("ab\xF5\x80\x80\x80") == 2 );
+    REQUIRE( find_invalid_utf8("ab\xE4\xB8") == 2 );         // Cut off at the end
+    REQUIRE( find_invalid_utf8("ab\xE4\xB8x") == 2 );        // Too short
+
+    // The checks for every instruction set this CPU has agree with the scalar one on random
+    // mixes of valid and invalid sequences, placed across every offset of the vectors
+    using MinBpeCC::Util::SimdLevel;
+    vector<SimdLevel> levels{SimdLevel::Scalar, MinBpeCC::Util::simd_level()};
+    if(levels.back() == SimdLevel::AVX2) {
+        levels.push_back(SimdLevel::SSE2);
+    }
+    vector<string> pieces = {"a", " ", "\n", "\xC3\xA9", "\xE4\xB8\xAD", "\xF0\x9F\x98\x80", "\x80", "\xBF",
+        "\xC0", "\xC3", "\xE4\xB8", "\xF0\x9F\x98", "\xED\xA0\x80", "\xF8", "\xFF"};
+    std::mt19937 rng(3);
+    for(int round = 0; round < 20000; round++) {
+        string text(rng() % 70, 'x');
+        for(size_t count = rng() % 4; count > 0; count--) {
+            text.insert(rng() % (text.size() + 1), pieces[rng() % pieces.size()]);
+        }
+        auto expected = find_invalid_utf8_scalar(text);
+        for(auto level : levels) {
+            REQUIRE( find_invalid_utf8(text, level) == expected );
+        }
+    }
+}
+
+TEST_CASE("Invalid UTF-8 is replaced as the Unicode standard recommends", "[utf8]") {
+    using MinBpeCC::Util::replace_invalid_utf8;
+    string replacement = "\xEF\xBF\xBD";
+    REQUIRE( replace_invalid_utf8("valid \xE4\xB8\xAD") == "valid \xE4\xB8\xAD" );
+    REQUIRE( replace_invalid_utf8("a\xF1\x80\x80\xE1\x80\xC2\x62\x80\x63\x80\xBF\x64") ==
+        "a" + replacement + replacement + replacement + "b" + replacement + "c" + replacement + replacement + "d" );
+    REQUIRE( replace_invalid_utf8("end\xF0\x9F\x98") == "end" + replacement );
+}
+
+TEST_CASE("Invalid UTF-8 is rejected, replaced or kept raw", "[utf8]") {
+    string sample = "Some words, some  spaces\n<|endoftext|> and caf\xC3\xA9 1234!\n";
+    string invalid = "Bad \xC3 byte\xFF\xFE and <|endoftext|>\xE4\xB8 cut \x80\x80off\n";
+    string text;
+    for(int i = 0; text.size() < 20000; i++) {
+        text += (i % 7 == 3 ? invalid : sample) + std::to_string(i) + "\n";
+    }
+    string replaced = MinBpeCC::Util::replace_invalid_utf8(text);
+    for(const auto &pattern: {Tokenizer::GPT2_SPLIT_PATTERN, Tokenizer::GPT4_SPLIT_PATTERN, string("\\S+|\\s+"), string()}) {
+        Tokenizer t(pattern);
+        t.set_special_tokens_from_file("<|endoftext|> 100257\n");
+        t.train(sample + sample, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+
+        auto encode_streamed = [&](size_t block_size) {
+            std::istringstream in(text);
+            vector<MinBpeCC::Tokenizer::Token> streamed;
+            t.encode_stream(in, [&](std::span<const MinBpeCC::Tokenizer::Token> tokens) {
+                streamed.insert(streamed.end(), tokens.begin(), tokens.end());
+            }, block_size);
+            return streamed;
+        };
+
+        t.set_invalid_utf8(InvalidUtf8::Reject);
+        REQUIRE_THROWS_AS( t.encode(text, false), std::runtime_error );
+        REQUIRE_THROWS_AS( encode_streamed(100), std::runtime_error );
+        REQUIRE_THROWS_AS( t.train(text, 300, Tokenizer::CONFLICT_RESOLUTION::FIRST, false), std::runtime_error );
+        REQUIRE_NOTHROW( t.encode(replaced, false) );
+
+        t.set_invalid_utf8(InvalidUtf8::Replace);
+        auto encoded = t.encode(text, false);
+        REQUIRE( encoded == t.encode(replaced, false) );
+        REQUIRE( t.decode(encoded, false) == replaced );
+        for(size_t block_size: {1, 7, 100, 1 << 16}) {
+            REQUIRE( encode_streamed(block_size) == encoded );
+        }
+
+        t.set_invalid_utf8(InvalidUtf8::Raw);
+        encoded = t.encode(text, false);
+        REQUIRE( t.decode(encoded, false) == text );
+        for(size_t block_size: {1, 7, 100, 1 << 16}) {
+            REQUIRE( encode_streamed(block_size) == encoded );
+        }
+        t.set_threads(4);
+        REQUIRE( t.encode(text, false) == encoded );
+        REQUIRE( t.encode_batch(vector<string>{text, sample})[0] == encoded );
+        t.set_threads(1);
+    }
+
+    // Training keeps each run of invalid bytes as a chunk of its own
+    Tokenizer t(Tokenizer::GPT4_SPLIT_PATTERN);
+    t.train(text, 400, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    REQUIRE( t.decode(t.encode(text, false), false) == text );
+}
+
+TEST_CASE("UTF-8 validation throughput", "[.][benchmark]") {
+    auto ascii = read_data_file("shakespeare.txt");
+    string mixed;
+    while(mixed.size() < ascii.size()) {
+        mixed += "Mixed text caf\xC3\xA9 \xE4\xB8\xAD\xE6\x96\x87 \xD0\xB6\xD0\xB8\xD0\xB7\xD0\xBD\xD1\x8C \xF0\x9F\x98\x80\n";
+    }
+    for(const auto &[name, text]: {pair{string("ascii"), ascii}, pair{string("mixed"), mixed}}) {
+        BENCHMARK("Scalar " + name) {
+            return MinBpeCC::Util::find_invalid_utf8_scalar(text);
+        };
+        BENCHMARK("Vector " + name) {
+            return MinBpeCC::Util::find_invalid_utf8(text);
+        };
+    }
+}
+
+TEST_CASE("Byte kernels agree with the scalar versions", "[simd]") {
+    using MinBpeCC::Util::SimdLevel;
+    using MinBpeCC::Util::byte_kernels;
+    vector<SimdLevel> levels{SimdLevel::Scalar, MinBpeCC::Util::simd_level()};
+    if(levels.back() == SimdLevel::AVX2) {
+        levels.push_back(SimdLevel::SSE2);
+    }
+    std::mt19937 rng(23);
+    for(int i = 0; i < 2000; i++) {
+        // Mostly ASCII, so there are runs long enough for the vector loops
+        string text(rng() % 100, ' ');
+        for(auto &c : text) {
+            c = static_cast<char>(rng() % 16 == 0 ? rng() % 256 : rng() % 128);
+        }
+        size_t ascii_length = 0;
+        while(ascii_length < text.size() && static_cast<uint8_t>(text[ascii_length]) < 0x80) {
+            ascii_length++;
+        }
+        for(auto level : levels) {
+            const auto &kernels = byte_kernels(level);
+            REQUIRE( kernels.level == level );
+            vector<uint16_t> widened_16(text.size());
+            vector<uint32_t> widened_32(text.size());
+            kernels.widen_to_16(text.data(), text.size(), widened_16.data());
+            kernels.widen_to_32(text.data(), text.size(), widened_32.data());
+            for(size_t j = 0; j < text.size(); j++) {
+                REQUIRE( widened_16[j] == static_cast<uint8_t>(text[j]) );
+                REQUIRE( widened_32[j] == static_cast<uint8_t>(text[j]) );
+            }
+            REQUIRE( kernels.ascii_prefix_length(text.data(), text.size()) == ascii_length );
+        }
+        auto bytes = reinterpret_cast<const uint8_t *>(text.data());
+        REQUIRE( MinBpeCC::Tokenizer::text_to_vector(text) ==
+            vector<MinBpeCC::Tokenizer::Token>(bytes, bytes + text.size()) );
+    }
+}
+
+TEST_CASE("ASCII class masks match the pre-tokenizer's classes", "[simd]") {
+    using MinBpeCC::Util::ascii_class_mask;
+    string bytes(256, ' ');
+    for(size_t c = 0; c < 256; c++) {
+        bytes[c] = static_cast<char>(c);
+    }
+    for(size_t start = 0; start < 256; start += 16) {
+        for(auto char_class : {CharClass::Other, CharClass::Letter, CharClass::Number, CharClass::Space}) {
+            uint32_t expected = 0;
+            for(size_t i = 0; i < 16; i++) {
+                if(start + i < 0x80 && PreTokenizer::class_of(static_cast<uint32_t>(start + i)) == char_class) {
+                    expected |= 1u << i;
+                }
+            }
+            REQUIRE( ascii_class_mask(bytes.data() + start, char_class) == expected );
+        }
+    }
+}
+
+TEST_CASE("Byte widening throughput", "[.][benchmark]") {
+    auto text = read_data_file("shakespeare.txt");
+    vector<MinBpeCC::Tokenizer::Token> tokens(text.size());
+    BENCHMARK("Scalar widening") {
+        MinBpeCC::Util::byte_kernels(MinBpeCC::Util::SimdLevel::Scalar).widen_to_32(text.data(), text.size(), tokens.data());
+        return tokens.back();
+    };
+    BENCHMARK("Push back widening") {
+        // As text_to_vector did before the kernels
+        vector<MinBpeCC::Tokenizer::Token> pushed;
+        pushed.reserve(text.size());
+        for(char c : text) {
+            pushed.push_back(MinBpeCC::Tokenizer::char_to_token(c));
+        }
+        return pushed.back();
+    };
+    BENCHMARK("Vector widening") {
+        MinBpeCC::Util::widen_bytes(text, tokens.data());
+        return tokens.back();
+    };
+    BENCHMARK("Scalar ASCII prefix") {
+        return MinBpeCC::Util::byte_kernels(MinBpeCC::Util::SimdLevel::Scalar).ascii_prefix_length(text.data(), text.size());
+    };
+    BENCHMARK("Vector ASCII prefix") {
+        return MinBpeCC::Util::ascii_prefix_length(text);
+    };
+}
+
+TEST_CASE("Decode throughput", "[.][benchmark]") {
+    auto text = read_data_file("shakespeare.txt");
+    Tokenizer t(Tokenizer::GPT4_SPLIT_PATTERN);
+    t.train(text.substr(0, 200000), 2000, Tokenizer::CONFLICT_RESOLUTION::FIRST, false);
+    auto tokens = t.encode(text, false);
+    BENCHMARK("Decode " + std::to_string(tokens.size()) + " tokens") {
+        return t.decode(tokens, false);
+    };
+}